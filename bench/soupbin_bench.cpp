@@ -0,0 +1,554 @@
+/***
+ * Benchmarks: the packet codec, NUMERIC fields, framing, and a server
+ * publishing to clients over loopback.
+ *
+ * The results are machine readable with --benchmark_format=json (or
+ * --benchmark_out=file.json), for comparing builds.
+ */
+#include "soup_bin_server.h"
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+std::vector<unsigned char> payload(size_t length)
+{
+    std::vector<unsigned char> result(length);
+    for(size_t i = 0; i < length; ++i)
+        result[i] = 'a' + i % 26;
+    return result;
+}
+
+/***
+ * Packets with a payload after the fixed part
+ */
+template<typename PACKET>
+constexpr bool has_payload = std::is_same_v<PACKET, soupbintcp::sequenced_data>
+        || std::is_same_v<PACKET, soupbintcp::unsequenced_data> || std::is_same_v<PACKET, soupbintcp::debug_packet>;
+
+template<soupbintcp::message_record MR, typename PACKET>
+void write_field(PACKET& msg)
+{
+    if constexpr (MR.offset < 3)
+        return; // the length and type are already there
+    else if constexpr (MR.type == soupbintcp::message_record::field_type::ALPHA)
+        msg.template set_string<MR>("ABCDEF");
+    else
+        msg.template set_int<MR>(123456789);
+}
+
+template<soupbintcp::message_record MR, typename VIEW>
+void read_field(const VIEW& view)
+{
+    if constexpr (MR.type == soupbintcp::message_record::field_type::ALPHA)
+        benchmark::DoNotOptimize(view.template get_string<MR>());
+    else
+        benchmark::DoNotOptimize(view.template get_int<MR>());
+}
+
+template<typename PACKET, size_t... I>
+void write_fields(PACKET& msg, std::index_sequence<I...>)
+{
+    (write_field<PACKET::fields[I]>(msg), ...);
+}
+
+template<typename PACKET, size_t... I>
+void read_fields(const soupbintcp::message_view<PACKET>& view, std::index_sequence<I...>)
+{
+    (read_field<PACKET::fields[I]>(view), ...);
+}
+
+/***
+ * Build a packet and set every field (and a 64 byte payload, if it has one)
+ */
+template<typename PACKET>
+void BM_Encode(benchmark::State& state)
+{
+    std::vector<unsigned char> body = payload(64);
+    for(auto _ : state)
+    {
+        PACKET msg;
+        write_fields(msg, std::make_index_sequence<PACKET::fields.size()>());
+        if constexpr (has_payload<PACKET>)
+            msg.set_message(std::span<const unsigned char>(body));
+        benchmark::DoNotOptimize(msg.get_record());
+        benchmark::ClobberMemory();
+    }
+}
+
+/***
+ * Read every field of a packet through a view (and the payload, if it has one)
+ */
+template<typename PACKET>
+void BM_Decode(benchmark::State& state)
+{
+    PACKET msg;
+    write_fields(msg, std::make_index_sequence<PACKET::fields.size()>());
+    if constexpr (has_payload<PACKET>)
+        msg.set_message(payload(64));
+    for(auto _ : state)
+    {
+        soupbintcp::message_view<PACKET> view(msg.get_record());
+        read_fields(view, std::make_index_sequence<PACKET::fields.size()>());
+        if constexpr (has_payload<PACKET>)
+            benchmark::DoNotOptimize(view.get_message());
+    }
+}
+
+BENCHMARK_TEMPLATE(BM_Encode, soupbintcp::debug_packet);
+BENCHMARK_TEMPLATE(BM_Encode, soupbintcp::login_accepted);
+BENCHMARK_TEMPLATE(BM_Encode, soupbintcp::login_rejected);
+BENCHMARK_TEMPLATE(BM_Encode, soupbintcp::sequenced_data);
+BENCHMARK_TEMPLATE(BM_Encode, soupbintcp::server_heartbeat);
+BENCHMARK_TEMPLATE(BM_Encode, soupbintcp::end_of_session);
+BENCHMARK_TEMPLATE(BM_Encode, soupbintcp::login_request);
+BENCHMARK_TEMPLATE(BM_Encode, soupbintcp::unsequenced_data);
+BENCHMARK_TEMPLATE(BM_Encode, soupbintcp::client_heartbeat);
+BENCHMARK_TEMPLATE(BM_Encode, soupbintcp::logout_request);
+BENCHMARK_TEMPLATE(BM_Decode, soupbintcp::debug_packet);
+BENCHMARK_TEMPLATE(BM_Decode, soupbintcp::login_accepted);
+BENCHMARK_TEMPLATE(BM_Decode, soupbintcp::login_rejected);
+BENCHMARK_TEMPLATE(BM_Decode, soupbintcp::sequenced_data);
+BENCHMARK_TEMPLATE(BM_Decode, soupbintcp::server_heartbeat);
+BENCHMARK_TEMPLATE(BM_Decode, soupbintcp::end_of_session);
+BENCHMARK_TEMPLATE(BM_Decode, soupbintcp::login_request);
+BENCHMARK_TEMPLATE(BM_Decode, soupbintcp::unsequenced_data);
+BENCHMARK_TEMPLATE(BM_Decode, soupbintcp::client_heartbeat);
+BENCHMARK_TEMPLATE(BM_Decode, soupbintcp::logout_request);
+
+/***
+ * A 20 digit NUMERIC field (a sequence number), arg = the value
+ */
+void BM_NumericEncode(benchmark::State& state)
+{
+    unsigned char field[20];
+    uint64_t value = state.range(0);
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(soupbintcp::encode_numeric(field, sizeof(field), value));
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_NumericEncode)->Arg(7)->Arg(123456789)->Arg(1234567890123456789);
+
+void BM_NumericDecode(benchmark::State& state)
+{
+    unsigned char field[20];
+    soupbintcp::encode_numeric(field, sizeof(field), state.range(0));
+    for(auto _ : state)
+    {
+        uint64_t value;
+        benchmark::DoNotOptimize(soupbintcp::decode_numeric(field, sizeof(field), value));
+        benchmark::DoNotOptimize(value);
+    }
+}
+BENCHMARK(BM_NumericDecode)->Arg(7)->Arg(123456789)->Arg(1234567890123456789);
+
+/***
+ * arg = the payload size
+ */
+void BM_SetMessage(benchmark::State& state)
+{
+    std::vector<unsigned char> body = payload(state.range(0));
+    soupbintcp::sequenced_data msg;
+    for(auto _ : state)
+    {
+        msg.set_message(std::span<const unsigned char>(body));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * body.size());
+}
+BENCHMARK(BM_SetMessage)->Arg(8)->Arg(64)->Arg(512)->Arg(4096);
+
+void BM_GetMessage(benchmark::State& state)
+{
+    soupbintcp::sequenced_data msg;
+    msg.set_message(payload(state.range(0)));
+    for(auto _ : state)
+        benchmark::DoNotOptimize(msg.get_message());
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_GetMessage)->Arg(8)->Arg(64)->Arg(512)->Arg(4096);
+
+/***
+ * Header plus body into a shared buffer, arg = the payload size
+ */
+void BM_MakeFrame(benchmark::State& state)
+{
+    std::vector<unsigned char> body = payload(state.range(0));
+    for(auto _ : state)
+        benchmark::DoNotOptimize(soupbintcp::make_frame('S', body));
+    state.SetBytesProcessed(state.iterations() * body.size());
+}
+BENCHMARK(BM_MakeFrame)->Arg(8)->Arg(64)->Arg(512)->Arg(4096);
+
+/***
+ * Frame a receive full of packets, args = the payload size, packets per receive
+ */
+void BM_ReceiveFraming(benchmark::State& state)
+{
+    std::vector<unsigned char> body = payload(state.range(0));
+    std::vector<unsigned char> wire;
+    for(int64_t i = 0; i < state.range(1); ++i)
+    {
+        soupbintcp::buffer_slice frame = soupbintcp::make_frame('S', body);
+        wire.insert(wire.end(), frame.data(), frame.data() + frame.size());
+    }
+    soupbintcp::receive_buffer incoming;
+    for(auto _ : state)
+    {
+        std::span<unsigned char> space = incoming.free_space();
+        memcpy(space.data(), wire.data(), wire.size());
+        incoming.commit(wire.size());
+        while(const unsigned char* packet = incoming.next_packet())
+            benchmark::DoNotOptimize(packet);
+        incoming.compact();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+    state.SetBytesProcessed(state.iterations() * wire.size());
+}
+BENCHMARK(BM_ReceiveFraming)->Args({8, 64})->Args({64, 64})->Args({512, 16});
+
+uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/***
+ * Records how long each sequenced message took to arrive. The payload starts
+ * with the time it was published
+ */
+class LoopbackConnection final : public SoupBinStaticConnection<LoopbackConnection>
+{
+    public:
+    LoopbackConnection(boost::asio::ip::tcp::socket socket, MessageRepeater* parent)
+            : SoupBinStaticConnection(std::move(socket), parent) {}
+    LoopbackConnection(const std::string& url, size_t expected, const PollOptions& pollOptions,
+            const TransportOptions& transportOptions)
+            : SoupBinStaticConnection(url, "bench", "bench", "", 0, false)
+    {
+        latencies.reserve(expected);
+        set_poll_options(pollOptions);
+        set_transport_options(transportOptions);
+        SocketOptions socketOptions;
+        socketOptions.noDelay = true;
+        set_socket_options(socketOptions);
+        connect();
+    }
+    void on_login_accepted(const soupbintcp::login_accepted_view& in)
+    {
+        status = Status::CONNECTED;
+        loggedIn.store(true, std::memory_order_release);
+    }
+    void on_sequenced_data(const soupbintcp::sequenced_data_view& in)
+    {
+        uint64_t received = now_ns();
+        uint64_t sent;
+        memcpy(&sent, in.get_message().data(), sizeof(sent));
+        latencies.push_back(received - sent);
+        bytes += in.get_record_length();
+        count.store(latencies.size(), std::memory_order_release);
+    }
+    std::atomic<bool> loggedIn = false;
+    std::vector<uint64_t> latencies; // ns, on the client's thread until count says otherwise
+    uint64_t bytes = 0;
+    std::atomic<size_t> count = 0;
+};
+
+/***
+ * System calls made by this thread and every thread it starts from now on,
+ * whichever way they get to the kernel. Through the raw_syscalls tracepoint,
+ * which needs tracefs and perf_event_paranoid <= 1 (or CAP_PERFMON)
+ */
+class SyscallCounter
+{
+    public:
+    SyscallCounter()
+    {
+        uint64_t id = 0;
+        for(const char* path : { "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id" })
+        {
+            std::ifstream in(path);
+            if (in >> id)
+                break;
+        }
+        if (id == 0)
+            return;
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = sizeof(attr);
+        attr.config = id;
+        attr.inherit = 1; // the server's and the clients' threads too
+        fd = ::syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~SyscallCounter()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+    bool is_available() const { return fd >= 0; }
+    /***
+     * @returns the count so far, including the threads that are still running
+     */
+    uint64_t get() const
+    {
+        uint64_t count = 0;
+        if (fd < 0 || ::read(fd, &count, sizeof(count)) != sizeof(count))
+            return 0;
+        return count;
+    }
+
+    private:
+    int fd = -1;
+};
+
+/***
+ * @returns the context switches of every thread in the process so far
+ */
+static uint64_t context_switches()
+{
+    rusage usage;
+    if (::getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+/***
+ * A server and its clients, logged in and ready
+ */
+struct Loopback
+{
+    Loopback(size_t clients, size_t expected, const SoupBinConnection::PollOptions& pollOptions = {},
+            const SoupBinConnection::TransportOptions& transportOptions = {})
+            : port(nextPort++), uring(transportOptions.backend == SoupBinConnection::TransportOptions::Backend::IO_URING)
+    {
+        SoupBinConnection::SocketOptions socketOptions;
+        socketOptions.noDelay = true;
+        SoupBinServerOptions serverOptions;
+        serverOptions.transport = transportOptions;
+        if (transportOptions.backend == SoupBinConnection::TransportOptions::Backend::SHARED_MEMORY)
+            serverOptions.sharedMemory.name = "soupbin-bench-" + std::to_string(port);
+        server = std::make_unique<SoupBinServer<LoopbackConnection>>(port, serverOptions);
+        server->set_socket_options(socketOptions);
+        for(size_t i = 0; i < clients; ++i)
+            connections.push_back(std::make_unique<LoopbackConnection>("127.0.0.1:" + std::to_string(port), expected,
+                    pollOptions, transportOptions));
+        for(auto& conn : connections)
+            while(!conn->loggedIn.load(std::memory_order_acquire))
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        // the switch to the shared ring comes just after the login
+        auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        if (transportOptions.backend == SoupBinConnection::TransportOptions::Backend::SHARED_MEMORY)
+            for(auto& conn : connections)
+                while(!conn->is_using_shared_memory() && std::chrono::steady_clock::now() < giveUp)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ~Loopback()
+    {
+        connections.clear();
+        server.reset();
+    }
+    /***
+     * report() counts system calls and context switches from here
+     */
+    void start_counting()
+    {
+        syscallsAtStart = syscalls.get();
+        switchesAtStart = context_switches();
+    }
+    /***
+     * wait (up to a while) for every client to have count messages
+     */
+    bool wait_for(size_t count)
+    {
+        auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+        for(auto& conn : connections)
+            while(conn->count.load(std::memory_order_acquire) < count)
+            {
+                if (std::chrono::steady_clock::now() > giveUp)
+                    return false;
+                std::this_thread::yield();
+            }
+        return true;
+    }
+    /***
+     * msgs/s, bytes/s and the latency percentiles (us) of everything the clients got
+     */
+    void report(benchmark::State& state, double seconds)
+    {
+        std::vector<uint64_t> all;
+        uint64_t bytes = 0;
+        for(auto& conn : connections)
+        {
+            all.insert(all.end(), conn->latencies.begin(), conn->latencies.end());
+            bytes += conn->bytes;
+        }
+        if (all.empty())
+            return;
+        std::sort(all.begin(), all.end());
+        auto at = [&all](double pct) { return all[std::min(all.size() - 1, (size_t)(pct * all.size()))] / 1000.0; };
+        state.counters["msgs_per_sec"] = all.size() / seconds;
+        state.counters["bytes_per_sec"] = bytes / seconds;
+        state.counters["p50_us"] = at(0.50);
+        state.counters["p99_us"] = at(0.99);
+        state.counters["p99_9_us"] = at(0.999);
+        state.counters["max_us"] = all.back() / 1000.0;
+        // what it took to get them there: system calls of the whole process
+        // (publisher, server and clients, the same for every transport),
+        // context switches, and the clients' reads (of the socket or the shared ring)
+        if (syscalls.is_available())
+            state.counters["syscalls_per_msg"] = (double)(syscalls.get() - syscallsAtStart) / all.size();
+        state.counters["ctx_switches_per_msg"] = (double)(context_switches() - switchesAtStart) / all.size();
+        uint64_t receives = 0;
+        uint64_t enters = 0;
+        for(auto& conn : connections)
+        {
+            receives += conn->get_receive_count();
+            enters += conn->get_uring_enter_count();
+        }
+        state.counters["receives_per_msg"] = (double)receives / all.size();
+        // the clients' share of the system calls, where io_uring makes them few
+        if (uring)
+            state.counters["enters_per_msg"] = (double)enters / all.size();
+    }
+
+    static inline std::atomic<uint16_t> nextPort = 9200;
+    SyscallCounter syscalls; // before the server and the clients start their threads
+    uint16_t port;
+    bool uring;
+    uint64_t syscallsAtStart = 0;
+    uint64_t switchesAtStart = 0;
+    std::unique_ptr<SoupBinServer<LoopbackConnection>> server;
+    std::vector<std::unique_ptr<LoopbackConnection>> connections;
+};
+
+/***
+ * @param transport 0 for asio, 1 for io_uring, 2 for io_uring with sqPoll, 3 for shared memory
+ * @returns false if this system can not do it
+ */
+static bool transport_options(int64_t transport, SoupBinConnection::TransportOptions& options)
+{
+    if (transport == 1 || transport == 2)
+    {
+        if (!SoupBinUring::is_supported())
+            return false;
+        options.backend = SoupBinConnection::TransportOptions::Backend::IO_URING;
+        options.uring.sqPoll = (transport == 2);
+    }
+    else if (transport == 3)
+    {
+        options.backend = SoupBinConnection::TransportOptions::Backend::SHARED_MEMORY;
+    }
+    return true;
+}
+
+/***
+ * 1 server to N clients, args = clients, messages per second (0 = as fast as
+ * possible), payload size, and the transport (see transport_options). Latency
+ * is from publish to the client's handler
+ */
+void BM_Loopback(benchmark::State& state)
+{
+    const size_t clients = state.range(0);
+    const uint64_t rate = state.range(1);
+    const size_t size = std::max<size_t>(state.range(2), sizeof(uint64_t));
+    const size_t messages = (rate == 0 ? 100000 : std::min<uint64_t>(rate, 20000));
+    SoupBinConnection::TransportOptions transportOptions;
+    if (!transport_options(state.range(3), transportOptions))
+    {
+        state.SkipWithError("io_uring is not available here");
+        return;
+    }
+    for(auto _ : state)
+    {
+        state.PauseTiming();
+        auto loopback = std::make_unique<Loopback>(clients, messages, SoupBinConnection::PollOptions(), transportOptions);
+        std::vector<unsigned char> body = payload(size);
+        loopback->start_counting();
+        state.ResumeTiming();
+        auto start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < messages; ++i)
+        {
+            if (rate > 0)
+                std::this_thread::sleep_until(start + std::chrono::nanoseconds(i * 1000000000 / rate));
+            uint64_t sent = now_ns();
+            memcpy(body.data(), &sent, sizeof(sent));
+            loopback->server->send_sequenced(std::span<const unsigned char>(body));
+        }
+        if (!loopback->wait_for(messages))
+            state.SkipWithError("not every message arrived");
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        state.PauseTiming();
+        loopback->report(state, seconds);
+        loopback.reset();
+        state.ResumeTiming();
+    }
+}
+BENCHMARK(BM_Loopback)->ArgNames({"clients", "rate", "size", "transport"})
+        ->Args({1, 10000, 64, 0})->Args({4, 10000, 64, 0})->Args({16, 10000, 64, 0})
+        ->Args({1, 0, 64, 0})->Args({4, 0, 64, 0})->Args({16, 0, 64, 0})->Args({4, 0, 512, 0})
+        ->Args({4, 10000, 64, 1})->Args({4, 0, 64, 1})->Args({16, 0, 64, 1})
+        ->Args({4, 10000, 64, 3})->Args({4, 0, 64, 3})->Args({16, 0, 64, 3})
+        ->Iterations(1)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+/***
+ * 1 message at a time to 1 client, so each is measured on an idle link.
+ * args = 0 for a blocking client, 1 for busy polling (which needs a spare
+ * core), and the transport (see transport_options)
+ */
+void BM_Ping(benchmark::State& state)
+{
+    const size_t messages = 5000;
+    SoupBinConnection::PollOptions pollOptions;
+    if (state.range(0) == 1)
+        pollOptions.mode = SoupBinConnection::PollOptions::Mode::BUSY_POLL;
+    SoupBinConnection::TransportOptions transportOptions;
+    if (!transport_options(state.range(1), transportOptions))
+    {
+        state.SkipWithError("io_uring is not available here");
+        return;
+    }
+    for(auto _ : state)
+    {
+        state.PauseTiming();
+        auto loopback = std::make_unique<Loopback>(1, messages, pollOptions, transportOptions);
+        std::vector<unsigned char> body = payload(sizeof(uint64_t));
+        loopback->start_counting();
+        state.ResumeTiming();
+        auto start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < messages; ++i)
+        {
+            uint64_t sent = now_ns();
+            memcpy(body.data(), &sent, sizeof(sent));
+            loopback->server->send_sequenced(std::span<const unsigned char>(body));
+            if (!loopback->wait_for(i + 1))
+            {
+                state.SkipWithError("a message did not arrive");
+                break;
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        state.PauseTiming();
+        loopback->report(state, seconds);
+        loopback.reset();
+        state.ResumeTiming();
+    }
+}
+BENCHMARK(BM_Ping)->ArgNames({"busy_poll", "transport"})->ArgsProduct({{0, 1}, {0, 1, 2, 3}})
+        ->Iterations(1)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+} // end namespace
@@ -0,0 +1,149 @@
+#include "soup_bin_buffer_pool.h"
+#include <algorithm>
+#include <new>
+
+namespace soupbintcp {
+
+/***
+ * Owns the thread's pool. When the thread goes, buffers still out there free
+ * themselves as they come back, and the last one frees the pool
+ */
+struct buffer_pool::Holder
+{
+    Holder() : pool(new buffer_pool())
+    {
+        for(size_t i = 0; i < SIZE_CLASSES.size(); ++i)
+            pool->classes[i].maxFree = std::max<size_t>(MAX_FREE_BYTES / SIZE_CLASSES[i], 4);
+        current = pool;
+    }
+    ~Holder()
+    {
+        current = nullptr;
+        pool->orphaned.store(true, std::memory_order_seq_cst);
+        for(SizeClass& sizeClass : pool->classes)
+            while(pooled_buffer* buffer = sizeClass.free)
+            {
+                sizeClass.free = buffer->next;
+                pool->discard(buffer);
+            }
+        pool->discard_remote();
+        if (pool->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete pool;
+    }
+    buffer_pool* pool;
+    static thread_local buffer_pool* current; // the pool of this thread, still usable
+};
+
+thread_local buffer_pool* buffer_pool::Holder::current = nullptr;
+
+buffer_pool& buffer_pool::local()
+{
+    thread_local Holder holder;
+    return *holder.pool;
+}
+
+buffer_pool::~buffer_pool() = default;
+
+shared_buffer* buffer_pool::acquire(size_t length, unsigned char*& data)
+{
+    size_t index = std::lower_bound(SIZE_CLASSES.begin(), SIZE_CLASSES.end(), length) - SIZE_CLASSES.begin();
+    if (index == SIZE_CLASSES.size())
+    {
+        heap_buffer* buffer = heap_buffer::create(length);
+        data = buffer->data();
+        return buffer;
+    }
+    SizeClass& sizeClass = classes[index];
+    if (sizeClass.free == nullptr)
+        collect_remote();
+    pooled_buffer* buffer = sizeClass.free;
+    if (buffer != nullptr)
+    {
+        sizeClass.free = buffer->next;
+        sizeClass.freeCount--;
+    }
+    else
+    {
+        void* mem = ::operator new(sizeof(pooled_buffer) + SIZE_CLASSES[index]);
+        buffer = new(mem) pooled_buffer(this, (uint8_t)index);
+        refs.fetch_add(1, std::memory_order_relaxed);
+        heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    data = buffer->data();
+    return buffer;
+}
+
+void buffer_pool::give_back(pooled_buffer* buffer)
+{
+    if (Holder::current == this)
+    {
+        SizeClass& sizeClass = classes[buffer->sizeClass];
+        if (sizeClass.freeCount >= sizeClass.maxFree)
+        {
+            discard(buffer);
+            return;
+        }
+        buffer->next = sizeClass.free;
+        sizeClass.free = buffer;
+        sizeClass.freeCount++;
+        return;
+    }
+    // another thread's buffer. Once it is on the stack the pool's Holder may
+    // free it, and with it the pool, so hold the pool until we are done
+    refs.fetch_add(1, std::memory_order_relaxed);
+    buffer->next = remote.load(std::memory_order_relaxed);
+    while(!remote.compare_exchange_weak(buffer->next, buffer, std::memory_order_seq_cst, std::memory_order_relaxed))
+        ;
+    // the pool's thread may have gone before it could see this one. Either
+    // its Holder takes it, or we do
+    if (orphaned.load(std::memory_order_seq_cst))
+        discard_remote();
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+}
+
+void buffer_pool::discard(pooled_buffer* buffer)
+{
+    buffer->~pooled_buffer();
+    ::operator delete(buffer);
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+}
+
+bool buffer_pool::collect_remote()
+{
+    pooled_buffer* buffer = remote.exchange(nullptr, std::memory_order_acquire);
+    if (buffer == nullptr)
+        return false;
+    while(buffer != nullptr)
+    {
+        pooled_buffer* next = buffer->next;
+        give_back(buffer);
+        buffer = next;
+    }
+    return true;
+}
+
+void buffer_pool::discard_remote()
+{
+    // each exchange gets its own list, so nothing is freed twice
+    pooled_buffer* buffer = remote.exchange(nullptr, std::memory_order_seq_cst);
+    while(buffer != nullptr)
+    {
+        pooled_buffer* next = buffer->next;
+        discard(buffer);
+        buffer = next;
+    }
+}
+
+void pooled_buffer::destroy()
+{
+    pool->give_back(this);
+}
+
+shared_buffer* acquire_buffer(size_t length, unsigned char*& data)
+{
+    return buffer_pool::local().acquire(length, data);
+}
+
+} // end namespace soupbintcp
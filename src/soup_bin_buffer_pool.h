@@ -0,0 +1,237 @@
+#pragma once
+#include "soup_bin_framing.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+/***
+ * Buffers for outgoing packets, so that framing one does not go to the heap.
+ *
+ * Each thread has its own pool, with a free list per size class. A buffer
+ * goes back to the pool it came from when its last reference goes (i.e. when
+ * the write that sent it completes). On the pool's own thread that is a push
+ * onto a free list. From any other thread it is a push onto a lock-free
+ * stack that the pool takes back the next time it runs dry.
+ */
+namespace soupbintcp {
+
+class buffer_pool;
+
+/***
+ * A shared_buffer from a buffer_pool, with the bytes right behind it
+ */
+class pooled_buffer : public shared_buffer
+{
+    public:
+    unsigned char* data() { return reinterpret_cast<unsigned char*>(this + 1); }
+
+    protected:
+    void destroy() override;
+
+    private:
+    friend class buffer_pool;
+    pooled_buffer(buffer_pool* pool, uint8_t sizeClass) : pool(pool), sizeClass(sizeClass) {}
+    ~pooled_buffer() = default;
+    buffer_pool* pool;
+    uint8_t sizeClass;
+    pooled_buffer* next = nullptr; // while it is free
+};
+
+class buffer_pool
+{
+    public:
+    // bytes per buffer of each class. The last one fits the largest packet
+    static constexpr std::array<size_t, 6> SIZE_CLASSES = { 64, 256, 1024, 4096, 16384, 2 + UINT16_MAX };
+    static constexpr size_t MAX_FREE_BYTES = 1024 * 1024; // kept per class, anything over goes back to the heap
+
+    /***
+     * @returns the calling thread's pool
+     */
+    static buffer_pool& local();
+    /***
+     * @param length the bytes wanted
+     * @returns a buffer of at least length bytes (from the heap if it is
+     * bigger than the largest class)
+     */
+    shared_buffer* acquire(size_t length, unsigned char*& data);
+    /***
+     * @returns the buffers this pool has taken from the heap (a pool in a
+     * steady state stops adding to it)
+     */
+    uint64_t get_heap_allocations() const { return heapAllocations.load(std::memory_order_relaxed); }
+
+    private:
+    friend class pooled_buffer;
+    struct Holder;
+    buffer_pool() = default;
+    ~buffer_pool();
+    /***
+     * a buffer's last reference went, on any thread
+     */
+    void give_back(pooled_buffer* buffer);
+    /***
+     * free a buffer for good (and the pool, once it has none and its thread is gone)
+     */
+    void discard(pooled_buffer* buffer);
+    /***
+     * take back what other threads gave back
+     * @returns true if there was anything
+     */
+    bool collect_remote();
+    /***
+     * discard what other threads gave back (once the pool's thread is gone)
+     */
+    void discard_remote();
+
+    struct SizeClass
+    {
+        pooled_buffer* free = nullptr; // only touched on the pool's thread
+        size_t freeCount = 0;
+        size_t maxFree = 0;
+    };
+    std::array<SizeClass, SIZE_CLASSES.size()> classes;
+    std::atomic<pooled_buffer*> remote = nullptr; // given back from other threads, any class
+    std::atomic<size_t> refs = 1; // 1 for the thread, 1 for each buffer that has not been freed, 1 for each give_back from another thread in progress
+    std::atomic<bool> orphaned = false; // the pool's thread has gone
+    std::atomic<uint64_t> heapAllocations = 0;
+};
+
+/***
+ * A first in, first out queue that keeps its storage. Popping from the front
+ * only moves an index, so a queue that is filled and emptied over and over
+ * stops allocating once it has been as long as it gets.
+ */
+template<typename T>
+class reuse_queue
+{
+    public:
+    using iterator = typename std::vector<T>::iterator;
+    iterator begin() { return items.begin() + head; }
+    iterator end() { return items.end(); }
+    bool empty() const { return head == items.size(); }
+    size_t size() const { return items.size() - head; }
+    T& operator[](size_t i) { return items[head + i]; }
+    const T& operator[](size_t i) const { return items[head + i]; }
+    T& front() { return items[head]; }
+    const T& front() const { return items[head]; }
+    T& back() { return items.back(); }
+    const T& back() const { return items.back(); }
+    void push_back(T&& item) { items.push_back(std::move(item)); }
+    /***
+     * Take count items off the front
+     */
+    void pop_front(size_t count)
+    {
+        for(size_t i = head; i < head + count; ++i)
+            items[i] = T();
+        head += count;
+        if (head == items.size())
+        {
+            items.clear();
+            head = 0;
+        }
+        else if (head > items.size() / 2)
+        {
+            // more gone than left, move the rest down (nothing is allocated)
+            items.erase(items.begin(), items.begin() + head);
+            head = 0;
+        }
+    }
+    iterator erase(iterator itr) { return items.erase(itr); }
+    void clear()
+    {
+        items.clear();
+        head = 0;
+    }
+
+    private:
+    std::vector<T> items;
+    size_t head = 0; // items before this have been popped
+};
+
+/***
+ * Memory for 1 asynchronous operation at a time, so that starting one does
+ * not go to the heap. asio's own per-thread cache only keeps 1 block, which a
+ * read and a write in progress together keep evicting
+ */
+class handler_memory
+{
+    public:
+    handler_memory() = default;
+    handler_memory(const handler_memory&) = delete;
+    handler_memory& operator=(const handler_memory&) = delete;
+    void* allocate(size_t size)
+    {
+        if (!inUse && size <= sizeof(storage))
+        {
+            inUse = true;
+            return storage;
+        }
+        return ::operator new(size);
+    }
+    void deallocate(void* pointer)
+    {
+        if (pointer == storage)
+            inUse = false;
+        else
+            ::operator delete(pointer);
+    }
+
+    private:
+    alignas(std::max_align_t) unsigned char storage[1024];
+    bool inUse = false;
+};
+
+/***
+ * An allocator over a handler_memory, for asio to allocate an operation with
+ */
+template<typename T>
+class handler_allocator
+{
+    public:
+    using value_type = T;
+    explicit handler_allocator(handler_memory& memory) noexcept : memory(&memory) {}
+    template<typename U>
+    handler_allocator(const handler_allocator<U>& other) noexcept : memory(other.memory) {}
+    T* allocate(size_t count) { return static_cast<T*>(memory->allocate(sizeof(T) * count)); }
+    void deallocate(T* pointer, size_t) { memory->deallocate(pointer); }
+    template<typename U>
+    bool operator==(const handler_allocator<U>& other) const noexcept { return memory == other.memory; }
+    template<typename U>
+    bool operator!=(const handler_allocator<U>& other) const noexcept { return memory != other.memory; }
+
+    private:
+    template<typename> friend class handler_allocator;
+    handler_memory* memory;
+};
+
+/***
+ * A completion handler whose associated allocator takes its operation from
+ * a handler_memory
+ */
+template<typename Handler>
+class memory_handler
+{
+    public:
+    using allocator_type = handler_allocator<Handler>;
+    memory_handler(handler_memory& memory, Handler handler) : memory(&memory), handler(std::move(handler)) {}
+    allocator_type get_allocator() const noexcept { return allocator_type(*memory); }
+    template<typename... Args>
+    void operator()(Args&&... args) { handler(std::forward<Args>(args)...); }
+
+    private:
+    handler_memory* memory;
+    Handler handler;
+};
+
+template<typename Handler>
+memory_handler<Handler> with_memory(handler_memory& memory, Handler handler)
+{
+    return memory_handler<Handler>(memory, std::move(handler));
+}
+
+} // end namespace soupbintcp
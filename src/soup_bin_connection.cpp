@@ -1,35 +1,101 @@
 #include "soup_bin_server.h"
 #include "soupbintcp.h"
+#include <filesystem>
+#include <cstdlib>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+// the shared memory handshake, in debug packets. The client asks, the server
+// offers its ring, the client accepts if it can open it, and the server says
+// which sequence number the ring takes over from
+static constexpr std::string_view SHARED_PREFIX = "SHM ";
+static constexpr std::string_view SHARED_REQUEST = "SHM REQUEST";
+static constexpr std::string_view SHARED_OFFER = "SHM OFFER "; // then the token and the name
+static constexpr std::string_view SHARED_ACCEPT = "SHM ACCEPT";
+static constexpr std::string_view SHARED_START = "SHM START "; // then the sequence number
+
+/***
+ * @returns the io_context a socket runs on
+ */
+static boost::asio::io_context& context_of(boost::asio::ip::tcp::socket& skt)
+{
+    return static_cast<boost::asio::io_context&>(boost::asio::query(skt.get_executor(), boost::asio::execution::context));
+}
 
 SoupBinConnection::SoupBinConnection(boost::asio::ip::tcp::socket inSkt, MessageRepeater* parent)
-        : heartbeatTimer(this, 1000, Timer::get_time()), localIsServer(true), skt(std::move(inSkt)), parent(parent)
+        : localIsServer(true), skt(std::move(inSkt)), heartbeatTimer(this, 1000, context_of(skt)),
+        flushTimer(skt.get_executor()), reconnectTimer(skt.get_executor()), parent(parent)
 {
     status = Status::CONNECTED;
-    do_read_header();
+    lastTxMs = lastRxMs = Timer::get_time();
+    // the server puts a ring on the io_context if its sockets are to use one
+    if (boost::asio::has_service<SoupBinUring>(context_of(skt)))
+    {
+        uring = &boost::asio::use_service<SoupBinUring>(context_of(skt));
+        start_uring();
+    }
+    do_read();
 }
 
 SoupBinConnection::SoupBinConnection(const std::string& url, const std::string& user, const std::string& pw,
-        const std::string& sessionId, uint64_t nextSequenceNo) 
-        : heartbeatTimer(this, 1000, Timer::get_time()), localIsServer(false), skt(io_context), 
-        username(user), password(pw), sessionId(sessionId), nextSeq(nextSequenceNo)
+        const std::string& sessionId, uint64_t nextSequenceNo, bool connectNow) 
+        : url(url), username(user), password(pw), sessionId(sessionId), localIsServer(false), nextSeq(nextSequenceNo),
+        clientContext(std::make_unique<boost::asio::io_context>()), skt(*clientContext),
+        heartbeatTimer(this, 1000, *clientContext), flushTimer(skt.get_executor()), reconnectTimer(skt.get_executor())
+{
+    lastTxMs = lastRxMs = Timer::get_time();
+    if (connectNow)
+        connect();
+}
+
+void SoupBinConnection::connect()
 {
+    if (readerThread.joinable())
+        return;
+    host = url;
+    port = "80";
+    size_t pos = host.find(":");
+    if (pos != std::string::npos)
+    {
+        port = host.substr(pos + 1);
+        host = host.substr(0, pos);
+    }
+    resolver = std::make_unique<boost::asio::ip::tcp::resolver>(*clientContext);
     try
     {
-        std::string address = url;
-        std::string port = "80";
-        size_t pos = address.find(":");
-        if (pos != std::string::npos)
-        {
-            port = address.substr(pos + 1);
-            address = address.substr(0, pos);
-        }
-        boost::asio::ip::tcp::resolver resolver(io_context);
-        do_connect(resolver.resolve(address, port));
-        readerThread = std::thread([this]() { io_context.run(); });
-    } 
+        if (transportOptions.backend == TransportOptions::Backend::IO_URING && SoupBinUring::is_supported())
+            uring = &boost::asio::make_service<SoupBinUring>(*clientContext, transportOptions.uring);
+    }
     catch(const std::exception& e)
     {
-        // TODO
+        // the ring is only an optimisation, asio works without it
+        uring = nullptr;
+    }
+    // resolve and connect on the client's thread, where a failure can be retried
+    do_connect();
+    readerThread = std::thread([this]() { run_client(); });
+}
+
+void SoupBinConnection::run_client()
+{
+    if (pollOptions.cpu >= 0)
+        SoupBinIoContextPool::pin_current_thread(pollOptions.cpu);
+    if (pollOptions.mode == PollOptions::Mode::BLOCKING)
+    {
+        clientContext->run();
+        return;
+    }
+    // poll() never waits, and stops the context once there is no work left,
+    // which is when run() would have returned. Completions on a ring are
+    // picked up straight from shared memory
+    while(!clientContext->stopped())
+    {
+        clientContext->poll();
+        if (uring != nullptr)
+            uring->reap();
+        if (sharedActive.load(std::memory_order_relaxed))
+            poll_shared();
     }
 }
 
@@ -37,9 +103,17 @@ SoupBinConnection::~SoupBinConnection()
 {
     try
     {
-        close_socket();
         if (readerThread.joinable())
+        {
+            // the timers keep the reader thread busy until they are stopped
+            disconnect();
             readerThread.join();
+        }
+        shuttingDown = true;
+        closedNotified = true; // too late for the parent to let go
+        close_socket();
+        if (spillFd >= 0)
+            ::close(spillFd);
     } catch(...) {
         // TODO: 
     }
@@ -56,217 +130,995 @@ void SoupBinConnection::close_socket()
 {
     try {
         status = Status::DISCONNECTED;
+        flushTimer.cancel();
+        if (uringFd >= 0)
+        {
+            // anything still queued goes to the kernel before the descriptor
+            // can be reused, and the shutdown ends whatever is in flight
+            uring->flush();
+            ::shutdown(uringFd, SHUT_RDWR);
+            ::close(uringFd);
+            uringFd = -1;
+            uringReceiving = false;
+            uringGeneration = (uringGeneration + 1) & (SoupBinUringHandler::TAG_MASK >> 1);
+        }
+        stop_shared();
         if (skt.is_open())
             skt.close();
     } catch (...) {
     }
+    if (localIsServer)
+    {
+        notify_closed();
+        return;
+    }
+    clientLoggedIn = false;
+    if (reconnectOptions.enabled && !shuttingDown)
+        schedule_reconnect();
+    else
+        close_for_good();
 }
 
-void SoupBinConnection::on_login_request(const soupbintcp::login_request& in)
+void SoupBinConnection::notify_closed()
 {
-    std::string requestedSessionId = in.get_string(soupbintcp::login_request::REQUESTED_SESSION);
-    if (requestedSessionId.empty())
+    if (closedNotified || status != Status::DISCONNECTED || uringPending > 0 || parent == nullptr)
+        return;
+    closedNotified = true;
+    parent->closed(this);
+}
+
+void SoupBinConnection::close_for_good()
+{
+    closedForGood.store(true, std::memory_order_release);
+    unsentMessages.fetch_add(heldSends.size(), std::memory_order_relaxed);
+    heldSends.clear();
+}
+
+void SoupBinConnection::disconnect()
+{
+    boost::asio::dispatch(skt.get_executor(), [this]() {
+        shuttingDown = true;
+        reconnectTimer.cancel();
+        if (resolver != nullptr)
+            resolver->cancel();
+        close_socket();
+        heartbeatTimer.cancel();
+    });
+}
+
+void SoupBinConnection::schedule_reconnect()
+{
+    if (reconnectPending)
+        return; // each operation on the old socket fails, only the first one counts
+    if (reconnectOptions.maxAttempts > 0 && reconnectAttempts >= reconnectOptions.maxAttempts)
     {
-        std::stringstream ss;
-        ss << std::right << std::setw(10) << "ABC";
-        requestedSessionId = ss.str();
+        close_for_good();
+        return;
     }
-    uint64_t requestedSeqNo = in.get_int(soupbintcp::login_request::REQUESTED_SEQUENCE_NUMBER); 
-    bool resend = false;
-    if (requestedSeqNo != 0)
-        resend = true;
-    else
-        requestedSeqNo = 1;
+    if (!recovering)
+    {
+        recovering = true;
+        droppedAt = std::chrono::steady_clock::now();
+    }
+    // no heartbeats or dead peer checks while there is no socket
+    heartbeatTimer.cancel();
+    // the backoff doubles each try. Wait between half of it and all of it, so
+    // that clients that lost the same server do not all come back at once
+    uint64_t backoff = std::min<uint64_t>(reconnectOptions.initialBackoff.count() << std::min<size_t>(reconnectAttempts, 20),
+            reconnectOptions.maxBackoff.count());
+    uint64_t wait = backoff / 2 + jitter() % (backoff - backoff / 2 + 1);
+    reconnectAttempts++;
+    reconnectPending = true;
+    reconnectTimer.expires_after(std::chrono::milliseconds(wait));
+    reconnectTimer.async_wait([this](boost::system::error_code ec) {
+        if (ec == boost::asio::error::operation_aborted)
+            return;
+        reconnectPending = false;
+        if (!shuttingDown)
+            reconnect();
+    });
+}
+
+void SoupBinConnection::reconnect()
+{
+    // whatever was queued or half read belonged to the old socket
+    write_msgs.clear();
+    packetsInFlight = 0;
+    queuedBytes = 0;
+    queuedMessages = 0;
+    update_queue_depth();
+    if (spillFd >= 0)
+    {
+        ::close(spillFd);
+        spillFd = -1;
+    }
+    incoming = soupbintcp::receive_buffer();
+    sharedRing.reset();
+    sharedIncoming.reset();
+    sequencedBatch.clear();
+    status = Status::CONNECTING;
+    do_connect();
+}
+
+void SoupBinConnection::on_client_logged_in(uint64_t accepted)
+{
+    if (requestedSeq != 0 && accepted != requestedSeq)
+        on_sequence_gap(requestedSeq, accepted);
+    // what the application sent while there was no login goes out now, in order
+    clientLoggedIn = true;
+    for(soupbintcp::buffer_slice& frame : heldSends)
+        queue_write(std::move(frame), 0, 1);
+    heldSends.clear();
+    reconnectAttempts = 0;
+    if (!recovering)
+        return;
+    recovering = false;
+    auto recoveryTime = std::chrono::steady_clock::now() - droppedAt;
+    metrics.reconnects.add();
+    metrics.recoveryTime.record(std::chrono::duration_cast<std::chrono::nanoseconds>(recoveryTime).count());
+    on_reconnected(std::chrono::duration_cast<std::chrono::milliseconds>(recoveryTime));
+}
+
+void SoupBinConnection::on_login_request(const soupbintcp::login_request_view& in)
+{
+    std::string requestedSessionId = in.get_string<soupbintcp::login_request::REQUESTED_SESSION>();
+    if (loggedIn || closeWhenSent)
+        return; // already subscribed, or on the way out
+    stream = parent->login(this, requestedSessionId);
+    if (stream == nullptr)
+    {
+        // no such session
+        soupbintcp::login_rejected msg;
+        msg.set_string<soupbintcp::login_rejected::REJECT_REASON_CODE>("S");
+        send(msg.get_record_span());
+        closeWhenSent = true;
+        return;
+    }
+    // the session's own id, blank for an unnamed default session
+    requestedSessionId = stream->session_id();
+    // 0 means start with the next message, otherwise replay what we still have
+    uint64_t requestedSeqNo = in.get_int<soupbintcp::login_request::REQUESTED_SEQUENCE_NUMBER>(); 
+    uint64_t head = stream->next_seq();
+    if (requestedSeqNo == 0 || requestedSeqNo > head)
+        requestedSeqNo = head;
+    requestedSeqNo = std::max(requestedSeqNo, stream->first_seq());
     soupbintcp::login_accepted msg;
-    msg.set_int(soupbintcp::login_accepted::SEQUENCE_NUMBER, requestedSeqNo);
-    msg.set_string(soupbintcp::login_accepted::SESSION, requestedSessionId);
-    send(msg.get_record_as_vec());
-    if (resend)
+    msg.set_int<soupbintcp::login_accepted::SEQUENCE_NUMBER>(requestedSeqNo);
+    msg.set_string<soupbintcp::login_accepted::SESSION>(requestedSessionId);
+    send(msg.get_record_span());
+    loggedIn = true;
+    nextToSend = requestedSeqNo;
+    replaying = true;
+    refill_replay();
+}
+
+void SoupBinConnection::refill_replay()
+{
+    // stay well inside the queue limit, so the replay never trips it
+    size_t window = REPLAY_WINDOW_BYTES;
+    if (queueOptions.maxBytes > 0)
+        window = std::min(window, std::max<size_t>(queueOptions.maxBytes / 2, 1));
+    size_t batch = std::min(REPLAY_BATCH_BYTES, window);
+    while(replaying && queuedBytes < window && spillFd < 0 && status != Status::DISCONNECTED)
     {
-        parent->repeat_from(this, requestedSeqNo);
+        // anything at or past the head is published after this, and is still
+        // on its way to this thread as live. Reaching the head means nothing
+        // can slip in between the replay and the live feed
+        if (nextToSend >= stream->next_seq())
+        {
+            replaying = false;
+            if (sharedRequested)
+                start_shared();
+            return;
+        }
+        if (nextToSend < stream->first_seq())
+        {
+            // the store no longer has what the client needs, and SoupBin has
+            // no way to skip ahead
+            replaying = false;
+            close_socket();
+            return;
+        }
+        stream->repeat_from(this, nextToSend, batch);
     }
 }
 
-void SoupBinConnection::do_connect(const boost::asio::ip::tcp::resolver::results_type& endpoints)
+void SoupBinConnection::do_connect()
 {
-    boost::asio::async_connect(skt, endpoints, [this](boost::system::error_code ec, boost::asio::ip::tcp::endpoint) {
-        if (!ec)
+    resolver->async_resolve(host, port, [this](boost::system::error_code ec, boost::asio::ip::tcp::resolver::results_type endpoints) {
+        if (shuttingDown)
+            return;
+        if (ec)
         {
+            on_connect_failed("Unable to resolve " + url + ": " + ec.message());
+            close_socket();
+            return;
+        }
+        boost::asio::async_connect(skt, endpoints, [this](boost::system::error_code ec, boost::asio::ip::tcp::endpoint) {
+            if (ec)
+            {
+                if (!shuttingDown)
+                    on_connect_failed("Unable to connect to " + url + ": " + ec.message());
+                close_socket();
+                return;
+            }
             status = Status::CONNECTED;
+            lastTxMs = lastRxMs = Timer::get_time();
+            heartbeatTimer.reset();
+            apply_socket_options();
+            start_uring();
+            if (uringFd < 0 && pollOptions.mode == PollOptions::Mode::BUSY_POLL)
+            {
+                // reads that would block return at once, and the next poll tries again
+                boost::system::error_code ignored;
+                skt.non_blocking(true, ignored);
+            }
             // attempt login
             soupbintcp::login_request req;
-            req.set_string(soupbintcp::login_request::USERNAME, username);
-            req.set_string(soupbintcp::login_request::PASSWORD, password);
-            req.set_int(soupbintcp::login_request::REQUESTED_SEQUENCE_NUMBER, nextSeq);
-            req.set_string(soupbintcp::login_request::REQUESTED_SESSION, sessionId);
-            send(req.get_record_as_vec());
-            do_read_header();
-        }
+            req.set_string<soupbintcp::login_request::USERNAME>(username);
+            req.set_string<soupbintcp::login_request::PASSWORD>(password);
+            requestedSeq = nextSeq;
+            req.set_int<soupbintcp::login_request::REQUESTED_SEQUENCE_NUMBER>(requestedSeq);
+            req.set_string<soupbintcp::login_request::REQUESTED_SESSION>(sessionId);
+            send(req.get_record_span());
+            if (transportOptions.backend == TransportOptions::Backend::SHARED_MEMORY)
+                send(soupbintcp::make_frame('+', soupbintcp::as_uchars(SHARED_REQUEST)));
+            do_read();
+        });
     });
 }
-void SoupBinConnection::do_read_header()
+void SoupBinConnection::do_read()
 {
-    // read from network, placing first 3 bytes into buffer
-    boost::asio::async_read(skt, boost::asio::buffer(currentIncoming.data(), 3),
-            [this](boost::system::error_code ec, std::size_t length) {
+    if (uringFd >= 0)
+    {
+        // 1 receive keeps going until the socket ends
+        if (!uringReceiving)
+        {
+            uringReceiving = true;
+            uringPending++;
+            uring->receive(uringFd, this, URING_RECEIVE | (uringGeneration << 1));
+        }
+        return;
+    }
+    // read as much as the socket has, then frame every complete packet
+    std::span<unsigned char> space = incoming.free_space();
+    skt.async_read_some(boost::asio::buffer(space.data(), space.size()),
+            soupbintcp::with_memory(readMemory, [this](boost::system::error_code ec, std::size_t length) {
                 if (!ec)
                 {
-                    if (currentIncoming.decode_header())
-                    {
-                        do_read_body();
-                    }
-                    else
-                    {
-                        do_read_header();
-                    }
+                    if (on_received(incoming, length))
+                        do_read();
                 }
                 else
                 {
                     close_socket();
                 }
-            });
+            }));
 }
-void SoupBinConnection::do_read_body()
+
+bool SoupBinConnection::on_received(soupbintcp::receive_buffer& buffer, size_t length)
 {
-    boost::asio::async_read(skt, boost::asio::buffer(currentIncoming.body(), currentIncoming.body_length()),
-            [this](boost::system::error_code ec, std::size_t length ) 
-            {
-                if (!ec)
-                {
-                    // if this is a system message, handle it. Otherwise place it in queue
-                    if (currentIncoming.decode_header()) {
-                        switch(currentIncoming.data()[2])
-                        {
-                            // from server or client
-                            case('+'): // debug packet
-                                on_debug(soupbintcp::debug_packet(currentIncoming.data()));
-                                break;
-                            // from server
-                            case('A'): // login accepted
-                                on_login_accepted(soupbintcp::login_accepted(currentIncoming.data()));
-                                break;
-                            case('J'): // login rejected
-                                on_login_rejected(soupbintcp::login_rejected(currentIncoming.data()));
-                                break;
-                            case('S'):
-                                on_sequenced_data(soupbintcp::sequenced_data(currentIncoming.data()));
-                                break;
-                            case('H'): // heartbeat coming from server
-                                on_server_heartbeat(soupbintcp::server_heartbeat(currentIncoming.data()));
-                                break;
-                            case('Z'): // server end of session
-                                on_end_of_session(soupbintcp::end_of_session(currentIncoming.data()));
-                                break;
-                            // from client
-                            case('L'): // login request
-                                on_login_request(soupbintcp::login_request(currentIncoming.data()));
-                                break;
-                            case('U'):
-                                on_unsequenced_data(soupbintcp::unsequenced_data(currentIncoming.data()));
-                                break;
-                            case('R'):
-                                on_client_heartbeat(soupbintcp::client_heartbeat(currentIncoming.data()));
-                                break;
-                            case('O'):
-                                on_logout_request(soupbintcp::logout_request(currentIncoming.data()));
-                                break;
-                            default:
-                            {
-                                // this should never happen
-                                // place message in queue
-                                std::vector<unsigned char> vec(currentIncoming.data(), currentIncoming.data() + currentIncoming.body_length() + 3);
-                                read_msgs.push_back(vec);
-                                break;
-                            }
-                        }
-                        do_read_header();
-                    }
-                    else
-                    {
-                        close_socket();
-                    }
-                }
-                else
+    lastRxMs = heartbeatTimer.coarse_time();
+    receiveCount.fetch_add(1, std::memory_order_relaxed);
+    metrics.bytesIn.add(length);
+    buffer.commit(length);
+    auto start = std::chrono::steady_clock::now();
+    frame_received(buffer);
+    metrics.handlerTime.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    if (buffer.is_corrupt())
+    {
+        close_socket();
+        return false;
+    }
+    buffer.compact();
+    return true;
+}
+
+void SoupBinConnection::start_uring()
+{
+    if (uring == nullptr || !skt.is_open())
+        return;
+    // asio's reactor would still wake up for the socket, so it lets go of it
+    boost::system::error_code ec;
+    int fd = skt.release(ec);
+    if (ec)
+    {
+        uring = nullptr;
+        return;
+    }
+    // blocking, so the ring waits for the socket instead of failing with EAGAIN
+    int flags = ::fcntl(fd, F_GETFL);
+    if (flags >= 0)
+        ::fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    uringFd = fd;
+}
+
+void SoupBinConnection::on_uring_complete(uint8_t tag, int32_t result, uint32_t flags)
+{
+    // anything from a socket that has since closed is dropped
+    bool current = uringFd >= 0 && (tag >> 1) == uringGeneration;
+    if (!(flags & IORING_CQE_F_MORE))
+        uringPending--;
+    if ((tag & 1) == URING_RECEIVE)
+    {
+        if (current && !(flags & IORING_CQE_F_MORE))
+            uringReceiving = false;
+        if (current && result > 0)
+        {
+            // copied out, so the buffer goes straight back to the kernel.
+            // compact() always leaves room for a whole buffer
+            std::span<const unsigned char> data = uring->get_buffer(result, flags);
+            memcpy(incoming.free_space().data(), data.data(), data.size());
+        }
+        uring->recycle(flags);
+        if (!current)
+        {
+            notify_closed();
+            return;
+        }
+        if (result == -ENOBUFS)
+        {
+            // every buffer was in use, start again
+            do_read();
+            return;
+        }
+        if (result <= 0)
+        {
+            close_socket();
+            return;
+        }
+        if (on_received(incoming, result) && !uringReceiving)
+            do_read();
+        return;
+    }
+    if (!current)
+    {
+        notify_closed();
+        return;
+    }
+    if (result < 0)
+    {
+        close_socket();
+        return;
+    }
+    if ((size_t)result < uringSendBytes - uringSent)
+    {
+        // only part of it went, send the rest
+        uringSent += result;
+        size_t done = result;
+        size_t first = 0;
+        while(done >= uringIov[first].iov_len)
+            done -= uringIov[first++].iov_len;
+        uringIov[first].iov_base = (char*)uringIov[first].iov_base + done;
+        uringIov[first].iov_len -= done;
+        uringMsg.msg_iov = uringIov.data() + first;
+        uringMsg.msg_iovlen = uringIov.size() - first;
+        uringPending++;
+        uring->send(uringFd, &uringMsg, this, URING_SEND | (uringGeneration << 1));
+        return;
+    }
+    on_written(uringSendBytes);
+}
+
+void SoupBinConnection::frame_received(soupbintcp::receive_buffer& buffer)
+{
+    frame_packets(*this, buffer);
+}
+
+bool SoupBinConnection::on_shared_memory_debug(const soupbintcp::debug_packet_view& in)
+{
+    std::string_view text((const char*)in.get_message().data(), in.get_message().size());
+    if (!text.starts_with(SHARED_PREFIX))
+        return false;
+    if (localIsServer)
+    {
+        SoupBinSharedRing* ring = (loggedIn ? stream->get_shared_ring() : nullptr);
+        if (text == SHARED_REQUEST && ring != nullptr)
+        {
+            // the client has to be able to open it, it may be on another host
+            std::string offer = std::string(SHARED_OFFER) + std::to_string(ring->get_token()) + " " + ring->get_name();
+            send(soupbintcp::make_frame('+', soupbintcp::as_uchars(offer)));
+        }
+        else if (text == SHARED_ACCEPT && ring != nullptr && !sharedLive)
+        {
+            // the switch has to come after the replay, or the client would
+            // skip what is between the replay and the ring
+            if (replaying)
+                sharedRequested = true;
+            else
+                start_shared();
+        }
+        return true;
+    }
+    if (transportOptions.backend != TransportOptions::Backend::SHARED_MEMORY)
+        return false;
+    if (text.starts_with(SHARED_OFFER))
+    {
+        std::string offer(text.substr(SHARED_OFFER.size()));
+        size_t space = offer.find(' ');
+        if (space == std::string::npos)
+            return true;
+        try
+        {
+            sharedRing = std::make_unique<SoupBinSharedRing>(offer.substr(space + 1),
+                    std::strtoull(offer.c_str(), nullptr, 10));
+        }
+        catch(const std::exception& e)
+        {
+            // not on the server's host, stay on TCP
+            sharedRing.reset();
+            return true;
+        }
+        send(soupbintcp::make_frame('+', soupbintcp::as_uchars(SHARED_ACCEPT)));
+    }
+    else if (text.starts_with(SHARED_START) && sharedRing != nullptr && !sharedActive)
+    {
+        // everything before this came over TCP, the rest is in the ring
+        sharedSeq = std::strtoull(std::string(text.substr(SHARED_START.size())).c_str(), nullptr, 10);
+        sharedFound = false;
+        if (sharedIncoming == nullptr)
+            sharedIncoming = std::make_unique<soupbintcp::receive_buffer>();
+        sharedActive.store(true, std::memory_order_release);
+        if (pollOptions.mode == PollOptions::Mode::BLOCKING)
+        {
+            // the client's thread sleeps in epoll, so another thread sleeps
+            // on the ring and wakes it when there is something to read
+            sharedWaiterStop = false;
+            sharedWaiter = std::thread([this, ring = sharedRing.get()]() {
+                uint64_t seen = ring->get_write_pos();
+                while(!sharedWaiterStop.load(std::memory_order_acquire))
                 {
-                    close_socket();
+                    ring->wait(seen, std::chrono::milliseconds(100));
+                    uint64_t pos = ring->get_write_pos();
+                    if (pos == seen)
+                        continue;
+                    seen = pos;
+                    // a poll already on its way reads at least up to pos
+                    if (!sharedPollPosted.exchange(true, std::memory_order_acq_rel))
+                        boost::asio::post(*clientContext, [this]() {
+                            sharedPollPosted.store(false, std::memory_order_release);
+                            poll_shared();
+                        });
                 }
             });
+            // what was written before the waiter started
+            boost::asio::post(*clientContext, [this]() { poll_shared(); });
+        }
+    }
+    return true;
 }
 
-void SoupBinConnection::send_sequenced(uint64_t seqNo, const std::vector<unsigned char>& bytes)
+void SoupBinConnection::start_shared()
 {
-    // add to map
-    messages.emplace(seqNo, bytes);
-    soupbintcp::sequenced_data msg;
-    msg.set_message(bytes);
-    send(msg.get_record_as_vec());
+    sharedRequested = false;
+    sharedLive = true;
+    std::string start = std::string(SHARED_START) + std::to_string(nextToSend);
+    send(soupbintcp::make_frame('+', soupbintcp::as_uchars(start)));
 }
 
-void SoupBinConnection::send_sequenced(const std::vector<unsigned char>& bytes)
+void SoupBinConnection::poll_shared()
 {
-    send_sequenced(get_next_seq(), bytes);
+    if (!sharedActive.load(std::memory_order_relaxed) || status == Status::DISCONNECTED)
+        return;
+    if (!sharedFound)
+    {
+        switch(sharedRing->find(sharedSeq, sharedPos))
+        {
+            case SoupBinSharedRing::Find::NOT_YET:
+                return;
+            case SoupBinSharedRing::Find::GONE:
+                // too far behind for the ring, catch up over TCP
+                close_socket();
+                return;
+            case SoupBinSharedRing::Find::FOUND:
+                sharedFound = true;
+                break;
+        }
+    }
+    for(size_t i = 0; i < SHARED_READS_PER_POLL; ++i)
+    {
+        size_t length = sharedRing->read(sharedPos, sharedIncoming->free_space());
+        if (length == 0)
+            return;
+        if (length == SoupBinSharedRing::LAPPED)
+        {
+            // a slow consumer, the writer does not wait. Catch up over TCP
+            slowConsumerEvents.fetch_add(1, std::memory_order_relaxed);
+            on_slow_consumer();
+            close_socket();
+            return;
+        }
+        sharedPos += length;
+        if (!on_received(*sharedIncoming, length) || !sharedActive.load(std::memory_order_relaxed))
+            return;
+    }
+    // more to read, after the socket has had a turn
+    if (pollOptions.mode == PollOptions::Mode::BLOCKING && !sharedPollPosted.exchange(true, std::memory_order_acq_rel))
+        boost::asio::post(*clientContext, [this]() {
+            sharedPollPosted.store(false, std::memory_order_release);
+            poll_shared();
+        });
+}
+
+void SoupBinConnection::stop_shared()
+{
+    if (!sharedActive.exchange(false, std::memory_order_acq_rel))
+        return;
+    if (sharedWaiter.joinable())
+    {
+        sharedWaiterStop = true;
+        sharedRing->wake();
+        sharedWaiter.join();
+    }
+}
+
+void SoupBinConnection::send_sequenced(uint64_t seqNo, const soupbintcp::buffer_slice& frame)
+{
+    if (localIsServer)
+    {
+        // a replay in progress will pick this message up from the store
+        if (!loggedIn || replaying || seqNo < nextToSend)
+            return;
+        nextToSend = seqNo + 1;
+        if (sharedLive)
+            return; // the client reads it from the session's ring
+        queue_write(frame, seqNo, 1);
+        return;
+    }
+    send_when_logged_in(frame);
+}
+
+void SoupBinConnection::send_sequenced_range(uint64_t firstSeqNo, uint64_t count, const soupbintcp::buffer_slice& frames)
+{
+    metrics.replayedMessages.add(count);
+    metrics.replayedBytes.add(frames.size());
+    nextToSend = firstSeqNo + count;
+    queue_write(frames, firstSeqNo, count, true);
+}
+
+void SoupBinConnection::send_sequenced(std::span<const unsigned char> bytes)
+{
+    send_sequenced(nextSeq++, bytes);
+}
+
+bool SoupBinConnection::send_unsequenced(const soupbintcp::buffer_slice& frame)
+{
+    if (localIsServer)
+    {
+        send(frame);
+        return true;
+    }
+    return send_when_logged_in(frame);
+}
+
+void SoupBinConnection::set_write_options(const WriteOptions& options)
+{
+    boost::asio::dispatch(skt.get_executor(), [this, options]() {
+        writeOptions = options;
+        gatherBuffers.reserve(writeOptions.maxBuffers);
+    });
+}
+
+void SoupBinConnection::set_heartbeat_options(const HeartbeatOptions& options)
+{
+    boost::asio::dispatch(skt.get_executor(), [this, options]() {
+        heartbeatOptions = options;
+        heartbeatTimer.set_interval(heartbeatOptions.interval.count());
+    });
+}
+
+void SoupBinConnection::set_socket_options(const SocketOptions& options)
+{
+    boost::asio::dispatch(skt.get_executor(), [this, options]() {
+        socketOptions = options;
+        if (skt.is_open() || uringFd >= 0)
+            apply_socket_options();
+    });
+}
+
+void SoupBinConnection::apply_socket_options()
+{
+    // best effort, i.e. SO_BUSY_POLL needs CAP_NET_ADMIN to go above net.core.busy_read
+    if (uringFd >= 0)
+    {
+        // asio no longer has the socket
+        int noDelay = socketOptions.noDelay;
+        ::setsockopt(uringFd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        if (socketOptions.busyPollMicros > 0)
+            ::setsockopt(uringFd, SOL_SOCKET, SO_BUSY_POLL, &socketOptions.busyPollMicros, sizeof(int));
+        if (socketOptions.receiveBufferBytes > 0)
+            ::setsockopt(uringFd, SOL_SOCKET, SO_RCVBUF, &socketOptions.receiveBufferBytes, sizeof(int));
+        if (socketOptions.sendBufferBytes > 0)
+            ::setsockopt(uringFd, SOL_SOCKET, SO_SNDBUF, &socketOptions.sendBufferBytes, sizeof(int));
+        return;
+    }
+    boost::system::error_code ignored;
+    skt.set_option(boost::asio::ip::tcp::no_delay(socketOptions.noDelay), ignored);
+    if (socketOptions.busyPollMicros > 0)
+        skt.set_option(boost::asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>(socketOptions.busyPollMicros), ignored);
+    if (socketOptions.receiveBufferBytes > 0)
+        skt.set_option(boost::asio::socket_base::receive_buffer_size(socketOptions.receiveBufferBytes), ignored);
+    if (socketOptions.sendBufferBytes > 0)
+        skt.set_option(boost::asio::socket_base::send_buffer_size(socketOptions.sendBufferBytes), ignored);
+}
+
+void SoupBinConnection::set_queue_options(const QueueOptions& options)
+{
+    boost::asio::dispatch(skt.get_executor(), [this, options]() {
+        queueOptions = options;
+    });
+}
+
+SoupBinConnection::QueueStats SoupBinConnection::get_queue_stats() const
+{
+    QueueStats stats;
+    stats.highWaterBytes = highWaterBytes.load(std::memory_order_relaxed);
+    stats.highWaterMessages = highWaterMessages.load(std::memory_order_relaxed);
+    stats.slowConsumerEvents = slowConsumerEvents.load(std::memory_order_relaxed);
+    stats.droppedMessages = droppedMessages.load(std::memory_order_relaxed);
+    stats.spilledBytes = spilledBytes.load(std::memory_order_relaxed);
+    stats.unsentMessages = unsentMessages.load(std::memory_order_relaxed);
+    return stats;
+}
+
+soupbintcp::metrics_snapshot SoupBinConnection::get_metrics() const
+{
+    soupbintcp::metrics_snapshot snapshot;
+    snapshot.sessions = 1;
+    for(size_t i = 0; i < soupbintcp::PACKET_TYPE_COUNT; ++i)
+    {
+        snapshot.packetsIn[i] = metrics.packetsIn[i].get();
+        snapshot.packetsOut[i] = metrics.packetsOut[i].get();
+    }
+    snapshot.bytesIn = metrics.bytesIn.get();
+    snapshot.bytesOut = metrics.bytesOut.get();
+    snapshot.receives = get_receive_count();
+    snapshot.writes = get_write_count();
+    snapshot.queueBytes = metrics.queueBytes.get();
+    snapshot.queueMessages = metrics.queueMessages.get();
+    QueueStats queueStats = get_queue_stats();
+    snapshot.queueHighWaterBytes = queueStats.highWaterBytes;
+    snapshot.queueHighWaterMessages = queueStats.highWaterMessages;
+    snapshot.slowConsumerEvents = queueStats.slowConsumerEvents;
+    snapshot.droppedMessages = queueStats.droppedMessages;
+    snapshot.spilledBytes = queueStats.spilledBytes;
+    snapshot.replayedMessages = metrics.replayedMessages.get();
+    snapshot.replayedBytes = metrics.replayedBytes.get();
+    snapshot.heartbeatsSent = metrics.heartbeatsSent.get();
+    snapshot.heartbeatMisses = metrics.heartbeatMisses.get();
+    snapshot.deadPeers = metrics.deadPeers.get();
+    snapshot.handlerTime = metrics.handlerTime.snapshot();
+    snapshot.reconnects = metrics.reconnects.get();
+    snapshot.recoveryTime = metrics.recoveryTime.snapshot();
+    return snapshot;
 }
 
-void SoupBinConnection::send_unsequenced(const std::vector<unsigned char>& bytes)
+void SoupBinConnection::update_queue_depth()
 {
-    soupbintcp::unsequenced_data msg;
-    msg.set_message(bytes);
-    send(msg.get_record_as_vec());
+    metrics.queueBytes.set(queuedBytes);
+    metrics.queueMessages.set(queuedMessages);
 }
 
 void SoupBinConnection::do_write()
 {
-    boost::asio::async_write(skt, boost::asio::buffer(write_msgs.front().data(), write_msgs.front().size()),
-            [this](boost::system::error_code ec, std::size_t /* length */) {
-                if (!ec) {
-                    write_msgs.pop_front();
-                    if (!write_msgs.empty())
-                        do_write();
-                } else {
+    // gather as many queued packets as the limits allow into one write
+    gatherBuffers.clear();
+    size_t bytes = 0;
+    size_t messages = 0;
+    for(const QueuedWrite& entry : write_msgs)
+    {
+        if (packetsInFlight > 0 && (gatherBuffers.size() == writeOptions.maxBuffers
+                || bytes + entry.frames.size() > writeOptions.maxBytes))
+            break;
+        gatherBuffers.emplace_back(entry.frames.data(), entry.frames.size());
+        bytes += entry.frames.size();
+        messages += entry.count;
+        packetsInFlight++;
+    }
+    queuedBytes -= bytes;
+    queuedMessages -= messages;
+    update_queue_depth();
+    if (uringFd >= 0)
+    {
+        uringIov.clear();
+        for(const boost::asio::const_buffer& buffer : gatherBuffers)
+            uringIov.push_back(iovec{ const_cast<void*>(buffer.data()), buffer.size() });
+        uringMsg = msghdr{};
+        uringMsg.msg_iov = uringIov.data();
+        uringMsg.msg_iovlen = uringIov.size();
+        uringSendBytes = bytes;
+        uringSent = 0;
+        uringPending++;
+        uring->send(uringFd, &uringMsg, this, URING_SEND | (uringGeneration << 1));
+        return;
+    }
+    // a view of gatherBuffers, which asio copies for nothing (it stays put until the write completes)
+    boost::asio::async_write(skt, std::span<const boost::asio::const_buffer>(gatherBuffers),
+            soupbintcp::with_memory(writeMemory, [this](boost::system::error_code ec, std::size_t length) {
+                if (!ec)
+                    on_written(length);
+                else
                     close_socket();
-                }
-            });
+            }));
 }
 
-void SoupBinConnection::send(const std::vector<unsigned char>& bytes)
+void SoupBinConnection::on_written(size_t length)
 {
-    if (localIsServer)
+    lastTxMs = heartbeatTimer.coarse_time();
+    writeCount.fetch_add(1, std::memory_order_relaxed);
+    metrics.bytesOut.add(length);
+    // the packets go back to their pools once nothing else holds them
+    write_msgs.pop_front(packetsInFlight);
+    packetsInFlight = 0;
+    if (closeWhenSent && write_msgs.empty())
     {
-        bool write_in_progress = !write_msgs.empty();
-        write_msgs.push_back(bytes);
-        if (!write_in_progress)
+        close_socket();
+        return;
+    }
+    if (spillFd >= 0)
+        refill_from_spill();
+    if (replaying)
+        refill_replay();
+    if (!write_msgs.empty())
+        flush();
+}
+
+void SoupBinConnection::flush()
+{
+    if (packetsInFlight > 0)
+        return; // the completion of the current write will flush
+    if (writeOptions.flushPolicy == WriteOptions::FlushPolicy::IMMEDIATE || queuedBytes >= writeOptions.maxBytes)
+    {
+        if (flushTimerArmed)
+        {
+            flushTimer.cancel();
+            flushTimerArmed = false;
+        }
+        do_write();
+        return;
+    }
+    // BATCH: give other packets a chance to join this one
+    if (flushTimerArmed)
+        return;
+    flushTimerArmed = true;
+    flushTimer.expires_after(writeOptions.latencyBudget);
+    flushTimer.async_wait([this](boost::system::error_code ec) {
+        if (ec == boost::asio::error::operation_aborted)
+            return;
+        flushTimerArmed = false;
+        if (packetsInFlight == 0 && !write_msgs.empty() && status != Status::DISCONNECTED)
             do_write();
+    });
+}
+
+void SoupBinConnection::send(soupbintcp::buffer_slice frame)
+{
+    // the queue belongs to the socket's thread. Anything sent from another
+    // thread (the application, the heartbeat timer) is handed over to it
+    boost::asio::dispatch(skt.get_executor(), [this, frame = std::move(frame)]() mutable {
+        queue_write(std::move(frame), 0, 1);
+    });
+}
+
+bool SoupBinConnection::send_when_logged_in(soupbintcp::buffer_slice frame)
+{
+    if (closedForGood.load(std::memory_order_acquire))
+    {
+        unsentMessages.fetch_add(1, std::memory_order_relaxed);
+        return false;
     }
-    else
+    boost::asio::dispatch(skt.get_executor(), [this, frame = std::move(frame)]() mutable {
+        if (clientLoggedIn)
+            queue_write(std::move(frame), 0, 1);
+        else if (closedForGood.load(std::memory_order_relaxed))
+            unsentMessages.fetch_add(1, std::memory_order_relaxed); // closed since the check above
+        else
+            heldSends.push_back(std::move(frame));
+    });
+    return true;
+}
+
+void SoupBinConnection::queue_write(soupbintcp::buffer_slice frames, uint64_t firstSeq, uint64_t count, bool paced)
+{
+    if (status != Status::CONNECTED)
+        return; // nothing goes out before the socket is connected, or after it closes
+    // anything with more than 1 packet is a run of sequenced messages
+    metrics.packetsOut[soupbintcp::packet_type_index(count == 1 ? frames.data()[2] : 'S')].add(count);
+    if (spillFd >= 0)
+    {
+        // keep the order, everything goes behind what is already spilled
+        if (!spill(frames))
+            close_socket();
+        return;
+    }
+    if (!paced && ((queueOptions.maxBytes > 0 && queuedBytes + frames.size() > queueOptions.maxBytes)
+            || (queueOptions.maxMessages > 0 && queuedMessages + count > queueOptions.maxMessages)))
     {
-        boost::asio::post(io_context, [this, bytes]() {
-            bool write_in_progress = !write_msgs.empty();
-            write_msgs.push_back(bytes);
-            if (!write_in_progress) {
-                do_write();
+        slowConsumerEvents.fetch_add(1, std::memory_order_relaxed);
+        on_slow_consumer();
+        if (handle_slow_consumer(frames, firstSeq, count))
+            return;
+    }
+    queuedBytes += frames.size();
+    queuedMessages += count;
+    if (queuedBytes > highWaterBytes.load(std::memory_order_relaxed))
+        highWaterBytes.store(queuedBytes, std::memory_order_relaxed);
+    if (queuedMessages > highWaterMessages.load(std::memory_order_relaxed))
+        highWaterMessages.store(queuedMessages, std::memory_order_relaxed);
+    write_msgs.push_back(QueuedWrite{ std::move(frames), firstSeq, count });
+    update_queue_depth();
+    flush();
+}
+
+bool SoupBinConnection::handle_slow_consumer(const soupbintcp::buffer_slice& frames, uint64_t firstSeq, uint64_t count)
+{
+    switch(queueOptions.slowConsumerPolicy)
+    {
+        case(QueueOptions::SlowConsumerPolicy::DROP_AND_REPLAY):
+        {
+            if (!localIsServer || stream == nullptr || !loggedIn)
+                break;
+            // drop the sequenced messages that are not being written, the
+            // store still has them. Anything else stays in the queue.
+            uint64_t resumeFrom = (firstSeq != 0 ? firstSeq : nextToSend);
+            for(auto itr = write_msgs.begin() + packetsInFlight; itr != write_msgs.end(); )
+            {
+                if (itr->firstSeq == 0)
+                {
+                    ++itr;
+                    continue;
+                }
+                resumeFrom = std::min(resumeFrom, itr->firstSeq);
+                queuedBytes -= itr->frames.size();
+                queuedMessages -= itr->count;
+                droppedMessages.fetch_add(itr->count, std::memory_order_relaxed);
+                itr = write_msgs.erase(itr);
             }
-        });
+            if (firstSeq != 0)
+                droppedMessages.fetch_add(count, std::memory_order_relaxed);
+            update_queue_depth();
+            // the client gets them again, paced, once the socket drains
+            nextToSend = resumeFrom;
+            replaying = true;
+            refill_replay();
+            // the packet that hit the limit is either in the replay, or still goes out
+            return firstSeq != 0;
+        }
+        case(QueueOptions::SlowConsumerPolicy::SPILL):
+        {
+            std::filesystem::path directory = queueOptions.spillDirectory.empty()
+                    ? std::filesystem::temp_directory_path() : std::filesystem::path(queueOptions.spillDirectory);
+            std::string path = (directory / "soupbin_spill_XXXXXX").string();
+            spillFd = ::mkstemp(path.data());
+            if (spillFd < 0)
+                break;
+            // nobody else needs to see it, and it goes away with the descriptor
+            ::unlink(path.c_str());
+            spillWritePos = spillReadPos = 0;
+            if (spill(frames))
+                return true;
+            break;
+        }
+        default:
+            break;
     }
+    close_socket();
+    return true;
 }
 
-uint64_t SoupBinConnection::get_next_seq(bool increment) 
-{ 
-    if(!increment)
-        return nextSeq;
-    return nextSeq++; 
+bool SoupBinConnection::spill(const soupbintcp::buffer_slice& frames)
+{
+    if (queueOptions.maxSpillBytes > 0 && spillWritePos - spillReadPos + frames.size() > queueOptions.maxSpillBytes)
+        return false;
+    const unsigned char* data = frames.data();
+    size_t remaining = frames.size();
+    while(remaining > 0)
+    {
+        ssize_t written = ::pwrite(spillFd, data, remaining, spillWritePos);
+        if (written <= 0)
+            return false;
+        data += written;
+        remaining -= written;
+        spillWritePos += written;
+    }
+    spilledBytes.fetch_add(frames.size(), std::memory_order_relaxed);
+    return true;
+}
+
+void SoupBinConnection::refill_from_spill()
+{
+    // read back while the queue is under half the limit, whole packets only
+    size_t lowWater = (queueOptions.maxBytes > 0 ? queueOptions.maxBytes / 2 : SPILL_READ_BYTES);
+    while(spillFd >= 0 && queuedBytes < lowWater)
+    {
+        size_t wanted = std::min<uint64_t>(SPILL_READ_BYTES, spillWritePos - spillReadPos);
+        unsigned char* data;
+        soupbintcp::buffer_ref owner(soupbintcp::acquire_buffer(wanted, data));
+        ssize_t got = ::pread(spillFd, data, wanted, spillReadPos);
+        if (got <= 0)
+        {
+            close_socket();
+            return;
+        }
+        size_t length = 0;
+        uint64_t count = 0;
+        while(length + 2 <= (size_t)got)
+        {
+            uint16_t sz;
+            memcpy(&sz, data + length, sizeof(sz));
+            size_t frameLength = soupbintcp::swap_endian_bytes<uint16_t>(sz) + 2;
+            if (length + frameLength > (size_t)got)
+                break;
+            length += frameLength;
+            count++;
+        }
+        spillReadPos += length;
+        queuedBytes += length;
+        queuedMessages += count;
+        write_msgs.push_back(QueuedWrite{ soupbintcp::buffer_slice{ std::move(owner), data, length }, 0, count });
+        if (spillReadPos == spillWritePos)
+        {
+            // caught up, back to the queue in memory
+            ::close(spillFd);
+            spillFd = -1;
+        }
+    }
+    update_queue_depth();
 }
 
 void SoupBinConnection::OnTimer(uint64_t msSince)
 {
-    // send heartbeat
-    if (localIsServer)
+    if (status == Status::DISCONNECTED)
     {
-        soupbintcp::server_heartbeat hb;
-        send(hb.get_record_as_vec());
+        heartbeatTimer.cancel();
+        return;
     }
-    else
+    uint64_t now = heartbeatTimer.coarse_time();
+    uint64_t interval = heartbeatOptions.interval.count();
+    uint64_t timeout = heartbeatOptions.deadPeerTimeout.count();
+    if (interval > 0 && now > lastRxMs)
     {
-        soupbintcp::client_heartbeat hb;
-        send(hb.get_record_as_vec());
+        // count each heartbeat interval the other side has been quiet for, once
+        if (missRxMs != lastRxMs)
+        {
+            missRxMs = lastRxMs;
+            missesCounted = 0;
+        }
+        uint64_t missed = (now - lastRxMs) / interval;
+        if (missed > missesCounted)
+        {
+            metrics.heartbeatMisses.add(missed - missesCounted);
+            missesCounted = missed;
+        }
+    }
+    if (timeout > 0 && now >= lastRxMs + timeout)
+    {
+        // nothing from the other side, not even a heartbeat
+        metrics.deadPeers.add();
+        close_socket();
+        heartbeatTimer.cancel();
+        return;
+    }
+    // a link that is busy does not need heartbeats
+    if (now >= lastTxMs + interval)
+    {
+        if (localIsServer)
+        {
+            soupbintcp::server_heartbeat hb;
+            send(hb.get_record_span());
+        }
+        else
+        {
+            soupbintcp::client_heartbeat hb;
+            send(hb.get_record_span());
+        }
+        metrics.heartbeatsSent.add();
+        lastTxMs = now;
     }
+    // come back when we would next be idle, or the peer would be dead
+    uint64_t from = lastTxMs;
+    if (timeout > 0)
+        from = std::min(from, lastRxMs + timeout - interval);
+    heartbeatTimer.reset_from(from);
 }
@@ -1,25 +1,80 @@
 #pragma once
 #include "soup_bin_timer.h"
 #include "soupbintcp.h"
+#include "soup_bin_framing.h"
+#include "soup_bin_buffer_pool.h"
+#include "soup_bin_metrics.h"
+#include "soup_bin_uring.h"
+#include "soup_bin_shared_ring.h"
 #include <vector>
 #include <unordered_map>
 #include <atomic>
-#include <deque>
 #include <string>
+#include <string_view>
+#include <chrono>
+#include <span>
+#include <cstddef>
+#include <memory>
+#include <random>
+#include <type_traits>
+#include <utility> // boost asio needs std::exchange in C++20
 #include <boost/asio.hpp>
 
 class SoupBinConnection;
 
+/***
+ * Where a server side connection gets the sequenced messages it replays
+ */
 class MessageRepeater
 {
     public:
-    virtual void repeat_from(SoupBinConnection* conn, uint64_t startPos) = 0;
+    /***
+     * @returns the oldest sequence number that can still be repeated
+     */
+    virtual uint64_t first_seq() = 0;
+    /***
+     * @returns the sequence number the next published message will get
+     */
+    virtual uint64_t next_seq() = 0;
+    /***
+     * Queue stored messages on a connection (with send_sequenced_range)
+     * @param conn the connection
+     * @param startPos the first sequence number to send
+     * @param maxBytes roughly how many bytes to queue (at least 1 message is queued)
+     * @returns the sequence number after the last one queued
+     */
+    virtual uint64_t repeat_from(SoupBinConnection* conn, uint64_t startPos, size_t maxBytes) = 0;
+    /***
+     * @returns the session these messages belong to, empty if it has no name
+     */
+    virtual std::string session_id() { return ""; }
+    /***
+     * A connection logs in to a session (on the connection's thread). From
+     * then on, it replays from (and is sent the live messages of) the
+     * repeater returned
+     * @param conn the connection
+     * @param sessionId the requested session, empty for the default one
+     * @returns where the session's messages come from, or nullptr to reject the login
+     */
+    virtual MessageRepeater* login(SoupBinConnection* conn, const std::string& sessionId) { return this; }
+    /***
+     * A connection this repeater accepted has closed, and nothing in flight
+     * refers to it any more (on the connection's thread). It still has to
+     * outlive the handler this is called from
+     * @param conn the connection
+     */
+    virtual void closed(SoupBinConnection* conn) {}
+    /***
+     * @returns the ring that clients on this host can read the live messages
+     * from, nullptr if there is not one
+     */
+    virtual SoupBinSharedRing* get_shared_ring() { return nullptr; }
 };
 
 /***
  * Represents a connected client
 */
-class SoupBinConnection : public TimerListener
+class SoupBinConnection : public TimerListener, public SoupBinUringHandler, public std::enable_shared_from_this<SoupBinConnection>
 {
     public:
     enum class Status
@@ -29,68 +84,704 @@ class SoupBinConnection : public TimerListener
         DISCONNECTED  
     };
 
+    /***
+     * How queued packets are written to the socket. Everything queued (up to
+     * the limits) goes out in one gather write.
+     */
+    struct WriteOptions
+    {
+        enum class FlushPolicy
+        {
+            IMMEDIATE, // write as soon as the socket is free
+            BATCH // hold packets until maxBytes are queued or latencyBudget passes
+        };
+        FlushPolicy flushPolicy = FlushPolicy::IMMEDIATE;
+        std::chrono::microseconds latencyBudget{100}; // BATCH only, how long a packet may wait
+        size_t maxBytes = 64 * 1024; // the most bytes in one write
+        size_t maxBuffers = 64; // the most buffers (iovecs) in one write
+    };
+
+    /***
+     * When to send heartbeats, and when to give up on a quiet peer
+     */
+    struct HeartbeatOptions
+    {
+        std::chrono::milliseconds interval{1000}; // send a heartbeat once nothing has been sent for this long
+        std::chrono::milliseconds deadPeerTimeout{15000}; // disconnect once nothing has been received for this long, 0 = never
+    };
+
+    /***
+     * How much a connection may queue for a socket that is not keeping up, and
+     * what to do when a client falls that far behind
+     */
+    struct QueueOptions
+    {
+        enum class SlowConsumerPolicy
+        {
+            DISCONNECT, // close the connection
+            DROP_AND_REPLAY, // drop the queued sequenced messages and replay them from the store once the socket drains (server side only, otherwise DISCONNECT)
+            SPILL // write the overflow to a file and read it back as the socket drains
+        };
+        size_t maxBytes = 64 * 1024 * 1024; // the most bytes waiting for the socket, 0 = no limit
+        size_t maxMessages = 0; // the most packets waiting for the socket, 0 = no limit
+        SlowConsumerPolicy slowConsumerPolicy = SlowConsumerPolicy::DISCONNECT;
+        std::string spillDirectory; // SPILL only, where the file goes (empty = the temp directory)
+        uint64_t maxSpillBytes = 1024ull * 1024 * 1024; // SPILL only, the most bytes waiting in the spill file before disconnecting, 0 = no limit
+    };
+
+    /***
+     * How full the outbound queue has been
+     */
+    struct QueueStats
+    {
+        size_t highWaterBytes = 0; // the most bytes that have waited for the socket
+        size_t highWaterMessages = 0; // the most packets that have waited for the socket
+        uint64_t slowConsumerEvents = 0; // the number of times a limit was hit
+        uint64_t droppedMessages = 0; // DROP_AND_REPLAY, sequenced messages dropped (to be replayed)
+        uint64_t spilledBytes = 0; // SPILL, bytes written to the spill file
+        uint64_t unsentMessages = 0; // client side, sends that never went out because the connection closed for good
+    };
+
+    /***
+     * Socket level tuning. Applied once the socket is connected (or accepted),
+     * as far as the system allows
+     */
+    struct SocketOptions
+    {
+        bool noDelay = false; // TCP_NODELAY, send small writes without waiting for an ack
+        int busyPollMicros = 0; // SO_BUSY_POLL, how long a read may spin on the device queue, 0 = off
+        int receiveBufferBytes = 0; // SO_RCVBUF, 0 = the system default
+        int sendBufferBytes = 0; // SO_SNDBUF, 0 = the system default
+    };
+
+    /***
+     * How a client's thread waits for its socket
+     */
+    struct PollOptions
+    {
+        enum class Mode
+        {
+            BLOCKING, // sleep in epoll until there is something to do
+            BUSY_POLL // never sleep, spin on poll() with a non-blocking socket. Costs a whole core
+        };
+        Mode mode = Mode::BLOCKING;
+        int cpu = -1; // the core to pin the client's thread to, -1 = not pinned
+    };
+
+    /***
+     * Client side, what to do when the connection drops
+     */
+    struct ReconnectOptions
+    {
+        bool enabled = false; // connect and log in again, asking for the next sequence number
+        std::chrono::milliseconds initialBackoff{100}; // the wait before the first try
+        std::chrono::milliseconds maxBackoff{5000}; // the wait doubles with each try, up to this
+        size_t maxAttempts = 0; // tries in a row before giving up, 0 = never give up
+    };
+
+    /***
+     * What carries the bytes between the socket and the connection
+     */
+    struct TransportOptions
+    {
+        enum class Backend
+        {
+            ASIO, // asio's reactor, 1 system call per read or write
+            IO_URING, // 1 io_uring per io_context (see SoupBinUring), if the system allows it. Otherwise ASIO
+            SHARED_MEMORY // client side, log in and replay over TCP (asio), then read the live sequenced data from the server's
+                          // shared memory ring (see SoupBinSharedRing), if the server offers one on this host. Otherwise ASIO
+        };
+        Backend backend = Backend::ASIO;
+        SoupBinUring::Options uring; // IO_URING only
+    };
+
     /***
      * A connection to a server from a client
+     * @param connectNow false to wait for connect(). A derived class that
+     * handles packets should pass false and call connect() at the end of its own
+     * constructor, or packets can arrive before it is ready for them
      */
     SoupBinConnection(const std::string& url, const std::string& username, const std::string& password,
-            const std::string& sessionId = "", uint64_t nextSequenceNo = 0);
+            const std::string& sessionId = "", uint64_t nextSequenceNo = 0, bool connectNow = true);
     /***
      * A connection from a client (this ctor used by a server
      */
     SoupBinConnection(boost::asio::ip::tcp::socket skt, MessageRepeater* parent);
     ~SoupBinConnection();
+    /***
+     * Client side, connect and log in (if the constructor was told not to)
+     */
+    void connect();
+    /***
+     * Client side, how the client's thread waits for the socket. Only takes
+     * effect if called before connect()
+     */
+    void set_poll_options(const PollOptions& options) { pollOptions = options; }
+    /***
+     * Client side, hand sequenced data to on_sequenced_batch, a receive at a
+     * time, instead of to on_sequenced_data. Only takes effect if called before connect()
+     */
+    void set_sequenced_batch(bool on) { batchSequenced = on; }
+    /***
+     * Client side, reconnect after the connection drops. The connection logs
+     * in again with the next sequence number it needs and the session it last had. A
+     * rejected login or an end of session is not retried. Only takes effect
+     * if called before connect()
+     */
+    void set_reconnect_options(const ReconnectOptions& options) { reconnectOptions = options; }
+    /***
+     * Client side, how the socket is read and written. Only takes effect if
+     * called before connect(). A server's connections take theirs from
+     * SoupBinServerOptions::transport
+     */
+    void set_transport_options(const TransportOptions& options) { transportOptions = options; }
+    /***
+     * @returns true if the socket is read and written through an io_uring
+     */
+    bool is_using_uring() const { return uring != nullptr; }
+    /***
+     * @returns the io_uring_enter calls of this connection's ring (shared
+     * with the rest of its io_context), 0 without one
+     */
+    uint64_t get_uring_enter_count() const { return uring != nullptr ? uring->get_enter_count() : 0; }
+    /***
+     * @returns true if live sequenced data comes from a shared memory ring
+     * (unsequenced data and heartbeats still come over TCP, so their order
+     * against sequenced data is not kept)
+     */
+    bool is_using_shared_memory() const { return sharedActive.load(std::memory_order_acquire); }
 
     /***
-     * Stores message for repeats, plus sends it
+     * Sends a sequenced message
     */
-    virtual void send_sequenced(uint64_t seqNo, const std::vector<unsigned char>& bytes);
-    virtual void send_sequenced(const std::vector<unsigned char>& bytes);
-    void send_unsequenced(const std::vector<unsigned char>& bytes);
-    uint64_t get_next_seq(bool increment = true);
+    void send_sequenced(uint64_t seqNo, std::span<const unsigned char> bytes) { send_sequenced(seqNo, soupbintcp::make_frame('S', bytes)); }
+    void send_sequenced(uint64_t seqNo, const std::vector<unsigned char>& bytes) { send_sequenced(seqNo, std::span<const unsigned char>(bytes)); }
+    /***
+     * Sends a sequenced message that is already framed (and probably shared
+     * with other connections). On the server side, this is the live feed: it
+     * is ignored until the client has logged in and while a replay is still
+     * catching up.
+     */
+    virtual void send_sequenced(uint64_t seqNo, const soupbintcp::buffer_slice& frame);
+    /***
+     * Sends a run of sequenced messages that are framed back to back
+     * @param firstSeqNo the sequence number of the first message
+     * @param count the number of messages
+     * @param frames the framed messages
+     */
+    virtual void send_sequenced_range(uint64_t firstSeqNo, uint64_t count, const soupbintcp::buffer_slice& frames);
+    void send_sequenced(const std::vector<unsigned char>& bytes) { send_sequenced(std::span<const unsigned char>(bytes)); }
+    void send_sequenced(std::span<const std::byte> bytes) { send_sequenced(soupbintcp::as_uchars(bytes)); }
+    void send_sequenced(std::string_view bytes) { send_sequenced(soupbintcp::as_uchars(bytes)); }
+    void send_sequenced(std::span<const unsigned char> bytes);
+    /***
+     * Sends an unsequenced message. Client side, anything sent before the
+     * login is accepted (i.e. while connecting, or while waiting to reconnect)
+     * is held, and goes out right after it
+     * @returns false if the connection has closed for good, and the message
+     * will never go out (see QueueStats::unsentMessages)
+     */
+    bool send_unsequenced(std::span<const unsigned char> bytes) { return send_unsequenced(soupbintcp::make_frame('U', bytes)); }
+    bool send_unsequenced(const std::vector<unsigned char>& bytes) { return send_unsequenced(std::span<const unsigned char>(bytes)); }
+    bool send_unsequenced(std::span<const std::byte> bytes) { return send_unsequenced(soupbintcp::as_uchars(bytes)); }
+    bool send_unsequenced(std::string_view bytes) { return send_unsequenced(soupbintcp::as_uchars(bytes)); }
+    /***
+     * Sends an unsequenced message that is already framed
+     */
+    bool send_unsequenced(const soupbintcp::buffer_slice& frame);
+    /***
+     * Client side, the sequence number of the next sequenced message. Only
+     * the connection moves it on: during on_sequenced_data it is the number of
+     * the message being handled, and it moves past the message after the call
+     * (past the whole batch after on_sequenced_batch). Server side, the number
+     * send_sequenced without one uses next
+     */
+    uint64_t peek_next_seq() const { return nextSeq; }
+    /***
+     * Used to move the number on as well. Only the connection does that now,
+     * use peek_next_seq()
+     */
+    uint64_t get_next_seq(bool increment = true) = delete;
     std::string get_session_id() { return sessionId; }
+    /***
+     * @returns the number of socket reads that completed
+     */
+    uint64_t get_receive_count() const { return receiveCount.load(std::memory_order_relaxed); }
+    /***
+     * @returns the number of packets framed from those reads
+     */
+    uint64_t get_packet_count() const { return packetCount.load(std::memory_order_relaxed); }
+    /***
+     * @returns the number of socket writes that completed
+     */
+    uint64_t get_write_count() const { return writeCount.load(std::memory_order_relaxed); }
+    /***
+     * Change how packets are written. Safe to call from any thread.
+     */
+    void set_write_options(const WriteOptions& options);
+    /***
+     * Close the connection and stop its timers. Safe to call from any thread.
+     */
+    void disconnect();
+    /***
+     * Change the heartbeat interval and dead peer timeout. Safe to call from any thread.
+     */
+    void set_heartbeat_options(const HeartbeatOptions& options);
+    /***
+     * Change the socket options. Safe to call from any thread.
+     */
+    void set_socket_options(const SocketOptions& options);
+    /***
+     * Change the queue limits and slow consumer policy. Safe to call from any thread.
+     */
+    void set_queue_options(const QueueOptions& options);
+    /***
+     * @returns the high water marks of the outbound queue. Safe to call from any thread.
+     */
+    QueueStats get_queue_stats() const;
+    /***
+     * @returns everything counted about this session so far. Safe to call
+     * from any thread, and does not stop the session's thread
+     */
+    soupbintcp::metrics_snapshot get_metrics() const;
 
-    // TimerListener implementation
+    // TimerListener implementation, heartbeats and the dead peer check
     virtual void OnTimer(uint64_t msSince) override;
 
     public:
     Status status = Status::CONNECTING;
 
     protected:
-    // these are called when messages come in
-    virtual void on_debug(const soupbintcp::debug_packet& in) {}
-    virtual void on_login_accepted(const soupbintcp::login_accepted& in) { status = Status::CONNECTED; }
-    virtual void on_login_rejected(const soupbintcp::login_rejected& in) {}
-    virtual void on_sequenced_data(const soupbintcp::sequenced_data& in) {}
-    virtual void on_unsequenced_data(const soupbintcp::unsequenced_data&  in) {}
-    virtual void on_login_request(const soupbintcp::login_request& in);
-    virtual void on_logout_request(const soupbintcp::logout_request& in) {}
-    virtual void on_server_heartbeat(const soupbintcp::server_heartbeat& in) {} 
-    virtual void on_client_heartbeat(const soupbintcp::client_heartbeat& in) {}
-    virtual void on_end_of_session(const soupbintcp::end_of_session& in) {}
-    void send(const std::vector<unsigned char>& bytes);
+    // these are called when messages come in. The views point into the receive
+    // buffer, so copy anything that needs to outlive the call
+    virtual void on_debug(const soupbintcp::debug_packet_view& in) {}
+    virtual void on_login_accepted(const soupbintcp::login_accepted_view& in) { status = Status::CONNECTED; }
+    virtual void on_login_rejected(const soupbintcp::login_rejected_view& in) {}
+    virtual void on_sequenced_data(const soupbintcp::sequenced_data_view& in) {}
+    /***
+     * set_sequenced_batch only. Every sequenced packet framed from 1 receive
+     * (up to the next packet of another type), in order. The connection's
+     * sequence number moves past them after the call. By default each goes to
+     * on_sequenced_data, with peek_next_seq() at its number
+     */
+    virtual void on_sequenced_batch(std::span<const soupbintcp::sequenced_message> batch)
+    {
+        for(const soupbintcp::sequenced_message& msg : batch)
+        {
+            nextSeq = msg.seq;
+            on_sequenced_data(msg.view);
+        }
+    }
+    virtual void on_unsequenced_data(const soupbintcp::unsequenced_data_view&  in) {}
+    virtual void on_login_request(const soupbintcp::login_request_view& in);
+    virtual void on_logout_request(const soupbintcp::logout_request_view& in) {}
+    virtual void on_server_heartbeat(const soupbintcp::server_heartbeat_view& in) {} 
+    virtual void on_client_heartbeat(const soupbintcp::client_heartbeat_view& in) {}
+    virtual void on_end_of_session(const soupbintcp::end_of_session_view& in) {}
+    /***
+     * set_reconnect_options only. Logged in again after the connection dropped
+     * @param recoveryTime from the drop until the login was accepted
+     */
+    virtual void on_reconnected(std::chrono::milliseconds recoveryTime) {}
+    /***
+     * client side, resolving the server or connecting to it failed. With
+     * set_reconnect_options another try follows, otherwise the connection is
+     * closed for good
+     * @param reason what went wrong
+     */
+    virtual void on_connect_failed(const std::string& reason) {}
+    /***
+     * client side, the server is not starting where we asked it to
+     * @param requested the sequence number in the login request
+     * @param accepted the sequence number in login accepted
+     */
+    virtual void on_sequence_gap(uint64_t requested, uint64_t accepted) {}
+    /***
+     * called when a queue limit is hit, before the slow consumer policy is applied
+     */
+    virtual void on_slow_consumer() {}
+    /***
+     * send a complete packet (header included), i.e. from message<SIZE>
+     */
+    void send(std::span<const unsigned char> record) { send(soupbintcp::make_frame(record)); }
+    void send(const std::vector<unsigned char>& record) { send(std::span<const unsigned char>(record)); }
+    /***
+     * queue a framed packet for the socket
+     */
+    void send(soupbintcp::buffer_slice frame);
+    /***
+     * client side, send a packet from the application once the login is accepted
+     * @returns false if the connection has closed for good
+     */
+    bool send_when_logged_in(soupbintcp::buffer_slice frame);
+    /***
+     * client side, no more tries: what is held for the login never goes out
+     */
+    void close_for_good();
+    /***
+     * add to the outbound queue (on the io thread), applying the queue limits
+     * @param frames one or more framed packets
+     * @param firstSeq the sequence number of the first packet, 0 if not sequenced
+     * @param count the number of packets
+     * @param paced true if the caller already keeps the queue short (i.e. a replay)
+     */
+    void queue_write(soupbintcp::buffer_slice frames, uint64_t firstSeq, uint64_t count, bool paced = false);
+    /***
+     * apply the slow consumer policy
+     * @returns true if the packets were taken care of, false to queue them anyway
+     */
+    bool handle_slow_consumer(const soupbintcp::buffer_slice& frames, uint64_t firstSeq, uint64_t count);
+    /***
+     * SPILL, write packets to the end of the spill file
+     * @returns false if the file is full (QueueOptions::maxSpillBytes) or the write failed
+     */
+    bool spill(const soupbintcp::buffer_slice& frames);
+    /***
+     * SPILL, read packets back from the spill file while the queue has room
+     */
+    void refill_from_spill();
 
     // boost asio
-    void do_connect(const boost::asio::ip::tcp::resolver::results_type& endpoints);
-    void do_read_header();
-    void do_read_body();
+    /***
+     * client side, resolve the server (again, it may have moved) and connect
+     */
+    void do_connect();
+    void do_read();
+    /***
+     * a read put length more bytes in a receive buffer, hand them out
+     * @returns false if the connection was closed
+     */
+    bool on_received(soupbintcp::receive_buffer& buffer, size_t length);
+    /***
+     * a write of length bytes completed
+     */
+    void on_written(size_t length);
+    /***
+     * IO_URING, take the socket from asio (once it is connected)
+     */
+    void start_uring();
+    /***
+     * IO_URING, a receive or send finished
+     */
+    void on_uring_complete(uint8_t tag, int32_t result, uint32_t flags) override;
+    /***
+     * the shared memory handshake, which goes over TCP as debug packets
+     * @returns true if the packet was part of it (and is not for on_debug)
+     */
+    bool on_shared_memory_debug(const soupbintcp::debug_packet_view& in);
+    /***
+     * server side, send the live feed through the session's shared ring from the next message on
+     */
+    void start_shared();
+    /***
+     * SHARED_MEMORY, hand out whatever the ring has (on the client's thread)
+     */
+    void poll_shared();
+    /***
+     * SHARED_MEMORY, stop reading the ring
+     */
+    void stop_shared();
+    /***
+     * frame every complete packet in a receive buffer and hand them out.
+     * Called once per receive
+     * @param buffer incoming, or sharedIncoming for what came from the shared ring
+     */
+    virtual void frame_received(soupbintcp::receive_buffer& buffer);
+    /***
+     * frame_received(), with the on_ methods of a handler
+     * @param handler the connection itself, as the type that has the on_ methods
+     * @param buffer where the packets are
+     */
+    template<typename HANDLER>
+    void frame_packets(HANDLER& handler, soupbintcp::receive_buffer& buffer);
+    /***
+     * hand a complete packet to the correct on_ method of a handler
+     * @returns false if the packet is too short for its type (nothing is handed over)
+     */
+    template<typename HANDLER>
+    bool dispatch(HANDLER& handler, const unsigned char* packet);
+    /***
+     * set_sequenced_batch only, hand sequencedBatch to on_sequenced_batch
+     */
+    template<typename HANDLER>
+    void deliver_sequenced_batch(HANDLER& handler);
     void do_write();
+    /***
+     * write now, or wait for more packets, depending on the flush policy
+     */
+    void flush();
+    /***
+     * queue more of a replay if the socket has drained enough, and switch to
+     * the live feed once the replay reaches it
+     */
+    void refill_replay();
     void close_socket();
+    /***
+     * server side, tell the parent once the socket is closed and the ring has
+     * nothing of it left
+     */
+    void notify_closed();
+    /***
+     * set_reconnect_options only, try again after the backoff
+     */
+    void schedule_reconnect();
+    /***
+     * set_reconnect_options only, drop what was left from the old socket and connect
+     */
+    void reconnect();
+    /***
+     * client side, login accepted: check for a gap, and report a recovery
+     */
+    void on_client_logged_in(uint64_t accepted);
+    /***
+     * publish queuedBytes and queuedMessages to the metrics
+     */
+    void update_queue_depth();
+    /***
+     * set socketOptions on the socket (on the socket's thread)
+     */
+    void apply_socket_options();
+    /***
+     * the client's thread
+     */
+    void run_client();
 
     protected:
+    const std::string url; // client side, where to connect
     const std::string username;
     const std::string password;
     std::string sessionId;
     bool localIsServer = false;
     std::atomic<uint64_t> nextSeq = 0;
-    Timer heartbeatTimer; // fires off a heartbeat packet if nothing sent for 1 minute
-    std::unordered_map<uint64_t, std::vector<unsigned char> > messages;
-    boost::asio::io_context io_context;
+    std::unique_ptr<boost::asio::io_context> clientContext; // client side only, a server's connections run on the server's threads
     boost::asio::ip::tcp::socket skt;
-    std::thread readerThread;
-    bool shuttingDown = false;
-    std::deque<std::vector<unsigned char> > write_msgs;
-    std::deque<std::vector<unsigned char> > read_msgs;
-    soupbintcp::incoming_message currentIncoming;
-    MessageRepeater* parent;
+    std::thread readerThread; // client side only, runs clientContext
+    PollOptions pollOptions; // client side only, how readerThread runs clientContext
+    SocketOptions socketOptions;
+    Timer heartbeatTimer; // sends a heartbeat when idle, and checks for a dead peer, on the socket's thread
+    HeartbeatOptions heartbeatOptions;
+    uint64_t lastTxMs = 0; // when a write last completed (coarse)
+    uint64_t lastRxMs = 0; // when a read last completed (coarse)
+    bool shuttingDown = false; // closed on purpose, do not reconnect
+    struct QueuedWrite
+    {
+        soupbintcp::buffer_slice frames;
+        uint64_t firstSeq = 0; // 0 if not sequenced
+        uint64_t count = 1; // the number of packets in frames
+    };
+    soupbintcp::reuse_queue<QueuedWrite> write_msgs; // keeps its storage, so queuing a packet does not allocate
+    WriteOptions writeOptions;
+    QueueOptions queueOptions;
+    size_t queuedBytes = 0; // bytes in write_msgs not yet handed to the socket
+    size_t queuedMessages = 0; // packets in write_msgs not yet handed to the socket
+    std::atomic<size_t> highWaterBytes = 0;
+    std::atomic<size_t> highWaterMessages = 0;
+    std::atomic<uint64_t> slowConsumerEvents = 0;
+    std::atomic<uint64_t> droppedMessages = 0;
+    std::atomic<uint64_t> spilledBytes = 0;
+    int spillFd = -1; // SPILL, an unlinked file, open while there is anything in it
+    uint64_t spillWritePos = 0;
+    uint64_t spillReadPos = 0;
+    size_t packetsInFlight = 0; // entries at the front of write_msgs being written
+    std::vector<boost::asio::const_buffer> gatherBuffers; // the buffers of the write in progress
+    soupbintcp::handler_memory readMemory; // the read in progress
+    soupbintcp::handler_memory writeMemory; // the write in progress
+    TransportOptions transportOptions; // client side, the server's connections use the service on their io_context
+    SoupBinUring* uring = nullptr; // IO_URING, the ring of the socket's io_context
+    int uringFd = -1; // IO_URING, the socket (asio let go of it)
+    uint8_t uringGeneration = 0; // IO_URING, which socket a completion belongs to (a reconnect opens a new one)
+    bool uringReceiving = false; // IO_URING, the multishot receive is running
+    uint32_t uringPending = 0; // IO_URING, receives and sends the ring has yet to finish (they point at this)
+    bool closedNotified = false; // server side, the parent has been told (see notify_closed())
+    std::vector<iovec> uringIov; // IO_URING, the send in progress
+    msghdr uringMsg{};
+    size_t uringSendBytes = 0; // IO_URING, the size of the send in progress
+    size_t uringSent = 0; // IO_URING, how much of it has gone (if it went in parts)
+    static constexpr uint8_t URING_RECEIVE = 0; // tags, with the generation above them
+    static constexpr uint8_t URING_SEND = 1;
+    std::unique_ptr<SoupBinSharedRing> sharedRing; // SHARED_MEMORY, the server's ring, once it offered it
+    std::unique_ptr<soupbintcp::receive_buffer> sharedIncoming; // SHARED_MEMORY, bytes copied out of the ring
+    std::atomic<bool> sharedActive = false; // SHARED_MEMORY, live sequenced data comes from sharedRing
+    uint64_t sharedSeq = 0; // SHARED_MEMORY, the first sequence number to read from the ring
+    uint64_t sharedPos = 0; // SHARED_MEMORY, where to read next, once sharedSeq has been found
+    bool sharedFound = false; // SHARED_MEMORY, sharedPos is good
+    std::thread sharedWaiter; // SHARED_MEMORY and BLOCKING, sleeps on the ring and wakes the client's thread
+    std::atomic<bool> sharedWaiterStop = false;
+    std::atomic<bool> sharedPollPosted = false; // a poll_shared() is on its way to the client's thread
+    bool sharedRequested = false; // server side, the client asked for the ring while a replay was catching up
+    bool sharedLive = false; // server side, the client reads the live feed from the session's ring
+    static constexpr size_t SHARED_READS_PER_POLL = 16; // then let the socket have a turn
+    boost::asio::steady_timer flushTimer;
+    bool flushTimerArmed = false;
+    std::atomic<uint64_t> writeCount = 0;
+    soupbintcp::receive_buffer incoming;
+    std::atomic<uint64_t> receiveCount = 0;
+    std::atomic<uint64_t> packetCount = 0;
+    soupbintcp::session_metrics metrics; // written on the socket's thread only
+    ReconnectOptions reconnectOptions; // client side only
+    std::string host; // client side, where to connect
+    std::string port;
+    std::unique_ptr<boost::asio::ip::tcp::resolver> resolver; // client side, on clientContext
+    bool clientLoggedIn = false; // client side, the login on this socket was accepted
+    std::vector<soupbintcp::buffer_slice> heldSends; // client side, sent by the application before the login was accepted
+    std::atomic<bool> closedForGood = false; // client side, nothing more will be sent
+    std::atomic<uint64_t> unsentMessages = 0;
+    boost::asio::steady_timer reconnectTimer;
+    bool reconnectPending = false; // reconnectTimer is waiting
+    size_t reconnectAttempts = 0; // tries since the last login
+    bool recovering = false; // the connection dropped, and we are not logged in again yet
+    std::chrono::steady_clock::time_point droppedAt; // recovering only
+    uint64_t requestedSeq = 0; // the sequence number in the last login request
+    std::minstd_rand jitter{std::random_device()()};
+    uint64_t missRxMs = 0; // the lastRxMs the heartbeat misses were last counted for
+    uint64_t missesCounted = 0; // heartbeat misses counted since missRxMs
+    bool batchSequenced = false; // client side, deliver sequenced data with on_sequenced_batch
+    std::vector<soupbintcp::sequenced_message> sequencedBatch; // the sequenced packets of the current receive
+    MessageRepeater* parent = nullptr;
+    MessageRepeater* stream = nullptr; // server side, the session logged in to
+    bool loggedIn = false; // server side, the client has logged in
+    bool closeWhenSent = false; // server side, close once the queue is written (a rejected login)
+    bool replaying = false; // server side, a replay is still catching up to the live feed
+    uint64_t nextToSend = 0; // server side, the sequence number the client expects next
+    static constexpr size_t REPLAY_BATCH_BYTES = 64 * 1024; // most bytes queued per refill
+    static constexpr size_t REPLAY_WINDOW_BYTES = 256 * 1024; // refill while fewer bytes than this are queued
+    static constexpr size_t SPILL_READ_BYTES = 2 + UINT16_MAX; // most bytes read back from the spill file at a time (the largest packet, and the largest pooled buffer)
 };
 
+template<typename HANDLER>
+void SoupBinConnection::frame_packets(HANDLER& handler, soupbintcp::receive_buffer& buffer)
+{
+    while(const unsigned char* packet = buffer.next_packet())
+    {
+        packetCount.fetch_add(1, std::memory_order_relaxed);
+        metrics.packetsIn[soupbintcp::packet_type_index(packet[2])].add();
+        if (batchSequenced && packet[2] == 'S')
+        {
+            sequencedBatch.push_back(soupbintcp::sequenced_message{ nextSeq + sequencedBatch.size(),
+                    soupbintcp::sequenced_data_view(packet) });
+            continue;
+        }
+        // anything else waits for the sequenced packets before it
+        deliver_sequenced_batch(handler);
+        if (!dispatch(handler, packet))
+        {
+            // the peer is not speaking SoupBin, on_received() closes the socket
+            buffer.set_corrupt();
+            return;
+        }
+    }
+    deliver_sequenced_batch(handler);
+}
+
+template<typename HANDLER>
+void SoupBinConnection::deliver_sequenced_batch(HANDLER& handler)
+{
+    if (sequencedBatch.empty())
+        return;
+    uint64_t after = sequencedBatch.front().seq + sequencedBatch.size();
+    handler.on_sequenced_batch(sequencedBatch);
+    nextSeq = after;
+    sequencedBatch.clear();
+}
+
+template<typename HANDLER>
+bool SoupBinConnection::dispatch(HANDLER& handler, const unsigned char* packet)
+{
+    // the views read their fields without looking at the length
+    uint16_t length;
+    memcpy(&length, packet, sizeof(length));
+    if ((size_t)soupbintcp::swap_endian_bytes<uint16_t>(length) + 2 < soupbintcp::fixed_packet_length(packet[2]))
+        return false;
+    switch(packet[2])
+    {
+        // from server or client
+        case('+'): // debug packet
+        {
+            soupbintcp::debug_packet_view view(packet);
+            if (!on_shared_memory_debug(view))
+                handler.on_debug(view);
+            break;
+        }
+        // from server
+        case('A'): // login accepted
+        {
+            // keep track here, the reader thread can beat a derived class's constructor
+            soupbintcp::login_accepted_view view(packet);
+            nextSeq = view.get_int<soupbintcp::login_accepted::SEQUENCE_NUMBER>();
+            sessionId = view.get_string<soupbintcp::login_accepted::SESSION>();
+            on_client_logged_in(nextSeq);
+            handler.on_login_accepted(view);
+            break;
+        }
+        case('J'): // login rejected
+            shuttingDown = true; // the same login would be rejected again
+            handler.on_login_rejected(soupbintcp::login_rejected_view(packet));
+            break;
+        case('S'):
+            handler.on_sequenced_data(soupbintcp::sequenced_data_view(packet));
+            nextSeq++;
+            break;
+        case('H'): // heartbeat coming from server
+            handler.on_server_heartbeat(soupbintcp::server_heartbeat_view(packet));
+            break;
+        case('Z'): // server end of session
+            shuttingDown = true; // nothing more is coming
+            handler.on_end_of_session(soupbintcp::end_of_session_view(packet));
+            break;
+        // from client
+        case('L'): // login request
+            handler.on_login_request(soupbintcp::login_request_view(packet));
+            break;
+        case('U'):
+            handler.on_unsequenced_data(soupbintcp::unsequenced_data_view(packet));
+            break;
+        case('R'):
+            handler.on_client_heartbeat(soupbintcp::client_heartbeat_view(packet));
+            break;
+        case('O'):
+            handler.on_logout_request(soupbintcp::logout_request_view(packet));
+            break;
+        default:
+            // unknown packet type, the length is good so skip it
+            break;
+    }
+    return true;
+}
+
+/***
+ * A connection whose on_ methods are resolved at compile time. DERIVED
+ * inherits from SoupBinStaticConnection<DERIVED>, is final, and defines
+ * whichever on_ methods it wants (the rest are the empty defaults). Each
+ * receive makes 1 virtual call, and every packet in it goes to DERIVED's
+ * handlers directly, where they can be inlined into the read loop.
+ *
+ * SoupBinConnection calls the handlers, so they must be public (or
+ * SoupBinConnection a friend).
+ */
+template<typename DERIVED>
+class SoupBinStaticConnection : public SoupBinConnection
+{
+    public:
+    using SoupBinConnection::SoupBinConnection;
+
+    /***
+     * batches go to DERIVED's on_sequenced_data, unless it has its own on_sequenced_batch
+     */
+    void on_sequenced_batch(std::span<const soupbintcp::sequenced_message> batch) override
+    {
+        DERIVED& derived = static_cast<DERIVED&>(*this);
+        for(const soupbintcp::sequenced_message& msg : batch)
+        {
+            nextSeq = msg.seq;
+            derived.on_sequenced_data(msg.view);
+        }
+    }
+
+    protected:
+    void frame_received(soupbintcp::receive_buffer& buffer) override
+    {
+        // a final class's methods need no virtual call
+        static_assert(std::is_final_v<DERIVED>, "a static connection must be final");
+        frame_packets(static_cast<DERIVED&>(*this), buffer);
+    }
+};
@@ -0,0 +1,174 @@
+#pragma once
+#include "soupbintcp.h"
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <span>
+#include <string_view>
+#include <vector>
+#include <stdexcept>
+
+/***
+ * Framing of outgoing packets. A SoupBin packet is a 2 byte big endian length,
+ * a 1 byte packet type, and then the rest of the packet. The header is written
+ * into a slot at the front of a shared buffer and the payload is copied in
+ * behind it, once, no matter how many connections send it.
+ */
+namespace soupbintcp {
+
+constexpr size_t HEADER_LEN = 3;
+
+/***
+ * Write the 3 byte header
+ * @param out where to write (at least HEADER_LEN bytes)
+ * @param packetType the packet type ('S', 'U', etc.)
+ * @param bodyLength the number of bytes that follow the header
+ */
+inline void write_header(unsigned char* out, char packetType, size_t bodyLength)
+{
+    if (bodyLength + 1 > UINT16_MAX)
+        throw std::invalid_argument("Size too big");
+    uint16_t sz = swap_endian_bytes<uint16_t>((uint16_t)(bodyLength + 1));
+    memcpy(out, &sz, sizeof(sz));
+    out[2] = (unsigned char)packetType;
+}
+
+/***
+ * Payloads can come in as bytes or characters, but go out as unsigned char
+ */
+inline std::span<const unsigned char> as_uchars(std::span<const std::byte> in)
+{
+    return std::span<const unsigned char>((const unsigned char*)in.data(), in.size());
+}
+
+inline std::span<const unsigned char> as_uchars(std::string_view in)
+{
+    return std::span<const unsigned char>((const unsigned char*)in.data(), in.size());
+}
+
+/***
+ * A reference counted block of bytes that does not change once it is built.
+ * A packet is framed into one of these once, and then every write queue and
+ * the replay store share it.
+ */
+class shared_buffer
+{
+    public:
+    void add_ref() { refs.fetch_add(1, std::memory_order_relaxed); }
+    void release()
+    {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            destroy();
+    }
+    /***
+     * @returns the references there are. 1 for the only holder, which no one
+     * else can get a reference from, means nobody else is reading the bytes
+     */
+    uint32_t use_count() const { return refs.load(std::memory_order_acquire); }
+
+    protected:
+    virtual ~shared_buffer() = default;
+    /***
+     * called when the last reference goes away
+     */
+    virtual void destroy() = 0;
+
+    private:
+    std::atomic<uint32_t> refs = 0;
+};
+
+/***
+ * A shared_buffer that lives on the heap, with the bytes right behind it
+ */
+class heap_buffer : public shared_buffer
+{
+    public:
+    static heap_buffer* create(size_t length)
+    {
+        void* mem = ::operator new(sizeof(heap_buffer) + length);
+        return new(mem) heap_buffer();
+    }
+    unsigned char* data() { return reinterpret_cast<unsigned char*>(this + 1); }
+
+    protected:
+    void destroy() override
+    {
+        this->~heap_buffer();
+        ::operator delete(this);
+    }
+};
+
+/***
+ * A counted reference to a shared_buffer
+ */
+class buffer_ref
+{
+    public:
+    buffer_ref() = default;
+    explicit buffer_ref(shared_buffer* in) : buffer(in) { if (buffer != nullptr) buffer->add_ref(); }
+    buffer_ref(const buffer_ref& in) : buffer(in.buffer) { if (buffer != nullptr) buffer->add_ref(); }
+    buffer_ref(buffer_ref&& in) noexcept : buffer(in.buffer) { in.buffer = nullptr; }
+    buffer_ref& operator=(buffer_ref in) noexcept { std::swap(buffer, in.buffer); return *this; }
+    ~buffer_ref() { if (buffer != nullptr) buffer->release(); }
+    shared_buffer* get() const { return buffer; }
+
+    private:
+    shared_buffer* buffer = nullptr;
+};
+
+/***
+ * Some bytes (usually one framed packet) inside a shared_buffer. Holding the
+ * slice keeps the bytes alive.
+ */
+struct buffer_slice
+{
+    buffer_ref owner;
+    const unsigned char* bytes = nullptr;
+    size_t length = 0;
+
+    const unsigned char* data() const { return bytes; }
+    size_t size() const { return length; }
+    std::span<const unsigned char> span() const { return std::span<const unsigned char>(bytes, length); }
+};
+
+/***
+ * A buffer from the calling thread's buffer_pool (see soup_bin_buffer_pool.h)
+ * @param length the bytes wanted
+ * @param data set to where they go
+ */
+shared_buffer* acquire_buffer(size_t length, unsigned char*& data);
+
+/***
+ * Frame a body behind a new header, once
+ * @param packetType the packet type
+ * @param body the bytes that follow the header
+ * @returns the whole packet
+ */
+inline buffer_slice make_frame(char packetType, std::span<const unsigned char> body)
+{
+    unsigned char* data;
+    shared_buffer* buffer = acquire_buffer(HEADER_LEN + body.size(), data);
+    buffer_slice frame{ buffer_ref(buffer), data, HEADER_LEN + body.size() };
+    write_header(data, packetType, body.size());
+    if (!body.empty())
+        memcpy(data + HEADER_LEN, body.data(), body.size());
+    return frame;
+}
+
+/***
+ * Share a packet that is already framed (i.e. from message<SIZE>)
+ * @param record the whole packet, header included
+ * @returns the whole packet
+ */
+inline buffer_slice make_frame(std::span<const unsigned char> record)
+{
+    unsigned char* data;
+    shared_buffer* buffer = acquire_buffer(record.size(), data);
+    buffer_slice frame{ buffer_ref(buffer), data, record.size() };
+    memcpy(data, record.data(), record.size());
+    return frame;
+}
+
+} // end namespace soupbintcp
@@ -0,0 +1,49 @@
+#include "soup_bin_io_context_pool.h"
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+
+SoupBinIoContextPool::SoupBinIoContextPool(size_t size, bool pinThreads, size_t firstCpu)
+{
+    if (size == 0)
+        size = 1;
+    size_t cores = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    for(size_t i = 0; i < size; ++i)
+    {
+        // 1 thread per io_context, so the io_context can skip its own locking
+        contexts.emplace_back(std::make_unique<boost::asio::io_context>(1));
+        workGuards.emplace_back(contexts.back()->get_executor());
+    }
+    for(size_t i = 0; i < size; ++i)
+    {
+        boost::asio::io_context* context = contexts[i].get();
+        size_t cpu = (firstCpu + i) % cores;
+        threads.emplace_back([context, pinThreads, cpu]() {
+            if (pinThreads)
+                pin_current_thread(cpu);
+            context->run();
+        });
+    }
+}
+
+SoupBinIoContextPool::~SoupBinIoContextPool()
+{
+    join();
+}
+
+void SoupBinIoContextPool::join()
+{
+    for(work_guard& guard : workGuards)
+        guard.reset();
+    for(std::thread& thread : threads)
+        if (thread.joinable())
+            thread.join();
+}
+
+bool SoupBinIoContextPool::pin_current_thread(size_t cpu)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
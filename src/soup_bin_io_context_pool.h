@@ -0,0 +1,54 @@
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <utility> // boost asio needs std::exchange in C++20
+#include <boost/asio.hpp>
+
+/***
+ * A set of io_contexts, each run by its own thread. Everything posted to one
+ * io_context runs on that one thread, so whatever lives there needs no locks.
+ * The threads can be pinned to cores.
+ */
+class SoupBinIoContextPool
+{
+    public:
+    /***
+     * Start the threads
+     * @param size the number of io_contexts (and threads)
+     * @param pinThreads true to pin thread i to core (firstCpu + i) % the number of cores
+     * @param firstCpu the core of the first thread
+     */
+    SoupBinIoContextPool(size_t size, bool pinThreads = false, size_t firstCpu = 0);
+    /***
+     * Waits for the threads (see join())
+     */
+    ~SoupBinIoContextPool();
+    SoupBinIoContextPool(const SoupBinIoContextPool&) = delete;
+    SoupBinIoContextPool& operator=(const SoupBinIoContextPool&) = delete;
+
+    size_t size() const { return contexts.size(); }
+    boost::asio::io_context& get(size_t i) { return *contexts[i]; }
+    /***
+     * @returns the io_contexts in turn
+     */
+    boost::asio::io_context& next() { return get(nextContext.fetch_add(1, std::memory_order_relaxed) % contexts.size()); }
+    /***
+     * Let the threads finish once they run out of work, and wait for them
+     */
+    void join();
+    /***
+     * Pin the calling thread to a core
+     * @returns false if that was not possible
+     */
+    static bool pin_current_thread(size_t cpu);
+
+    private:
+    using work_guard = boost::asio::executor_work_guard<boost::asio::io_context::executor_type>;
+    std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+    std::vector<work_guard> workGuards; // keep the threads running while idle
+    std::vector<std::thread> threads;
+    std::atomic<size_t> nextContext = 0;
+};
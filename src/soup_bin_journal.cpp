@@ -0,0 +1,336 @@
+#include "soup_bin_journal.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/***
+ * One data file and its index, both mapped. The segment is a shared_buffer so
+ * that slices of it keep the mapping alive.
+ */
+class SoupBinJournal::Segment : public soupbintcp::shared_buffer
+{
+    public:
+    struct IndexHeader
+    {
+        char magic[8];
+        char session[16];
+        uint64_t firstSeq;
+        uint64_t count; // written last, so everything it covers is complete
+        uint64_t dataUsed;
+        uint64_t dataCapacity;
+        uint64_t indexCapacity;
+    };
+    static constexpr char MAGIC[8] = { 'S', 'O', 'U', 'P', 'J', 'N', 'L', '1' };
+
+    /***
+     * Create a new segment
+     */
+    Segment(const std::string& dataPath, const std::string& indexPath, uint64_t firstSeq, const std::string& session,
+            size_t dataCapacity, size_t indexCapacity)
+    {
+        indexSize = sizeof(IndexHeader) + indexCapacity * sizeof(uint64_t);
+        indexMap = map_file(indexPath, indexSize, true, indexFd);
+        header = (IndexHeader*)indexMap;
+        memcpy(header->magic, MAGIC, sizeof(MAGIC));
+        memset(header->session, 0, sizeof(header->session));
+        strncpy(header->session, session.c_str(), sizeof(header->session));
+        header->firstSeq = firstSeq;
+        header->count = 0;
+        header->dataUsed = 0;
+        header->dataCapacity = dataCapacity;
+        header->indexCapacity = indexCapacity;
+        offsets = (uint64_t*)(indexMap + sizeof(IndexHeader));
+        dataSize = dataCapacity;
+        try
+        {
+            data = map_file(dataPath, dataSize, true, dataFd);
+        }
+        catch(...)
+        {
+            unmap();
+            throw;
+        }
+    }
+    /***
+     * Open an existing segment
+     */
+    Segment(const std::string& dataPath, const std::string& indexPath)
+    {
+        indexMap = map_file(indexPath, indexSize, false, indexFd);
+        header = (IndexHeader*)indexMap;
+        if (indexSize < sizeof(IndexHeader) || memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0
+                || indexSize < sizeof(IndexHeader) + header->indexCapacity * sizeof(uint64_t))
+        {
+            unmap();
+            throw std::runtime_error("Not a journal index: " + indexPath);
+        }
+        offsets = (uint64_t*)(indexMap + sizeof(IndexHeader));
+        // a torn or corrupt index would send length_of() and the readers out of bounds
+        if (header->count > header->indexCapacity || header->dataUsed > header->dataCapacity
+                || (header->count > 0 && offsets[header->count - 1] > header->dataUsed))
+        {
+            unmap();
+            throw std::runtime_error("Journal index is corrupt: " + indexPath);
+        }
+        try
+        {
+            data = map_file(dataPath, dataSize, false, dataFd);
+        }
+        catch(...)
+        {
+            unmap();
+            throw;
+        }
+        if (dataSize < header->dataUsed)
+        {
+            unmap();
+            throw std::runtime_error("Journal data file is too short: " + dataPath);
+        }
+    }
+    size_t length_of(uint64_t pos) const
+    {
+        uint64_t end = (pos + 1 < header->count ? offsets[pos + 1] : header->dataUsed);
+        return end - offsets[pos];
+    }
+    void sync()
+    {
+        if (header->dataUsed > 0)
+            msync(data, header->dataUsed, MS_SYNC);
+        msync(indexMap, sizeof(IndexHeader) + header->count * sizeof(uint64_t), MS_SYNC);
+    }
+
+    unsigned char* data = nullptr;
+    IndexHeader* header = nullptr;
+    uint64_t* offsets = nullptr;
+
+    protected:
+    void destroy() override { delete this; }
+    ~Segment() { unmap(); }
+
+    private:
+    /***
+     * @param size the size to make a new file, or set to the size of an existing one
+     */
+    static unsigned char* map_file(const std::string& path, size_t& size, bool create, int& fd)
+    {
+        fd = ::open(path.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+        if (fd < 0)
+            throw std::runtime_error("Unable to open " + path);
+        if (create)
+        {
+            if (::ftruncate(fd, size) != 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("Unable to size " + path);
+            }
+        }
+        else
+        {
+            off_t end = ::lseek(fd, 0, SEEK_END);
+            size = (end > 0 ? (size_t)end : 0);
+        }
+        void* mem = (size > 0 ? ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED);
+        if (mem == MAP_FAILED)
+        {
+            ::close(fd);
+            throw std::runtime_error("Unable to map " + path);
+        }
+        return (unsigned char*)mem;
+    }
+    void unmap()
+    {
+        if (data != nullptr)
+            ::munmap(data, dataSize);
+        if (indexMap != nullptr)
+            ::munmap(indexMap, indexSize);
+        if (dataFd >= 0)
+            ::close(dataFd);
+        if (indexFd >= 0)
+            ::close(indexFd);
+        data = indexMap = nullptr;
+        dataFd = indexFd = -1;
+    }
+
+    unsigned char* indexMap = nullptr;
+    size_t indexSize = 0;
+    size_t dataSize = 0;
+    int dataFd = -1;
+    int indexFd = -1;
+};
+
+/***
+ * @returns the file name (without extension) of the segment starting at seq
+ */
+static std::string segment_name(const std::string& directory, uint64_t firstSeq)
+{
+    std::stringstream ss;
+    ss << std::setw(20) << std::setfill('0') << firstSeq;
+    return (std::filesystem::path(directory) / ss.str()).string();
+}
+
+SoupBinJournal::SoupBinJournal(const std::string& directory, const std::string& sessionId)
+        : SoupBinJournal(directory, sessionId, Options())
+{
+}
+
+SoupBinJournal::SoupBinJournal(const std::string& directory, const std::string& sessionId, const Options& options)
+        : directory(directory), sessionId(sessionId), options(options), lastSync(std::chrono::steady_clock::now())
+{
+    std::filesystem::create_directories(directory);
+    // the index names sort in sequence order
+    std::vector<std::string> indexes;
+    for(const auto& entry : std::filesystem::directory_iterator(directory))
+        if (entry.path().extension() == ".idx")
+            indexes.push_back(entry.path().string());
+    std::sort(indexes.begin(), indexes.end());
+    try
+    {
+        for(const std::string& indexPath : indexes)
+            open_segment(indexPath);
+    }
+    catch(...)
+    {
+        for(Segment* segment : segments)
+            segment->release();
+        throw;
+    }
+    if (segments.empty())
+        new_segment(1);
+    else
+        this->sessionId = std::string(segments.back()->header->session,
+                strnlen(segments.back()->header->session, sizeof(Segment::IndexHeader::session)));
+}
+
+SoupBinJournal::~SoupBinJournal()
+{
+    if (options.syncPolicy != Options::SyncPolicy::NONE)
+        sync();
+    for(Segment* segment : segments)
+        segment->release();
+}
+
+void SoupBinJournal::open_segment(const std::string& indexPath)
+{
+    std::filesystem::path dataPath(indexPath);
+    dataPath.replace_extension(".log");
+    Segment* segment = new Segment(dataPath.string(), indexPath);
+    segment->add_ref();
+    segments.push_back(segment);
+}
+
+void SoupBinJournal::new_segment(uint64_t firstSeq)
+{
+    std::string name = segment_name(directory, firstSeq);
+    Segment* segment = new Segment(name + ".log", name + ".idx", firstSeq, sessionId,
+            options.segmentSize, options.maxMessagesPerSegment);
+    segment->add_ref();
+    segments.push_back(segment);
+}
+
+soupbintcp::buffer_slice SoupBinJournal::append(std::span<const unsigned char> frame)
+{
+    Segment* segment = segments.back();
+    Segment::IndexHeader* header = segment->header;
+    if (header->dataUsed + frame.size() > header->dataCapacity || header->count == header->indexCapacity)
+    {
+        if (frame.size() > options.segmentSize)
+            throw std::invalid_argument("Message is bigger than a journal segment");
+        // the old segment is full, make sure it is all on disk before moving on
+        if (options.syncPolicy != Options::SyncPolicy::NONE)
+            segment->sync();
+        new_segment(next_seq());
+        segment = segments.back();
+        header = segment->header;
+    }
+    unsigned char* out = segment->data + header->dataUsed;
+    memcpy(out, frame.data(), frame.size());
+    segment->offsets[header->count] = header->dataUsed;
+    header->dataUsed += frame.size();
+    header->count++;
+
+    // group commit
+    unsynced++;
+    switch(options.syncPolicy)
+    {
+        case(Options::SyncPolicy::EVERY_N):
+            if (unsynced >= options.syncEveryN)
+                sync();
+            break;
+        case(Options::SyncPolicy::PERIODIC):
+            sync_if_due();
+            break;
+        default:
+            break;
+    }
+    return soupbintcp::buffer_slice{ soupbintcp::buffer_ref(segment), out, frame.size() };
+}
+
+const SoupBinJournal::Segment* SoupBinJournal::find_segment(uint64_t seq) const
+{
+    if (!contains(seq))
+        return nullptr;
+    // the last segment that starts at or before seq
+    auto itr = std::upper_bound(segments.begin(), segments.end(), seq,
+            [](uint64_t s, const Segment* segment) { return s < segment->header->firstSeq; });
+    return *(itr - 1);
+}
+
+soupbintcp::buffer_slice SoupBinJournal::get(uint64_t seq) const
+{
+    const Segment* segment = find_segment(seq);
+    if (segment == nullptr)
+        return soupbintcp::buffer_slice();
+    uint64_t pos = seq - segment->header->firstSeq;
+    return soupbintcp::buffer_slice{ soupbintcp::buffer_ref(const_cast<Segment*>(segment)),
+            segment->data + segment->offsets[pos], segment->length_of(pos) };
+}
+
+soupbintcp::buffer_slice SoupBinJournal::get_range(uint64_t from, size_t maxBytes, uint64_t& count) const
+{
+    count = 0;
+    const Segment* segment = find_segment(from);
+    if (segment == nullptr)
+        return soupbintcp::buffer_slice();
+    uint64_t first = from - segment->header->firstSeq;
+    size_t length = 0;
+    for(uint64_t pos = first; pos < segment->header->count; ++pos)
+    {
+        size_t frameLength = segment->length_of(pos);
+        if (count > 0 && length + frameLength > maxBytes)
+            break;
+        length += frameLength;
+        count++;
+    }
+    return soupbintcp::buffer_slice{ soupbintcp::buffer_ref(const_cast<Segment*>(segment)),
+            segment->data + segment->offsets[first], length };
+}
+
+void SoupBinJournal::sync()
+{
+    segments.back()->sync();
+    unsynced = 0;
+    lastSync = std::chrono::steady_clock::now();
+}
+
+void SoupBinJournal::sync_if_due()
+{
+    if (options.syncPolicy == Options::SyncPolicy::PERIODIC && unsynced > 0
+            && std::chrono::steady_clock::now() - lastSync >= options.syncInterval)
+        sync();
+}
+
+uint64_t SoupBinJournal::first_seq() const
+{
+    return segments.front()->header->firstSeq;
+}
+
+uint64_t SoupBinJournal::next_seq() const
+{
+    return segments.back()->header->firstSeq + segments.back()->header->count;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include "soup_bin_framing.h"
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <span>
+
+/***
+ * An on-disk store of sequenced messages, so that history (and the session)
+ * survives a restart.
+ *
+ * The journal is a set of segments. Each segment is a data file of framed
+ * messages, appended one after another, and an index file holding a small
+ * header (session, first sequence number, count) and one offset per message.
+ * Both files are memory-mapped. Opening an existing journal reads only the
+ * index headers, it does not scan the data.
+ *
+ * Messages handed out by get() and get_range() point straight into the mapped
+ * pages, and keep their segment mapped for as long as they are held.
+ *
+ * Not thread safe.
+ */
+class SoupBinJournal
+{
+    public:
+    struct Options
+    {
+        enum class SyncPolicy
+        {
+            NONE, // leave it to the OS
+            PERIODIC, // sync when syncInterval has passed since the last sync (see sync_if_due())
+            EVERY_N // sync every syncEveryN messages
+        };
+        SyncPolicy syncPolicy = SyncPolicy::NONE;
+        std::chrono::milliseconds syncInterval{100};
+        uint64_t syncEveryN = 1000;
+        size_t segmentSize = 64 * 1024 * 1024; // bytes of messages per segment
+        size_t maxMessagesPerSegment = 1024 * 1024;
+    };
+
+    /***
+     * Open (or create) a journal
+     * @param directory where the segments live (created if needed)
+     * @param sessionId the session, only used when the journal is new
+     * @param options sizes and sync policy
+     */
+    SoupBinJournal(const std::string& directory, const std::string& sessionId, const Options& options);
+    SoupBinJournal(const std::string& directory, const std::string& sessionId);
+    ~SoupBinJournal();
+    SoupBinJournal(const SoupBinJournal&) = delete;
+    SoupBinJournal& operator=(const SoupBinJournal&) = delete;
+
+    /***
+     * Add a framed message
+     * @param frame the whole packet
+     * @returns the message in the mapped segment
+     */
+    soupbintcp::buffer_slice append(std::span<const unsigned char> frame);
+    /***
+     * @returns the framed message, or an empty slice if it is not in the journal
+     */
+    soupbintcp::buffer_slice get(uint64_t seq) const;
+    /***
+     * Get a run of messages that sit next to each other in a segment
+     * @param from the first sequence number wanted
+     * @param maxBytes the most bytes to return (at least 1 message is returned)
+     * @param count set to the number of messages in the slice
+     * @returns the framed messages, or an empty slice if from is not in the journal
+     */
+    soupbintcp::buffer_slice get_range(uint64_t from, size_t maxBytes, uint64_t& count) const;
+    /***
+     * Flush everything appended so far to disk
+     */
+    void sync();
+    /***
+     * With SyncPolicy::PERIODIC, sync if anything is unsynced and syncInterval has
+     * passed since the last sync. append() checks this itself, call it from a timer
+     * as well so that the last messages before a quiet spell reach the disk
+     */
+    void sync_if_due();
+    bool contains(uint64_t seq) const { return seq >= first_seq() && seq < next_seq(); }
+    uint64_t first_seq() const;
+    uint64_t next_seq() const;
+    const std::string& get_session_id() const { return sessionId; }
+
+    private:
+    class Segment;
+    void open_segment(const std::string& indexPath);
+    void new_segment(uint64_t firstSeq);
+    const Segment* find_segment(uint64_t seq) const;
+
+    std::string directory;
+    std::string sessionId;
+    Options options;
+    std::vector<Segment*> segments; // oldest first, each holds a reference on itself
+    uint64_t unsynced = 0; // messages appended since the last sync
+    std::chrono::steady_clock::time_point lastSync;
+};
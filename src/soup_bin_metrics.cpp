@@ -0,0 +1,191 @@
+#include "soup_bin_metrics.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+namespace soupbintcp {
+
+void histogram_snapshot::add(const histogram_snapshot& in)
+{
+    for(size_t i = 0; i < BUCKETS; ++i)
+        buckets[i] += in.buckets[i];
+    count += in.count;
+    sumNs += in.sumNs;
+    maxNs = std::max(maxNs, in.maxNs);
+}
+
+uint64_t histogram_snapshot::percentile(double pct) const
+{
+    if (count == 0)
+        return 0;
+    uint64_t wanted = std::max<uint64_t>(1, pct * count);
+    uint64_t seen = 0;
+    for(size_t i = 0; i < BUCKETS; ++i)
+    {
+        seen += buckets[i];
+        if (seen >= wanted)
+            return std::min<uint64_t>(maxNs, (i == 0 ? 0 : (1ull << i) - 1));
+    }
+    return maxNs;
+}
+
+histogram_snapshot latency_histogram::snapshot() const
+{
+    histogram_snapshot result;
+    for(size_t i = 0; i < histogram_snapshot::BUCKETS; ++i)
+        result.buckets[i] = buckets[i].get();
+    result.count = count.get();
+    result.sumNs = sumNs.get();
+    result.maxNs = maxNs.get();
+    return result;
+}
+
+void metrics_snapshot::add(const metrics_snapshot& in)
+{
+    sessions += in.sessions;
+    for(size_t i = 0; i < PACKET_TYPE_COUNT; ++i)
+    {
+        packetsIn[i] += in.packetsIn[i];
+        packetsOut[i] += in.packetsOut[i];
+    }
+    bytesIn += in.bytesIn;
+    bytesOut += in.bytesOut;
+    receives += in.receives;
+    writes += in.writes;
+    queueBytes += in.queueBytes;
+    queueMessages += in.queueMessages;
+    queueHighWaterBytes = std::max(queueHighWaterBytes, in.queueHighWaterBytes);
+    queueHighWaterMessages = std::max(queueHighWaterMessages, in.queueHighWaterMessages);
+    slowConsumerEvents += in.slowConsumerEvents;
+    droppedMessages += in.droppedMessages;
+    spilledBytes += in.spilledBytes;
+    replayedMessages += in.replayedMessages;
+    replayedBytes += in.replayedBytes;
+    heartbeatsSent += in.heartbeatsSent;
+    heartbeatMisses += in.heartbeatMisses;
+    deadPeers += in.deadPeers;
+    handlerTime.add(in.handlerTime);
+    reconnects += in.reconnects;
+    recoveryTime.add(in.recoveryTime);
+    publishedSequenced += in.publishedSequenced;
+    publishedUnsequenced += in.publishedUnsequenced;
+    publishBatches += in.publishBatches;
+}
+
+/***
+ * Calls func(name, value) for every plain number in a snapshot, in order
+ */
+template<typename FUNC>
+static void for_each_value(const metrics_snapshot& in, FUNC func)
+{
+    func("sessions", in.sessions);
+    func("bytes_in", in.bytesIn);
+    func("bytes_out", in.bytesOut);
+    func("receives", in.receives);
+    func("writes", in.writes);
+    func("queue_bytes", in.queueBytes);
+    func("queue_messages", in.queueMessages);
+    func("queue_high_water_bytes", in.queueHighWaterBytes);
+    func("queue_high_water_messages", in.queueHighWaterMessages);
+    func("slow_consumer_events", in.slowConsumerEvents);
+    func("dropped_messages", in.droppedMessages);
+    func("spilled_bytes", in.spilledBytes);
+    func("replayed_messages", in.replayedMessages);
+    func("replayed_bytes", in.replayedBytes);
+    func("heartbeats_sent", in.heartbeatsSent);
+    func("heartbeat_misses", in.heartbeatMisses);
+    func("dead_peers", in.deadPeers);
+    func("reconnects", in.reconnects);
+    func("published_sequenced", in.publishedSequenced);
+    func("published_unsequenced", in.publishedUnsequenced);
+    func("publish_batches", in.publishBatches);
+}
+
+std::string metrics_snapshot::to_text() const
+{
+    std::stringstream ss;
+    for_each_value(*this, [&ss](const char* name, uint64_t value) { ss << name << ' ' << value << '\n'; });
+    for(size_t i = 0; i < PACKET_TYPE_COUNT; ++i)
+        ss << "packets_in{type=\"" << PACKET_TYPES[i] << "\"} " << packetsIn[i] << '\n';
+    for(size_t i = 0; i < PACKET_TYPE_COUNT; ++i)
+        ss << "packets_out{type=\"" << PACKET_TYPES[i] << "\"} " << packetsOut[i] << '\n';
+    auto histogram = [&ss](const char* name, const histogram_snapshot& values) {
+        ss << name << "_count " << values.count << '\n'
+                << name << "_sum_ns " << values.sumNs << '\n'
+                << name << "_p50_ns " << values.percentile(0.50) << '\n'
+                << name << "_p99_ns " << values.percentile(0.99) << '\n'
+                << name << "_p999_ns " << values.percentile(0.999) << '\n'
+                << name << "_max_ns " << values.maxNs << '\n';
+    };
+    histogram("handler_time", handlerTime);
+    histogram("recovery_time", recoveryTime);
+    return ss.str();
+}
+
+std::string metrics_snapshot::to_json() const
+{
+    std::stringstream ss;
+    ss << '{';
+    for_each_value(*this, [&ss](const char* name, uint64_t value) { ss << '"' << name << "\":" << value << ','; });
+    auto by_type = [&ss](const char* name, const std::array<uint64_t, PACKET_TYPE_COUNT>& values) {
+        ss << '"' << name << "\":{";
+        for(size_t i = 0; i < PACKET_TYPE_COUNT; ++i)
+            ss << (i > 0 ? "," : "") << '"' << PACKET_TYPES[i] << "\":" << values[i];
+        ss << "},";
+    };
+    by_type("packets_in", packetsIn);
+    by_type("packets_out", packetsOut);
+    auto histogram = [&ss](const char* name, const histogram_snapshot& values) {
+        ss << '"' << name << "\":{\"count\":" << values.count << ",\"sum_ns\":" << values.sumNs
+                << ",\"p50_ns\":" << values.percentile(0.50) << ",\"p99_ns\":" << values.percentile(0.99)
+                << ",\"p999_ns\":" << values.percentile(0.999) << ",\"max_ns\":" << values.maxNs
+                << ",\"buckets\":[";
+        for(size_t i = 0; i < histogram_snapshot::BUCKETS; ++i)
+            ss << (i > 0 ? "," : "") << values.buckets[i];
+        ss << "]}";
+    };
+    histogram("handler_time", handlerTime);
+    ss << ',';
+    histogram("recovery_time", recoveryTime);
+    ss << '}';
+    return ss.str();
+}
+
+metrics_exporter::metrics_exporter(std::function<metrics_snapshot()> source, const std::string& path,
+        std::chrono::milliseconds interval, Format format)
+        : source(std::move(source)), path(path), interval(interval), format(format)
+{
+    thread = std::thread([this]() {
+        std::unique_lock lock(mutex);
+        while(!stopping)
+        {
+            wake.wait_for(lock, this->interval, [this]() { return stopping; });
+            lock.unlock();
+            write();
+            lock.lock();
+        }
+    });
+}
+
+metrics_exporter::~metrics_exporter()
+{
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+void metrics_exporter::write()
+{
+    metrics_snapshot snapshot = source();
+    std::ofstream out(path, std::ios::app);
+    if (format == Format::JSON)
+        out << snapshot.to_json() << '\n';
+    else
+        out << snapshot.to_text() << '\n';
+}
+
+} // end namespace soupbintcp
@@ -0,0 +1,207 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/***
+ * Counters and histograms for sessions and servers.
+ *
+ * Each counter has 1 writer (the thread the session or server runs on), so an
+ * update is a relaxed load and store, not a locked add. Any thread can read
+ * them at any time, and sees a value that is at most a little behind.
+ */
+namespace soupbintcp {
+
+/***
+ * A counter with 1 writer and any number of readers
+ */
+class relaxed_counter
+{
+    public:
+    void add(uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void set(uint64_t n) { value.store(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+    private:
+    std::atomic<uint64_t> value = 0;
+};
+
+/***
+ * A snapshot of a latency histogram. Bucket i counts values below 2^i ns
+ * (and at least 2^(i-1) ns). The last bucket takes everything bigger.
+ */
+struct histogram_snapshot
+{
+    static constexpr size_t BUCKETS = 40; // the last bucket starts at ~4.5 minutes
+    std::array<uint64_t, BUCKETS> buckets{};
+    uint64_t count = 0;
+    uint64_t sumNs = 0;
+    uint64_t maxNs = 0;
+
+    void add(const histogram_snapshot& in);
+    /***
+     * @param pct 0 to 1
+     * @returns the upper bound (ns) of the bucket the percentile falls in
+     */
+    uint64_t percentile(double pct) const;
+};
+
+/***
+ * A histogram of durations, with 1 writer and any number of readers
+ */
+class latency_histogram
+{
+    public:
+    void record(uint64_t ns)
+    {
+        size_t bucket = (ns == 0 ? 0 : 64 - __builtin_clzll(ns));
+        if (bucket >= histogram_snapshot::BUCKETS)
+            bucket = histogram_snapshot::BUCKETS - 1;
+        buckets[bucket].add();
+        count.add();
+        sumNs.add(ns);
+        if (ns > maxNs.get())
+            maxNs.set(ns);
+    }
+    histogram_snapshot snapshot() const;
+
+    private:
+    std::array<relaxed_counter, histogram_snapshot::BUCKETS> buckets;
+    relaxed_counter count;
+    relaxed_counter sumNs;
+    relaxed_counter maxNs;
+};
+
+/***
+ * The packet types, as indexes into the per type counters
+ */
+constexpr size_t PACKET_TYPE_COUNT = 11; // the 10 SoupBinTCP packets, and anything else
+constexpr char PACKET_TYPES[PACKET_TYPE_COUNT] = { '+', 'A', 'J', 'S', 'H', 'Z', 'L', 'U', 'R', 'O', '?' };
+inline size_t packet_type_index(unsigned char packetType)
+{
+    switch(packetType)
+    {
+        case('+'): return 0;
+        case('A'): return 1;
+        case('J'): return 2;
+        case('S'): return 3;
+        case('H'): return 4;
+        case('Z'): return 5;
+        case('L'): return 6;
+        case('U'): return 7;
+        case('R'): return 8;
+        case('O'): return 9;
+    }
+    return 10;
+}
+
+/***
+ * Everything counted about 1 or more sessions (and the server), at a point in time
+ */
+struct metrics_snapshot
+{
+    uint64_t sessions = 0; // sessions added up in this snapshot
+    std::array<uint64_t, PACKET_TYPE_COUNT> packetsIn{}; // by PACKET_TYPES
+    std::array<uint64_t, PACKET_TYPE_COUNT> packetsOut{}; // queued for the socket, by PACKET_TYPES
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    uint64_t receives = 0; // socket reads
+    uint64_t writes = 0; // socket writes
+    uint64_t queueBytes = 0; // waiting for the socket now
+    uint64_t queueMessages = 0; // waiting for the socket now
+    uint64_t queueHighWaterBytes = 0; // the most of any 1 session
+    uint64_t queueHighWaterMessages = 0; // the most of any 1 session
+    uint64_t slowConsumerEvents = 0;
+    uint64_t droppedMessages = 0;
+    uint64_t spilledBytes = 0;
+    uint64_t replayedMessages = 0;
+    uint64_t replayedBytes = 0;
+    uint64_t heartbeatsSent = 0;
+    uint64_t heartbeatMisses = 0; // heartbeat intervals in which nothing came in
+    uint64_t deadPeers = 0; // sessions closed for hearing nothing
+    histogram_snapshot handlerTime; // time spent in the on_ methods, per receive
+    uint64_t reconnects = 0; // client side, logged in again after a drop
+    histogram_snapshot recoveryTime; // client side, from a drop until logged in again
+    // server only
+    uint64_t publishedSequenced = 0;
+    uint64_t publishedUnsequenced = 0;
+    uint64_t publishBatches = 0; // batches taken off the publish ring
+
+    /***
+     * add another snapshot to this one (the high water marks take the max)
+     */
+    void add(const metrics_snapshot& in);
+    std::string to_text() const;
+    std::string to_json() const;
+};
+
+/***
+ * The live counters of 1 session. On its own cache lines, so the session's
+ * thread does not share them with anything else.
+ */
+struct alignas(64) session_metrics
+{
+    std::array<relaxed_counter, PACKET_TYPE_COUNT> packetsIn;
+    std::array<relaxed_counter, PACKET_TYPE_COUNT> packetsOut;
+    relaxed_counter bytesIn;
+    relaxed_counter bytesOut;
+    relaxed_counter queueBytes;
+    relaxed_counter queueMessages;
+    relaxed_counter replayedMessages;
+    relaxed_counter replayedBytes;
+    relaxed_counter heartbeatsSent;
+    relaxed_counter heartbeatMisses;
+    relaxed_counter deadPeers;
+    latency_histogram handlerTime;
+    relaxed_counter reconnects;
+    latency_histogram recoveryTime;
+};
+
+/***
+ * Writes a snapshot every so often, on its own thread
+ */
+class metrics_exporter
+{
+    public:
+    enum class Format
+    {
+        TEXT,
+        JSON // 1 object per line
+    };
+    /***
+     * Start writing
+     * @param source makes the snapshot (called on the exporter's thread)
+     * @param path the file to append to
+     * @param interval how often
+     * @param format how to write it
+     */
+    metrics_exporter(std::function<metrics_snapshot()> source, const std::string& path,
+            std::chrono::milliseconds interval, Format format = Format::JSON);
+    /***
+     * Write 1 last snapshot, and stop
+     */
+    ~metrics_exporter();
+    metrics_exporter(const metrics_exporter&) = delete;
+    metrics_exporter& operator=(const metrics_exporter&) = delete;
+
+    private:
+    void write();
+
+    std::function<metrics_snapshot()> source;
+    std::string path;
+    std::chrono::milliseconds interval;
+    Format format;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread thread;
+};
+
+} // end namespace soupbintcp
@@ -0,0 +1,173 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring> // memcpy
+#include <bit>
+
+/***
+ * Fixed width ASCII integers (the NUMERIC fields of SoupBinTCP, i.e. sequence
+ * numbers). The value is right-justified and padded on the left.
+ *
+ * Both directions work 8 digits at a time inside a uint64_t (SWAR), and
+ * neither allocates or touches the locale.
+ */
+namespace soupbintcp {
+
+namespace numeric_detail {
+
+/***
+ * load 8 bytes so that the first byte in memory is the lowest byte
+ */
+inline uint64_t load8(const unsigned char* in)
+{
+    uint64_t val;
+    memcpy(&val, in, sizeof(val));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    val = __builtin_bswap64(val);
+#endif
+    return val;
+}
+
+inline void store8(unsigned char* out, uint64_t val)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    val = __builtin_bswap64(val);
+#endif
+    memcpy(out, &val, sizeof(val));
+}
+
+/***
+ * @returns true if all 8 bytes are '0' through '9'
+ */
+inline bool all_digits(uint64_t val)
+{
+    return (((val & 0xF0F0F0F0F0F0F0F0ull) | (((val + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4))
+            == 0x3333333333333333ull);
+}
+
+/***
+ * @returns true if all 8 bytes are padding (spaces or NULs)
+ */
+inline bool all_padding(uint64_t val)
+{
+    return val == 0x2020202020202020ull || val == 0;
+}
+
+/***
+ * Turn 8 ASCII digits into a number
+ */
+inline uint32_t parse8(uint64_t val)
+{
+    const uint64_t mask = 0x000000FF000000FFull;
+    const uint64_t mul1 = 0x000F424000000064ull; // 100 + (1000000 << 32)
+    const uint64_t mul2 = 0x0000271000000001ull; // 1 + (10000 << 32)
+    val -= 0x3030303030303030ull;
+    val = (val * 10) + (val >> 8);
+    return (uint32_t)((((val & mask) * mul1) + (((val >> 16) & mask) * mul2)) >> 32);
+}
+
+/***
+ * Turn a number less than 100,000,000 into 8 ASCII digits (with leading zeros)
+ */
+inline uint64_t format8(uint32_t in)
+{
+    // split into 32 bit lanes of 4 digits, then 16 bit lanes of 2 digits, then bytes
+    uint64_t merged = (in / 10000) | ((uint64_t)(in % 10000) << 32);
+    uint64_t hundreds = ((merged * 10486) >> 20) & 0x0000007F0000007Full;
+    merged = hundreds | ((merged - 100 * hundreds) << 16);
+    uint64_t tens = ((merged * 103) >> 10) & 0x000F000F000F000Full;
+    merged = tens | ((merged - 10 * tens) << 8);
+    return merged + 0x3030303030303030ull;
+}
+
+inline bool is_padding(unsigned char c) { return c == ' ' || c == 0; }
+
+constexpr uint64_t powers_of_10[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+    1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+    1000000000000000000ull, 10000000000000000000ull
+};
+
+/***
+ * @returns how many decimal digits are needed to write in
+ */
+inline size_t digit_count(uint64_t in)
+{
+    // log10 from log2, then correct by one if needed
+    size_t guess = ((size_t)std::bit_width(in) * 1233) >> 12;
+    return guess + (in >= powers_of_10[guess] ? 1 : 0) + (in == 0 ? 1 : 0);
+}
+
+} // end namespace numeric_detail
+
+/***
+ * The widest NUMERIC field we can write (UINT64_MAX has 20 digits)
+ */
+constexpr size_t MAX_NUMERIC_DIGITS = 20;
+
+/***
+ * Write a number right-justified into a fixed width field
+ * @param out where to write
+ * @param width the width of the field
+ * @param in the value
+ * @param pad what to fill the left side with (SoupBinTCP uses spaces)
+ * @returns false if the value does not fit (nothing is written)
+ */
+inline bool encode_numeric(unsigned char* out, size_t width, uint64_t in, unsigned char pad = ' ')
+{
+    size_t digits = numeric_detail::digit_count(in);
+    if (digits > width)
+        return false;
+    // write all 24 digits (with leading zeros) then keep the ones we need
+    unsigned char buf[24];
+    numeric_detail::store8(&buf[16], numeric_detail::format8((uint32_t)(in % 100000000)));
+    in /= 100000000;
+    numeric_detail::store8(&buf[8], numeric_detail::format8((uint32_t)(in % 100000000)));
+    numeric_detail::store8(&buf[0], numeric_detail::format8((uint32_t)(in / 100000000)));
+    memset(out, pad, width - digits);
+    memcpy(&out[width - digits], &buf[24 - digits], digits);
+    return true;
+}
+
+/***
+ * Read a right-justified number out of a fixed width field. Leading spaces,
+ * NULs and zeros are allowed. An empty (all padding) field is 0.
+ * @param in the start of the field
+ * @param width the width of the field
+ * @param out the value
+ * @returns false if there is something other than a digit after the padding,
+ * or if the value does not fit in 64 bits
+ */
+inline bool decode_numeric(const unsigned char* in, size_t width, uint64_t& out)
+{
+    size_t pos = 0;
+    // skip the padding, 8 bytes at a time where we can
+    while(pos + 8 <= width && numeric_detail::all_padding(numeric_detail::load8(&in[pos])))
+        pos += 8;
+    while(pos < width && numeric_detail::is_padding(in[pos]))
+        ++pos;
+    uint64_t val = 0;
+    while(width - pos >= 8)
+    {
+        uint64_t chunk = numeric_detail::load8(&in[pos]);
+        if (!numeric_detail::all_digits(chunk))
+            return false;
+        if (__builtin_mul_overflow(val, 100000000ull, &val)
+                || __builtin_add_overflow(val, (uint64_t)numeric_detail::parse8(chunk), &val))
+            return false;
+        pos += 8;
+    }
+    for(; pos < width; ++pos)
+    {
+        unsigned char digit = in[pos] - '0';
+        if (digit > 9)
+            return false;
+        if (__builtin_mul_overflow(val, 10ull, &val) || __builtin_add_overflow(val, (uint64_t)digit, &val))
+            return false;
+    }
+    out = val;
+    return true;
+}
+
+} // end namespace soupbintcp
@@ -0,0 +1,57 @@
+#include "soup_bin_publish_ring.h"
+
+SoupBinPublishRing::SoupBinPublishRing(size_t capacity)
+{
+    slotCount = 2;
+    while(slotCount < capacity)
+        slotCount <<= 1;
+    mask = slotCount - 1;
+    slots = std::make_unique<Slot[]>(slotCount);
+    for(size_t i = 0; i < slotCount; ++i)
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+bool SoupBinPublishRing::try_push(char packetType, std::span<const unsigned char> body, uint32_t stream)
+{
+    uint64_t pos = tail.load(std::memory_order_relaxed);
+    Slot* slot;
+    while(true)
+    {
+        slot = &slots[pos & mask];
+        uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)sequence - (int64_t)pos;
+        if (diff == 0)
+        {
+            // the slot is free for this position, try to claim it
+            if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return false; // the consumer has not freed it yet, full
+        }
+        else
+        {
+            pos = tail.load(std::memory_order_relaxed); // another producer got it
+        }
+    }
+    slot->packetType = packetType;
+    slot->stream = stream;
+    slot->length = body.size();
+    if (body.size() <= INLINE_BYTES)
+    {
+        if (!body.empty())
+            memcpy(slot->body, body.data(), body.size());
+    }
+    else
+    {
+        // from the publishing thread's pool, it finds its way back once drained
+        unsigned char* data;
+        soupbintcp::shared_buffer* buffer = soupbintcp::acquire_buffer(body.size(), data);
+        memcpy(data, body.data(), body.size());
+        slot->overflow = soupbintcp::buffer_slice{ soupbintcp::buffer_ref(buffer), data, body.size() };
+    }
+    // hand it to the consumer
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
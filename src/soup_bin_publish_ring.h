@@ -0,0 +1,115 @@
+#pragma once
+#include "soup_bin_framing.h"
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <span>
+#include <thread>
+#include <type_traits>
+
+/***
+ * A bounded, lock-free queue of messages from any number of application
+ * threads to one io thread (multi producer, single consumer).
+ *
+ * Each slot carries a sequence number that says whose turn it is: a producer
+ * claims the next slot with a compare and swap on the tail, copies the
+ * message in, and then hands the slot to the consumer. The consumer hands it
+ * back once it is done with it. Small messages are copied into the slot
+ * itself, so the common case allocates nothing.
+ */
+class SoupBinPublishRing
+{
+    public:
+    static constexpr size_t INLINE_BYTES = 200; // bodies up to this size live in the slot
+
+    /***
+     * @param capacity the number of slots (rounded up to a power of 2)
+     */
+    SoupBinPublishRing(size_t capacity);
+    SoupBinPublishRing(const SoupBinPublishRing&) = delete;
+    SoupBinPublishRing& operator=(const SoupBinPublishRing&) = delete;
+
+    /***
+     * Add a message. Safe to call from any thread.
+     * @param packetType the packet type ('S' or 'U')
+     * @param body the payload
+     * @param stream which of the consumer's streams (sessions) it is for
+     * @returns false if the ring is full
+     */
+    bool try_push(char packetType, std::span<const unsigned char> body, uint32_t stream = 0);
+    /***
+     * Add a message, waiting for room if the ring is full. Safe to call from any thread.
+     */
+    void push(char packetType, std::span<const unsigned char> body, uint32_t stream = 0)
+    {
+        while(!try_push(packetType, body, stream))
+            std::this_thread::yield();
+    }
+    /***
+     * Take messages off the ring, in the order they were pushed. Only 1 thread
+     * may call this.
+     * @param maxMessages the most messages to take
+     * @param func called with (packetType, body), or (packetType, body, stream),
+     * for each message. The body is only good during the call
+     * @returns the number of messages taken
+     */
+    template<typename FUNC>
+    size_t drain(size_t maxMessages, FUNC func)
+    {
+        size_t count = 0;
+        while(count < maxMessages)
+        {
+            Slot& slot = slots[head & mask];
+            if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+                break; // empty, or the producer is not done with it yet
+            if (slot.length <= INLINE_BYTES)
+            {
+                call(func, slot, std::span<const unsigned char>(slot.body, slot.length));
+            }
+            else
+            {
+                call(func, slot, slot.overflow.span());
+                slot.overflow = soupbintcp::buffer_slice();
+            }
+            // the slot is free again for the producer 1 lap later
+            slot.sequence.store(head + slotCount, std::memory_order_release);
+            head++;
+            count++;
+        }
+        return count;
+    }
+    /***
+     * @returns true if there is nothing ready for the consumer (consumer thread only)
+     */
+    bool empty() const { return slots[head & mask].sequence.load(std::memory_order_acquire) != head + 1; }
+    size_t capacity() const { return slotCount; }
+
+    private:
+    struct Slot;
+    template<typename FUNC>
+    static void call(FUNC& func, const Slot& slot, std::span<const unsigned char> body)
+    {
+        if constexpr (std::is_invocable_v<FUNC&, char, std::span<const unsigned char>, uint32_t>)
+            func(slot.packetType, body, slot.stream);
+        else
+            func(slot.packetType, body);
+    }
+
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> sequence; // position + 1 when full, position when free for that position
+        char packetType;
+        uint32_t stream;
+        size_t length;
+        soupbintcp::buffer_slice overflow; // the body, if bigger than INLINE_BYTES
+        unsigned char body[INLINE_BYTES];
+    };
+
+    size_t slotCount;
+    size_t mask;
+    std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<uint64_t> tail = 0; // the next position for a producer
+    alignas(64) uint64_t head = 0; // the next position for the consumer
+};
@@ -0,0 +1,130 @@
+#include "soup_bin_sequenced_log.h"
+#include <algorithm>
+#include <cstring>
+
+SequencedLog::SequencedLog(uint64_t firstSeq) : firstSeq(firstSeq)
+{
+}
+
+SequencedLog::SequencedLog(uint64_t firstSeq, const Options& options) : options(options), firstSeq(firstSeq)
+{
+}
+
+soupbintcp::buffer_slice SequencedLog::append(char packetType, std::span<const unsigned char> body)
+{
+    size_t length = soupbintcp::HEADER_LEN + body.size();
+    unsigned char* out = reserve(length);
+    soupbintcp::write_header(out, packetType, body.size());
+    if (!body.empty())
+        memcpy(out + soupbintcp::HEADER_LEN, body.data(), body.size());
+    return commit(length);
+}
+
+soupbintcp::buffer_slice SequencedLog::append(std::span<const unsigned char> frame)
+{
+    unsigned char* out = reserve(frame.size());
+    memcpy(out, frame.data(), frame.size());
+    return commit(frame.size());
+}
+
+soupbintcp::buffer_slice SequencedLog::get(uint64_t seq) const
+{
+    if (!contains(seq))
+        return soupbintcp::buffer_slice();
+    const IndexEntry& entry = index[seq - firstSeq];
+    const Chunk& chunk = chunk_for(entry);
+    const unsigned char* frame = chunk.data + entry.offset;
+    return soupbintcp::buffer_slice{ chunk.buffer, frame, frame_length(frame) };
+}
+
+soupbintcp::buffer_slice SequencedLog::get_range(uint64_t from, size_t maxBytes, uint64_t& count) const
+{
+    count = 0;
+    if (!contains(from))
+        return soupbintcp::buffer_slice();
+    const IndexEntry& first = index[from - firstSeq];
+    const Chunk& chunk = chunk_for(first);
+    // messages in the same chunk are back to back
+    size_t length = 0;
+    for(uint64_t seq = from; seq < next_seq(); ++seq)
+    {
+        const IndexEntry& entry = index[seq - firstSeq];
+        if (entry.chunkId != first.chunkId)
+            break;
+        size_t frameLength = frame_length(chunk.data + entry.offset);
+        if (count > 0 && length + frameLength > maxBytes)
+            break;
+        length += frameLength;
+        count++;
+    }
+    return soupbintcp::buffer_slice{ chunk.buffer, chunk.data + first.offset, length };
+}
+
+/***
+ * Make sure the newest chunk has room
+ * @param length the size of the frame about to be written
+ * @returns where to write it
+ */
+unsigned char* SequencedLog::reserve(size_t length)
+{
+    if (chunks.empty() || chunks.back().capacity - chunks.back().used < length)
+    {
+        size_t capacity = std::max(options.chunkSize, length);
+        if (spare.buffer.get() != nullptr && spare.capacity >= capacity)
+        {
+            spare.used = 0;
+            chunks.push_back(std::move(spare));
+            spare = Chunk();
+        }
+        else
+        {
+            soupbintcp::heap_buffer* buffer = soupbintcp::heap_buffer::create(capacity);
+            chunks.push_back(Chunk{ soupbintcp::buffer_ref(buffer), buffer->data(), capacity, 0 });
+        }
+    }
+    return chunks.back().data + chunks.back().used;
+}
+
+/***
+ * Index the frame just written by reserve()
+ */
+soupbintcp::buffer_slice SequencedLog::commit(size_t length)
+{
+    Chunk& chunk = chunks.back();
+    index.push_back(IndexEntry{ firstChunkId + chunks.size() - 1, chunk.used });
+    soupbintcp::buffer_slice frame{ chunk.buffer, chunk.data + chunk.used, length };
+    chunk.used += length;
+    retainedBytes += length;
+    enforce_retention();
+    return frame;
+}
+
+/***
+ * Drop the oldest messages (and chunks) until we are within the limits. The
+ * newest message always stays.
+ */
+void SequencedLog::enforce_retention()
+{
+    while(index.size() > 1 && ((options.maxMessages > 0 && index.size() > options.maxMessages)
+            || (options.maxBytes > 0 && retainedBytes > options.maxBytes)))
+    {
+        const IndexEntry& oldest = index.front();
+        retainedBytes -= frame_length(chunk_for(oldest).data + oldest.offset);
+        index.pop_front(1);
+        firstSeq++;
+        while(chunks.size() > 1 && index.front().chunkId > firstChunkId)
+        {
+            if (chunks.front().buffer.get()->use_count() == 1)
+                spare = std::move(chunks.front());
+            chunks.pop_front(1);
+            firstChunkId++;
+        }
+    }
+}
+
+size_t SequencedLog::frame_length(const unsigned char* frame)
+{
+    uint16_t sz;
+    memcpy(&sz, frame, sizeof(sz));
+    return soupbintcp::swap_endian_bytes<uint16_t>(sz) + 2;
+}
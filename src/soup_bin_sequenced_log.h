@@ -0,0 +1,95 @@
+#pragma once
+#include "soup_bin_framing.h"
+#include "soup_bin_buffer_pool.h"
+#include <cstdint>
+#include <span>
+
+/***
+ * The store of sequenced messages kept for replay. Messages are framed
+ * straight into large chunks, one after another, so a run of messages is one
+ * contiguous block of memory. A dense index (by seq - first seq) finds any
+ * message in O(1).
+ *
+ * The chunks are shared buffers, so a slice handed to a write queue stays good
+ * even if retention drops the chunk from the log. A dropped chunk nobody else
+ * holds is kept for the next one, so a log with retention stops allocating.
+ *
+ * Not thread safe.
+ */
+class SequencedLog
+{
+    public:
+    struct Options
+    {
+        size_t chunkSize = 1024 * 1024; // bytes per chunk (grows for a bigger message)
+        size_t maxMessages = 0; // the most messages to keep, 0 = no limit
+        size_t maxBytes = 0; // the most bytes to keep, 0 = no limit
+    };
+
+    SequencedLog(uint64_t firstSeq = 1);
+    SequencedLog(uint64_t firstSeq, const Options& options);
+
+    /***
+     * Frame a message into the log
+     * @param packetType the packet type (usually 'S')
+     * @param body the payload
+     * @returns the framed message, which can be sent as is
+     */
+    soupbintcp::buffer_slice append(char packetType, std::span<const unsigned char> body);
+    /***
+     * Add a message that is already framed
+     * @param frame the whole packet
+     * @returns the copy in the log
+     */
+    soupbintcp::buffer_slice append(std::span<const unsigned char> frame);
+    /***
+     * @returns the framed message, or an empty slice if it is not in the log
+     */
+    soupbintcp::buffer_slice get(uint64_t seq) const;
+    /***
+     * Get a run of messages that sit next to each other in memory
+     * @param from the first sequence number wanted
+     * @param maxBytes the most bytes to return (at least 1 message is returned)
+     * @param count set to the number of messages in the slice
+     * @returns the framed messages, or an empty slice if from is not in the log
+     */
+    soupbintcp::buffer_slice get_range(uint64_t from, size_t maxBytes, uint64_t& count) const;
+    bool contains(uint64_t seq) const { return seq >= firstSeq && seq < firstSeq + index.size(); }
+    /***
+     * @returns the oldest sequence number still in the log
+     */
+    uint64_t first_seq() const { return firstSeq; }
+    /***
+     * @returns the sequence number the next append will get
+     */
+    uint64_t next_seq() const { return firstSeq + index.size(); }
+    size_t size() const { return index.size(); }
+    size_t bytes() const { return retainedBytes; }
+
+    private:
+    struct Chunk
+    {
+        soupbintcp::buffer_ref buffer;
+        unsigned char* data = nullptr;
+        size_t capacity = 0;
+        size_t used = 0;
+    };
+    struct IndexEntry
+    {
+        uint64_t chunkId; // chunks[chunkId - firstChunkId]
+        size_t offset; // where in the chunk
+    };
+    unsigned char* reserve(size_t length);
+    soupbintcp::buffer_slice commit(size_t length);
+    void enforce_retention();
+    const Chunk& chunk_for(const IndexEntry& entry) const { return chunks[entry.chunkId - firstChunkId]; }
+    static size_t frame_length(const unsigned char* frame);
+
+    Options options;
+    uint64_t firstSeq;
+    soupbintcp::reuse_queue<IndexEntry> index;
+    soupbintcp::reuse_queue<Chunk> chunks;
+    Chunk spare; // dropped by retention, and not held by anyone else
+    uint64_t firstChunkId = 0;
+    size_t retainedBytes = 0;
+};
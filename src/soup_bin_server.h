@@ -1,5 +1,16 @@
 #pragma once
 #include "soup_bin_connection.h"
+#include "soup_bin_session.h"
+#include "soup_bin_io_context_pool.h"
+#include "soup_bin_publish_ring.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <memory>
 #include <boost/asio.hpp>
@@ -16,73 +27,608 @@ class AnonymousLoginVerifier : public SoupBinLoginVerifier
     virtual bool IsValid(const std::string& u, const std::string& p) override { return true; }
 };
 
+/***
+ * How a SoupBinServer keeps its history, and how it uses threads
+ */
+struct SoupBinServerOptions
+{
+    SequencedLog::Options log; // how much history to keep in memory
+    std::string journalDirectory; // where to keep history on disk, empty for no journal
+    SoupBinJournal::Options journal; // with SyncPolicy::PERIODIC the server's thread also syncs on a timer, so a quiet journal still reaches the disk
+    std::string sessionId; // the default session (an existing journal keeps its own)
+    std::vector<std::string> sessions; // more named sessions, each with its own sequence numbers (and journal, in journalDirectory/<session>)
+    size_t ioThreads = 1; // threads to spread the sessions over. 1 = everything on the server's one thread
+    bool pinThreads = false; // pin each io thread to its own core
+    size_t firstCpu = 0; // pinThreads only, the core of the first io thread
+    bool reusePort = false; // 1 listening socket per io thread (SO_REUSEPORT), instead of handing accepted sockets out in turn
+    size_t publishRingSize = 16384; // messages that can wait between the application threads and the server's thread
+    SoupBinConnection::TransportOptions transport; // how the sessions' sockets are read and written (IO_URING: 1 ring per io thread)
+    SoupBinSharedRing::Options sharedMemory; // live messages for clients on this host (name.0 for the default session, name.1 for the next...), empty name = none
+};
+
 /***
  * A SoupBin server that listens on a socket
+ *
+ * A server hosts 1 or more sessions, each with its own sequence numbers,
+ * store and subscribers. A login is routed to the session it asks for (no
+ * session means the default one), and only ever sees that session's messages.
+ *
+ * Any thread may publish. Published messages go through a lock-free ring to
+ * the server's own thread, which takes them off in batches and sequences them
+ * into their session's log (and journal). It also accepts connections. With more than 1 io thread, sessions
+ * are spread over shards, each an io_context with its own thread, and each
+ * publish is handed to every shard to fan out to its own sessions. A session
+ * only ever runs on its shard's thread.
 */
 template<typename CONNECTION>
 class SoupBinServer : public MessageRepeater
 {
     public:
-    SoupBinServer(int32_t listenPort)
+    /***
+     * @param listenPort the port
+     * @param options history to keep for replays, and the threads to use
+     */
+    SoupBinServer(int32_t listenPort, const SoupBinServerOptions& options = SoupBinServerOptions())
+            : workGuard(io_context.get_executor()), journalSyncTimer(io_context), publishRing(options.publishRingSize)
     {
+        sessions.push_back(std::make_unique<SoupBinSession>(options.sessionId, 0, options.log,
+                options.journalDirectory, options.journal, shared_ring_options(options, 0)));
+        for(const std::string& name : options.sessions)
+        {
+            std::string directory;
+            if (!options.journalDirectory.empty())
+                directory = options.journalDirectory + "/" + SoupBinSession::trim(name);
+            sessions.push_back(std::make_unique<SoupBinSession>(name, sessions.size(), options.log, directory, options.journal,
+                    shared_ring_options(options, sessions.size())));
+        }
+        for(auto& session : sessions)
+            if (!SoupBinSession::trim(session->session_id()).empty())
+                sessionIndex.emplace(SoupBinSession::trim(session->session_id()), session->get_stream());
+        if (options.ioThreads > 1)
+        {
+            pool = std::make_unique<SoupBinIoContextPool>(options.ioThreads, options.pinThreads, options.firstCpu);
+            for(size_t i = 0; i < pool->size(); ++i)
+                shards.emplace_back(&pool->get(i), sessions.size());
+        }
+        else
+        {
+            shards.emplace_back(&io_context, sessions.size());
+        }
+        if (options.transport.backend == SoupBinConnection::TransportOptions::Backend::IO_URING && SoupBinUring::is_supported())
+        {
+            // the sessions find the ring of their io_context
+            for(Shard& shard : shards)
+                boost::asio::make_service<SoupBinUring>(*shard.context, options.transport.uring);
+        }
         boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), listenPort);
-        acceptor = new boost::asio::ip::tcp::acceptor(io_context, endpoint);
-        do_accept();
+        if (options.reusePort)
+        {
+            // the kernel spreads incoming connections over the listening sockets
+            for(size_t i = 0; i < shards.size(); ++i)
+            {
+                auto acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(*shards[i].context);
+                acceptor->open(endpoint.protocol());
+                acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+                acceptor->set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+                acceptor->bind(endpoint);
+                acceptor->listen();
+                acceptors.push_back(std::move(acceptor));
+            }
+        }
+        else
+        {
+            acceptors.push_back(std::make_unique<boost::asio::ip::tcp::acceptor>(io_context, endpoint));
+        }
+        for(size_t i = 0; i < acceptors.size(); ++i)
+            do_accept(i);
+        if (!options.journalDirectory.empty() && options.journal.syncPolicy == SoupBinJournal::Options::SyncPolicy::PERIODIC)
+            schedule_journal_sync(options.journal.syncInterval);
         runThread = std::thread([this]() { io_context.run(); } );
     }
     virtual ~SoupBinServer()
     {
+        exporter.reset();
         shuttingDown = true;
-        delete acceptor;
+        // everything is closed on the thread it belongs to
+        for(auto& acceptor : acceptors)
+            boost::asio::post(acceptor->get_executor(), [&acceptor]() { acceptor->close(); });
+        boost::asio::post(io_context, [this]() { journalSyncTimer.cancel(); });
+        for(Shard& shard : shards)
+            boost::asio::post(*shard.context, [&shard]() {
+                for(auto& c : shard.connections)
+                    c->disconnect();
+            });
+        // nothing is published after the server's thread is done
+        workGuard.reset();
         if (runThread.joinable())
             runThread.join();
+        if (pool != nullptr)
+            pool->join();
+        // the sockets go before the io_contexts they belong to
+        for(Shard& shard : shards)
+        {
+            shard.subscribers.clear();
+            shard.connections.clear();
+        }
+        connections.clear();
     }
     void set_login_verifier(SoupBinLoginVerifier* verifier) { loginVerifier = verifier; }
+    /***
+     * @returns the default session
+     */
+    std::string get_session_id() const { return sessions[0]->session_id(); }
+    /***
+     * @returns the number of sessions, including the default one
+     */
+    size_t get_session_count() const { return sessions.size(); }
+    static constexpr size_t NO_SESSION = SIZE_MAX;
+    /***
+     * @param sessionId the session (padding spaces do not count)
+     * @returns the stream to publish the session's messages to, or NO_SESSION.
+     * The default session is stream 0, the ones in SoupBinServerOptions::sessions follow in order
+     */
+    size_t find_session(const std::string& sessionId) const
+    {
+        auto itr = sessionIndex.find(SoupBinSession::trim(sessionId));
+        return itr != sessionIndex.end() ? itr->second : NO_SESSION;
+    }
+    /***
+     * @returns the number of shards the sessions are spread over
+     */
+    size_t get_shard_count() const { return shards.size(); }
+    /***
+     * How connections accepted from now on write to their sockets
+     */
+    void set_write_options(const SoupBinConnection::WriteOptions& options) { writeOptions = options; }
+    /***
+     * The heartbeat interval and dead peer timeout of connections accepted from now on
+     */
+    void set_heartbeat_options(const SoupBinConnection::HeartbeatOptions& options) { heartbeatOptions = options; }
+    /***
+     * The queue limits and slow consumer policy of connections accepted from now on
+     */
+    void set_queue_options(const SoupBinConnection::QueueOptions& options) { queueOptions = options; }
+    /***
+     * The socket options of connections accepted from now on
+     */
+    void set_socket_options(const SoupBinConnection::SocketOptions& options) { socketOptions = options; }
 
-    void send_unsequenced(const std::vector<unsigned char>& bytes)
+    /***
+     * @returns the metrics of every session added up (the closed ones too), and the server's own.
+     * Safe to call from any thread. The sessions keep running while it reads
+     */
+    soupbintcp::metrics_snapshot get_metrics()
     {
-        for(auto c : connections)
-            c->send_unsequenced(bytes);
+        std::vector<std::shared_ptr<CONNECTION> > sessions;
+        soupbintcp::metrics_snapshot snapshot;
+        {
+            std::lock_guard lock(connectionsMutex);
+            sessions = connections;
+            snapshot = closedMetrics;
+        }
+        for(auto& c : sessions)
+            snapshot.add(c->get_metrics());
+        snapshot.publishedSequenced = publishedSequenced.get();
+        snapshot.publishedUnsequenced = publishedUnsequenced.get();
+        snapshot.publishBatches = publishBatches.get();
+        return snapshot;
     }
+    /***
+     * Append get_metrics() to a file every so often (until the server goes, or
+     * this is called again)
+     * @param path the file
+     * @param interval how often
+     * @param format text or JSON
+     */
+    void export_metrics(const std::string& path, std::chrono::milliseconds interval,
+            soupbintcp::metrics_exporter::Format format = soupbintcp::metrics_exporter::Format::JSON)
+    {
+        exporter.reset();
+        exporter = std::make_unique<soupbintcp::metrics_exporter>([this]() { return get_metrics(); }, path, interval, format);
+    }
+
+    /***
+     * Publish to the subscribers of a session. Safe to call from any thread,
+     * and does not wait unless publishRingSize messages are already waiting.
+     * @param stream the session, from find_session()
+     * @throws std::out_of_range if there is no such session
+     * @throws std::invalid_argument if bytes is too big for a packet
+     */
+    void send_unsequenced(size_t stream, std::span<const unsigned char> bytes)
+    {
+        check_publish(stream, bytes);
+        // through the same ring as send_sequenced, to stay in order with it
+        publishRing.push('U', bytes, stream);
+        schedule_drain();
+    }
+    void send_unsequenced(size_t stream, std::string_view bytes) { send_unsequenced(stream, soupbintcp::as_uchars(bytes)); }
+    /***
+     * Publish to the subscribers of the default session
+     */
+    void send_unsequenced(std::span<const unsigned char> bytes) { send_unsequenced(0, bytes); }
+    void send_unsequenced(const std::vector<unsigned char>& bytes) { send_unsequenced(std::span<const unsigned char>(bytes)); }
+    void send_unsequenced(std::span<const std::byte> bytes) { send_unsequenced(soupbintcp::as_uchars(bytes)); }
+    void send_unsequenced(std::string_view bytes) { send_unsequenced(soupbintcp::as_uchars(bytes)); }
 
-    void send_sequenced(const std::vector<unsigned char>& bytes)
+    /***
+     * Publish to a session, with the session's next sequence number. Safe to
+     * call from any thread. Messages from 1 thread keep their order.
+     * @param stream the session, from find_session()
+     * @throws std::out_of_range if there is no such session
+     * @throws std::invalid_argument if bytes is too big for a packet
+     */
+    void send_sequenced(size_t stream, std::span<const unsigned char> bytes)
     {
-        uint64_t seq = nextSeq++;
-        messages[seq] = bytes;
-        for(auto c : connections)
-            c->send_sequenced(seq, bytes);
+        check_publish(stream, bytes);
+        publishRing.push('S', bytes, stream);
+        schedule_drain();
     }
+    void send_sequenced(size_t stream, std::string_view bytes) { send_sequenced(stream, soupbintcp::as_uchars(bytes)); }
+    /***
+     * Publish to the default session
+     */
+    void send_sequenced(std::span<const unsigned char> bytes) { send_sequenced(0, bytes); }
+    void send_sequenced(const std::vector<unsigned char>& bytes) { send_sequenced(std::span<const unsigned char>(bytes)); }
+    void send_sequenced(std::span<const std::byte> bytes) { send_sequenced(soupbintcp::as_uchars(bytes)); }
+    void send_sequenced(std::string_view bytes) { send_sequenced(soupbintcp::as_uchars(bytes)); }
 
-    void repeat_from(SoupBinConnection* conn, uint64_t startPos)
+    // MessageRepeater implementation, the default session
+    uint64_t first_seq() override { return sessions[0]->first_seq(); }
+    uint64_t next_seq() override { return sessions[0]->next_seq(); }
+    uint64_t repeat_from(SoupBinConnection* conn, uint64_t startPos, size_t maxBytes) override
+    {
+        return sessions[0]->repeat_from(conn, startPos, maxBytes);
+    }
+    std::string session_id() override { return sessions[0]->session_id(); }
+    SoupBinSharedRing* get_shared_ring() override { return sessions[0]->get_shared_ring(); }
+    /***
+     * Route a login to its session, and subscribe the connection to it. On
+     * the connection's shard. An empty session id is the default session,
+     * and a session id it does not know is rejected
+     */
+    MessageRepeater* login(SoupBinConnection* conn, const std::string& sessionId) override
     {
-        while(true)
+        size_t stream = 0;
+        if (!SoupBinSession::trim(sessionId).empty())
+            stream = find_session(sessionId);
+        if (stream == NO_SESSION)
+            return nullptr;
+        current_shard().subscribers[stream].push_back(std::static_pointer_cast<CONNECTION>(conn->shared_from_this()));
+        return sessions[stream].get();
+    }
+    /***
+     * Let go of a connection that has closed: no more fan out to it, and its
+     * counters move to the server's. On the connection's shard
+     */
+    void closed(SoupBinConnection* conn) override
+    {
+        if (shuttingDown)
+            return; // the destructor lets go of every connection at once
+        std::shared_ptr<CONNECTION> owner = std::static_pointer_cast<CONNECTION>(conn->shared_from_this());
+        Shard& shard = current_shard();
+        std::erase(shard.connections, owner);
+        for(auto& subscribers : shard.subscribers)
+            std::erase(subscribers, owner);
+        soupbintcp::metrics_snapshot metrics = owner->get_metrics();
+        metrics.sessions = 0; // only the open ones count, and have a queue
+        metrics.queueBytes = 0;
+        metrics.queueMessages = 0;
         {
-            auto itr = messages.find(startPos);
-            if (itr == messages.end())
-                return;
-            conn->send_sequenced((*itr).first, (*itr).second);
-            startPos++;
+            std::lock_guard lock(connectionsMutex);
+            std::erase(connections, owner);
+            closedMetrics.add(metrics);
+        }
+        // the handlers that closing the socket cancelled are already queued,
+        // and still refer to the connection, so it goes after them
+        boost::asio::post(*shard.context, [context = shard.context, owner = std::move(owner)]() mutable {
+            boost::asio::post(*context, [owner = std::move(owner)]() {});
+        });
+    }
+
+    protected:
+    /***
+     * The sessions that run on one io_context
+     */
+    struct Shard
+    {
+        Shard(boost::asio::io_context* context, size_t sessionCount) : context(context), subscribers(sessionCount) {}
+        boost::asio::io_context* context;
+        std::vector<std::shared_ptr<CONNECTION> > connections; // only touched on context's thread
+        std::vector<std::vector<std::shared_ptr<CONNECTION> > > subscribers; // logged in, by stream. Only touched on context's thread
+    };
+
+    /***
+     * @returns the shard whose thread this is
+     */
+    Shard& current_shard()
+    {
+        for(Shard& shard : shards)
+            if (shard.context->get_executor().running_in_this_thread())
+                return shard;
+        throw std::logic_error("Not on a shard's thread");
+    }
+
+    /***
+     * Run something on every shard's thread
+     */
+    template<typename FUNC>
+    void for_each_shard(FUNC func)
+    {
+        for(Shard& shard : shards)
+            boost::asio::dispatch(*shard.context, [&shard, func]() mutable { func(shard); });
+    }
+
+    /***
+     * The publish ring keeps the stream in 32 bits, and drain() uses it as an
+     * index, so anything that is not a session stops here. So does a body that
+     * will not fit a packet, which the server's thread could only fail to frame
+     */
+    void check_publish(size_t stream, std::span<const unsigned char> bytes) const
+    {
+        if (stream >= sessions.size())
+            throw std::out_of_range("No such session: " + std::to_string(stream));
+        if (bytes.size() + 1 > UINT16_MAX)
+            throw std::invalid_argument("Size too big");
+    }
+
+    /***
+     * A message taken off the publish ring
+     */
+    struct Published
+    {
+        uint32_t stream; // the session
+        uint64_t seq; // 0 if unsequenced
+        soupbintcp::buffer_slice frame;
+    };
+    static constexpr size_t MAX_DRAIN_BATCH = 1024;
+
+    /***
+     * @returns the shared ring of a session, named after the server's
+     */
+    static SoupBinSharedRing::Options shared_ring_options(const SoupBinServerOptions& options, size_t stream)
+    {
+        SoupBinSharedRing::Options shared = options.sharedMemory;
+        if (!shared.name.empty())
+            shared.name += "." + std::to_string(stream);
+        return shared;
+    }
+
+    /***
+     * Make sure the server's thread will drain the ring. Only the publisher
+     * that finds nothing scheduled posts, so most publishes post nothing.
+     */
+    void schedule_drain()
+    {
+        if (!drainScheduled.exchange(true, std::memory_order_acq_rel))
+            boost::asio::post(io_context, [this]() { drain(); });
+    }
+
+    /***
+     * What one drain took off the publish ring, handed to every shard. The
+     * last shard done with it puts it back for a later drain, so draining
+     * allocates nothing once there are enough of them
+     */
+    struct Batch
+    {
+        Batch()
+        {
+            items.reserve(MAX_DRAIN_BATCH);
+            sorted.reserve(MAX_DRAIN_BATCH);
+        }
+        std::vector<Published> items;
+        std::vector<Published> sorted; // room to sort items into
+        std::atomic<size_t> shardsLeft = 0;
+    };
+
+    /***
+     * @returns a batch that no shard is using. On the server's thread
+     */
+    Batch* take_batch()
+    {
+        {
+            std::lock_guard lock(spareBatchesMutex);
+            if (!spareBatches.empty())
+            {
+                Batch* batch = spareBatches.back();
+                spareBatches.pop_back();
+                return batch;
+            }
         }
+        batches.push_back(std::make_unique<Batch>());
+        return batches.back().get();
     }
-    private:
+    /***
+     * A shard is done with a batch. On the shard's thread
+     */
+    void release_batch(Batch* batch)
+    {
+        if (batch->shardsLeft.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        batch->items.clear();
+        std::lock_guard lock(spareBatchesMutex);
+        spareBatches.push_back(batch);
+    }
+    /***
+     * Put each session's messages together, keeping their order. A counting
+     * sort into the batch's spare room, where std::stable_sort would allocate
+     */
+    void sort_by_stream(Batch& batch)
+    {
+        streamStarts.assign(sessions.size() + 1, 0);
+        for(const Published& published : batch.items)
+            streamStarts[published.stream + 1]++;
+        for(size_t i = 1; i < streamStarts.size(); ++i)
+            streamStarts[i] += streamStarts[i - 1];
+        batch.sorted.resize(batch.items.size());
+        for(Published& published : batch.items)
+            batch.sorted[streamStarts[published.stream]++] = std::move(published);
+        batch.items.swap(batch.sorted);
+        batch.sorted.clear();
+    }
+
+    /***
+     * Take a batch off the publish ring, sequence it into the sessions' logs (and
+     * journals) and hand it to every shard in one go. On the server's thread.
+     */
+    void drain()
+    {
+        Batch* batch = take_batch();
+        std::vector<Published>& items = batch->items;
+        bool mixed = false; // more than 1 session in the batch
+        size_t count;
+        {
+            // a session stays locked while its messages come in a row
+            std::unique_lock<std::shared_mutex> lock;
+            SoupBinSession* locked = nullptr;
+            count = publishRing.drain(MAX_DRAIN_BATCH, [this, &items, &mixed, &lock, &locked](char packetType,
+                    std::span<const unsigned char> body, uint32_t stream) {
+                if (!items.empty() && items.back().stream != stream)
+                    mixed = true;
+                if (packetType == 'S')
+                {
+                    publishedSequenced.add();
+                    SoupBinSession* session = sessions[stream].get();
+                    if (session != locked)
+                    {
+                        lock = std::unique_lock(session->get_mutex());
+                        locked = session;
+                    }
+                    uint64_t seq;
+                    soupbintcp::buffer_slice frame = session->append(body, seq);
+                    items.push_back(Published{ stream, seq, std::move(frame) });
+                }
+                else
+                {
+                    // framed into this thread's buffer_pool
+                    publishedUnsequenced.add();
+                    items.push_back(Published{ stream, 0, soupbintcp::make_frame(packetType, body) });
+                }
+            });
+        }
+        if (count > 0)
+        {
+            publishBatches.add();
+            // readers of the shared rings get the whole batch at once
+            for(auto& session : sessions)
+                session->notify_shared();
+            // the sessions are independent, only the order within each one matters
+            if (mixed)
+                sort_by_stream(*batch);
+            // each shard gets the batches in order, and hands each session's
+            // run of messages to that session's subscribers
+            batch->shardsLeft.store(shards.size(), std::memory_order_relaxed);
+            for_each_shard([this, batch](Shard& shard) {
+                for(auto first = batch->items.begin(); first != batch->items.end(); )
+                {
+                    uint32_t stream = first->stream;
+                    auto last = std::find_if(first, batch->items.end(), [stream](const Published& p) { return p.stream != stream; });
+                    for(auto& c : shard.subscribers[stream])
+                        for(auto published = first; published != last; ++published)
+                        {
+                            if (published->seq != 0)
+                                c->send_sequenced(published->seq, published->frame);
+                            else
+                                c->send_unsequenced(published->frame);
+                        }
+                    first = last;
+                }
+                release_batch(batch);
+            });
+        }
+        else
+        {
+            std::lock_guard lock(spareBatchesMutex);
+            spareBatches.push_back(batch);
+        }
+        if (count == MAX_DRAIN_BATCH)
+        {
+            // more to do, but let the socket handlers have a turn
+            boost::asio::post(io_context, [this]() { drain(); });
+            return;
+        }
+        // a publisher that came in after the drain either sees this and posts,
+        // or had already set the flag and its message is seen here
+        drainScheduled.exchange(false, std::memory_order_acq_rel);
+        if (!publishRing.empty())
+            schedule_drain();
+    }
+
+    /***
+     * Sync the journals that have gone quiet since their last sync. On the server's
+     * thread, which is the one that appends to them
+     */
+    void schedule_journal_sync(std::chrono::milliseconds interval)
+    {
+        journalSyncTimer.expires_after(interval);
+        journalSyncTimer.async_wait([this, interval](boost::system::error_code ec) {
+            if (ec || shuttingDown)
+                return;
+            for(auto& session : sessions)
+                session->sync_journal_if_due();
+            schedule_journal_sync(interval);
+        });
+    }
+
     // boost asio
-    void do_accept()
+    void do_accept(size_t acceptorIndex)
     {
-        acceptor->async_accept([this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+        // with 1 listening socket, accepted sockets go to the shards in turn
+        size_t shardIndex = (acceptors.size() > 1 ? acceptorIndex : nextShard++ % shards.size());
+        acceptors[acceptorIndex]->async_accept(*shards[shardIndex].context,
+                [this, acceptorIndex, shardIndex](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
             if (!ec)
-                connections.emplace_back(std::make_shared<CONNECTION>(std::move(socket), this));
-            if (!shuttingDown)
-                do_accept();
+                add_connection(shards[shardIndex], std::move(socket));
+            if (!shuttingDown && acceptors[acceptorIndex]->is_open())
+                do_accept(acceptorIndex);
         });
     }
 
-    protected:
-    std::atomic<uint64_t> nextSeq = 1;
-    std::vector<std::shared_ptr<CONNECTION> > connections;
+    /***
+     * Start a session on its shard's thread
+     */
+    void add_connection(Shard& shard, boost::asio::ip::tcp::socket socket)
+    {
+        boost::asio::dispatch(*shard.context, [this, &shard, socket = std::move(socket)]() mutable {
+            if (shuttingDown)
+                return;
+            auto conn = std::make_shared<CONNECTION>(std::move(socket), this);
+            conn->set_write_options(writeOptions);
+            conn->set_queue_options(queueOptions);
+            conn->set_heartbeat_options(heartbeatOptions);
+            conn->set_socket_options(socketOptions);
+            shard.connections.push_back(conn);
+            std::lock_guard lock(connectionsMutex);
+            connections.push_back(conn);
+        });
+    }
+
+    std::vector<std::shared_ptr<CONNECTION> > connections; // every open session, in the order accepted
+    std::mutex connectionsMutex;
+    soupbintcp::metrics_snapshot closedMetrics; // the counters of the sessions that have closed, under connectionsMutex
     SoupBinLoginVerifier* loginVerifier = nullptr;
-    boost::asio::io_context io_context;
-    boost::asio::ip::tcp::acceptor* acceptor;
+    SoupBinConnection::WriteOptions writeOptions;
+    SoupBinConnection::QueueOptions queueOptions;
+    SoupBinConnection::HeartbeatOptions heartbeatOptions;
+    SoupBinConnection::SocketOptions socketOptions;
+    boost::asio::io_context io_context; // accepts, and sequences what is published
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> workGuard; // the server's thread may have no sockets
+    std::unique_ptr<SoupBinIoContextPool> pool; // the shards' threads, if more than 1
+    std::deque<Shard> shards; // does not move, the shards' threads hold references
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor> > acceptors;
+    size_t nextShard = 0;
+    boost::asio::steady_timer journalSyncTimer; // SyncPolicy::PERIODIC only
     std::thread runThread;
-    bool shuttingDown = false;
-    std::unordered_map<uint64_t, std::vector<unsigned char> > messages;
-};
\ No newline at end of file
+    std::atomic<bool> shuttingDown = false;
+    SoupBinPublishRing publishRing; // from the application threads to the server's thread
+    std::atomic<bool> drainScheduled = false;
+    std::vector<std::unique_ptr<Batch> > batches; // every batch there is, only touched on the server's thread
+    std::vector<Batch*> spareBatches; // the ones no shard is using
+    std::mutex spareBatchesMutex;
+    std::vector<size_t> streamStarts; // sort_by_stream(), on the server's thread
+    soupbintcp::relaxed_counter publishedSequenced; // written on the server's thread only
+    soupbintcp::relaxed_counter publishedUnsequenced;
+    soupbintcp::relaxed_counter publishBatches;
+    std::unique_ptr<soupbintcp::metrics_exporter> exporter;
+    std::vector<std::unique_ptr<SoupBinSession> > sessions; // by stream, the default one first. Fixed once constructed
+    std::unordered_map<std::string, size_t> sessionIndex; // the streams of the named sessions, by trimmed session id
+};
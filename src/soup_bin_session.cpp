@@ -0,0 +1,65 @@
+#include "soup_bin_session.h"
+
+SoupBinSession::SoupBinSession(const std::string& sessionId, size_t stream, const SequencedLog::Options& log,
+        const std::string& journalDirectory, const SoupBinJournal::Options& journal, const SoupBinSharedRing::Options& shared)
+        : sessionId(sessionId), stream(stream), log(1, log)
+{
+    if (!journalDirectory.empty())
+    {
+        // pick up where the last run left off
+        this->journal = std::make_unique<SoupBinJournal>(journalDirectory, sessionId, journal);
+        this->log = SequencedLog(this->journal->next_seq(), log);
+        this->sessionId = this->journal->get_session_id();
+    }
+    if (!shared.name.empty())
+        this->shared = std::make_unique<SoupBinSharedRing>(shared);
+}
+
+std::string SoupBinSession::trim(const std::string& sessionId)
+{
+    size_t first = sessionId.find_first_not_of(' ');
+    if (first == std::string::npos)
+        return "";
+    return sessionId.substr(first, sessionId.find_last_not_of(' ') - first + 1);
+}
+
+soupbintcp::buffer_slice SoupBinSession::append(std::span<const unsigned char> body, uint64_t& seq)
+{
+    seq = log.next_seq();
+    soupbintcp::buffer_slice frame = log.append('S', body);
+    if (journal != nullptr)
+        journal->append(frame.span());
+    if (shared != nullptr)
+        shared->append(seq, frame.span());
+    return frame;
+}
+
+uint64_t SoupBinSession::first_seq()
+{
+    std::shared_lock lock(mutex);
+    return journal != nullptr ? journal->first_seq() : log.first_seq();
+}
+
+uint64_t SoupBinSession::next_seq()
+{
+    std::shared_lock lock(mutex);
+    return log.next_seq();
+}
+
+uint64_t SoupBinSession::repeat_from(SoupBinConnection* conn, uint64_t startPos, size_t maxBytes)
+{
+    // messages that are next to each other go out as one buffer. Anything
+    // older than the log comes straight from the journal's mapped pages
+    uint64_t count = 0;
+    soupbintcp::buffer_slice frames;
+    {
+        std::shared_lock lock(mutex);
+        if (journal != nullptr && startPos < log.first_seq())
+            frames = journal->get_range(startPos, maxBytes, count);
+        else
+            frames = log.get_range(startPos, maxBytes, count);
+    }
+    if (count > 0)
+        conn->send_sequenced_range(startPos, count, frames);
+    return startPos + count;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include "soup_bin_connection.h"
+#include "soup_bin_sequenced_log.h"
+#include "soup_bin_journal.h"
+#include "soup_bin_shared_ring.h"
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <span>
+#include <string>
+
+/***
+ * One named session of a server: its own sequence numbers, and the store
+ * its subscribers replay from.
+ *
+ * Only the server's thread appends. The shards replay from it at the same
+ * time, so the store is behind a shared mutex that the appending thread
+ * holds exclusively (see get_mutex()).
+ */
+class SoupBinSession : public MessageRepeater
+{
+    public:
+    /***
+     * @param sessionId the session
+     * @param stream the session's number within its server
+     * @param log how much history to keep in memory
+     * @param journalDirectory where to keep history on disk, empty for no journal. An
+     * existing journal keeps its own session id, and picks up where it left off
+     * @param journal the journal options
+     * @param shared a ring for clients on this host (none if it has no name)
+     */
+    SoupBinSession(const std::string& sessionId, size_t stream, const SequencedLog::Options& log,
+            const std::string& journalDirectory = "", const SoupBinJournal::Options& journal = SoupBinJournal::Options(),
+            const SoupBinSharedRing::Options& shared = SoupBinSharedRing::Options());
+    SoupBinSession(const SoupBinSession&) = delete;
+    SoupBinSession& operator=(const SoupBinSession&) = delete;
+
+    size_t get_stream() const { return stream; }
+    /***
+     * Sequence a message into the store (and journal, and shared ring). The caller holds
+     * get_mutex() exclusively
+     * @param body the message
+     * @param seq set to the message's sequence number
+     * @returns the framed message
+     */
+    soupbintcp::buffer_slice append(std::span<const unsigned char> body, uint64_t& seq);
+    std::shared_mutex& get_mutex() { return mutex; }
+    /***
+     * Sync the journal if its periodic sync is due. On the appending thread
+     */
+    void sync_journal_if_due()
+    {
+        if (journal != nullptr)
+            journal->sync_if_due();
+    }
+    /***
+     * Wake the shared ring's readers, once a batch has been appended
+     */
+    void notify_shared()
+    {
+        if (shared != nullptr)
+            shared->notify();
+    }
+
+    // MessageRepeater implementation (called from the shards)
+    uint64_t first_seq() override;
+    uint64_t next_seq() override;
+    uint64_t repeat_from(SoupBinConnection* conn, uint64_t startPos, size_t maxBytes) override;
+    std::string session_id() override { return sessionId; }
+    SoupBinSharedRing* get_shared_ring() override { return shared.get(); }
+
+    /***
+     * @returns sessionId without its padding spaces
+     */
+    static std::string trim(const std::string& sessionId);
+
+    private:
+    std::string sessionId;
+    size_t stream;
+    std::shared_mutex mutex;
+    SequencedLog log; // sequenced messages kept for replay
+    std::unique_ptr<SoupBinJournal> journal; // optional, sequenced messages kept on disk
+    std::unique_ptr<SoupBinSharedRing> shared; // optional, sequenced messages for clients on this host
+};
@@ -0,0 +1,262 @@
+#include "soup_bin_shared_ring.h"
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <random>
+#include <stdexcept>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/***
+ * At the start of the mapping. The positions are bytes ever written, the
+ * data offset is that modulo the capacity
+ */
+struct SoupBinSharedRing::Header
+{
+    char magic[8];
+    uint64_t token;
+    uint64_t capacity;
+    uint64_t indexSize;
+    pid_t owner; // the creator, which removes the name when it is done
+    alignas(64) std::atomic<uint64_t> reserved; // the writer may be overwriting anything before reserved - capacity
+    std::atomic<uint64_t> written; // every byte before this is complete
+    std::atomic<uint64_t> nextSeq; // every packet before this is complete
+    alignas(64) std::atomic<uint32_t> doorbell; // a futex, bumped by notify()
+    std::atomic<uint32_t> sleepers; // readers in wait()
+};
+
+/***
+ * Where a sequence number's packet starts. seq is written last (and cleared
+ * first), so a reader that sees the same seq before and after reading pos
+ * has a good pos
+ */
+struct SoupBinSharedRing::IndexEntry
+{
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> pos;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+        "the ring is shared between processes, its atomics can not use locks");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "the doorbell is a futex");
+
+static constexpr char MAGIC[8] = { 'S', 'O', 'U', 'P', 'S', 'H', 'M', '1' };
+static constexpr size_t HEADER_SIZE = 4096;
+
+static std::string object_name(const std::string& name)
+{
+    return name.empty() || name[0] != '/' ? "/" + name : name;
+}
+
+bool SoupBinSharedRing::in_use(const std::string& name)
+{
+    int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return errno != ENOENT;
+    struct stat st;
+    void* mem = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && (size_t)st.st_size >= HEADER_SIZE)
+        mem = ::mmap(nullptr, HEADER_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+        return true; // not a ring, or one still being created. Not ours to remove
+    const Header* existing = (const Header*)mem;
+    bool ring = memcmp(existing->magic, MAGIC, sizeof(MAGIC)) == 0;
+    pid_t owner = existing->owner;
+    ::munmap(mem, HEADER_SIZE);
+    return !ring || owner <= 0 || ::kill(owner, 0) == 0 || errno != ESRCH;
+}
+
+static uint64_t round_up_pow2(uint64_t value)
+{
+    uint64_t result = 1;
+    while(result < value)
+        result <<= 1;
+    return result;
+}
+
+SoupBinSharedRing::SoupBinSharedRing(const Options& options) : name(object_name(options.name)), owner(true)
+{
+    capacity = round_up_pow2(std::max<size_t>(options.capacity, 2 * (2 + UINT16_MAX)));
+    uint64_t indexSize = round_up_pow2(std::max<size_t>(options.indexSize, 1));
+    mappingSize = HEADER_SIZE + indexSize * sizeof(IndexEntry) + capacity;
+    // another server's readers stay with it. Only a ring whose server died
+    // without removing it is replaced
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST && !in_use(name))
+    {
+        ::shm_unlink(name.c_str());
+        fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd < 0 && errno == EEXIST)
+        throw std::runtime_error("Shared memory " + name + " is in use by another server");
+    if (fd < 0)
+        throw std::runtime_error("Unable to create shared memory " + name);
+    if (::ftruncate(fd, mappingSize) != 0)
+    {
+        ::close(fd);
+        ::shm_unlink(name.c_str());
+        throw std::runtime_error("Unable to size shared memory " + name);
+    }
+    try
+    {
+        map(fd, true);
+    }
+    catch(...)
+    {
+        ::shm_unlink(name.c_str());
+        throw;
+    }
+    // a fresh object is all zeros, so only the constants need writing
+    std::random_device random;
+    header->token = random() | ((uint64_t)random() << 32);
+    header->capacity = capacity;
+    header->indexSize = indexSize;
+    header->owner = ::getpid();
+    indexMask = indexSize - 1;
+    data = (unsigned char*)mapping + mappingSize - capacity;
+    memcpy(header->magic, MAGIC, sizeof(MAGIC));
+}
+
+SoupBinSharedRing::SoupBinSharedRing(const std::string& name, uint64_t token) : name(object_name(name))
+{
+    int fd = ::shm_open(this->name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+        throw std::runtime_error("Unable to open shared memory " + this->name);
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_SIZE)
+    {
+        ::close(fd);
+        throw std::runtime_error("Not a ring: " + this->name);
+    }
+    mappingSize = st.st_size;
+    map(fd, false);
+    capacity = header->capacity;
+    indexMask = header->indexSize - 1;
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->token != token
+            || HEADER_SIZE + header->indexSize * sizeof(IndexEntry) + capacity != mappingSize)
+    {
+        ::munmap(mapping, mappingSize);
+        throw std::runtime_error("Not the expected ring: " + this->name);
+    }
+    data = (unsigned char*)mapping + mappingSize - capacity;
+}
+
+void SoupBinSharedRing::map(int fd, bool create)
+{
+    void* mem = ::mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | (create ? MAP_POPULATE : 0), fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+        throw std::runtime_error("Unable to map shared memory " + name);
+    mapping = mem;
+    header = (Header*)mem;
+    index = (IndexEntry*)((unsigned char*)mem + HEADER_SIZE);
+}
+
+SoupBinSharedRing::~SoupBinSharedRing()
+{
+    if (mapping != nullptr)
+        ::munmap(mapping, mappingSize);
+    if (owner)
+        ::shm_unlink(name.c_str());
+}
+
+uint64_t SoupBinSharedRing::get_token() const
+{
+    return header->token;
+}
+
+void SoupBinSharedRing::append(uint64_t seq, std::span<const unsigned char> packet)
+{
+    uint64_t end = writePos + packet.size();
+    // readers of what is about to be overwritten find out from reserved
+    header->reserved.store(end, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    size_t offset = writePos & (capacity - 1);
+    size_t first = std::min<size_t>(packet.size(), capacity - offset);
+    memcpy(data + offset, packet.data(), first);
+    memcpy(data, packet.data() + first, packet.size() - first);
+    IndexEntry& entry = index[seq & indexMask];
+    entry.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    entry.pos.store(writePos, std::memory_order_relaxed);
+    entry.seq.store(seq, std::memory_order_release);
+    header->written.store(end, std::memory_order_release);
+    header->nextSeq.store(seq + 1, std::memory_order_release);
+    writePos = end;
+    appended = true;
+}
+
+void SoupBinSharedRing::notify()
+{
+    if (!appended)
+        return;
+    appended = false;
+    // a reader either sees the new write position before it sleeps, or is
+    // counted in sleepers by the time the doorbell has moved
+    header->doorbell.fetch_add(1, std::memory_order_seq_cst);
+    if (header->sleepers.load(std::memory_order_seq_cst) > 0)
+        ::syscall(SYS_futex, &header->doorbell, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+SoupBinSharedRing::Find SoupBinSharedRing::find(uint64_t seq, uint64_t& pos) const
+{
+    if (seq >= header->nextSeq.load(std::memory_order_acquire))
+        return Find::NOT_YET;
+    const IndexEntry& entry = index[seq & indexMask];
+    uint64_t before = entry.seq.load(std::memory_order_acquire);
+    uint64_t at = entry.pos.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (before != seq || entry.seq.load(std::memory_order_relaxed) != seq)
+        return Find::GONE;
+    if (at + capacity < header->reserved.load(std::memory_order_acquire))
+        return Find::GONE;
+    pos = at;
+    return Find::FOUND;
+}
+
+size_t SoupBinSharedRing::read(uint64_t pos, std::span<unsigned char> out) const
+{
+    uint64_t written = header->written.load(std::memory_order_acquire);
+    size_t length = std::min<uint64_t>(written - pos, out.size());
+    if (length == 0)
+        return 0;
+    size_t offset = pos & (capacity - 1);
+    size_t first = std::min<size_t>(length, capacity - offset);
+    memcpy(out.data(), data + offset, first);
+    memcpy(out.data() + first, data, length - first);
+    // the copy is only good if the writer had not started on it
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (pos + capacity < header->reserved.load(std::memory_order_relaxed))
+        return LAPPED;
+    return length;
+}
+
+uint64_t SoupBinSharedRing::get_write_pos() const
+{
+    return header->written.load(std::memory_order_acquire);
+}
+
+void SoupBinSharedRing::wait(uint64_t pos, std::chrono::milliseconds timeout) const
+{
+    uint32_t bell = header->doorbell.load(std::memory_order_seq_cst);
+    header->sleepers.fetch_add(1, std::memory_order_seq_cst);
+    if (header->written.load(std::memory_order_seq_cst) == pos)
+    {
+        timespec ts{ (time_t)(timeout.count() / 1000), (long)(timeout.count() % 1000) * 1000000 };
+        ::syscall(SYS_futex, &header->doorbell, FUTEX_WAIT, bell, &ts, nullptr, 0);
+    }
+    header->sleepers.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+void SoupBinSharedRing::wake() const
+{
+    header->doorbell.fetch_add(1, std::memory_order_seq_cst);
+    ::syscall(SYS_futex, &header->doorbell, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
@@ -0,0 +1,128 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <span>
+#include <string>
+
+/***
+ * A ring of sequenced packets in POSIX shared memory, written by 1 server
+ * and read by any number of clients on the same host.
+ *
+ * The ring holds SoupBin packets back to back, exactly as they would go
+ * over TCP, so a reader copies bytes out and frames them like a receive.
+ * An index maps each sequence number to where its packet starts. The writer
+ * never waits for the readers: one that falls more than the ring's capacity
+ * behind finds its bytes overwritten (read() says LAPPED), and has to catch
+ * up some other way.
+ *
+ * Readers that want to sleep wait on a futex in the ring, which the writer
+ * only wakes when someone is waiting.
+ *
+ * The writer is not thread safe. Each reader is used by 1 thread at a time,
+ * apart from wait() and wake().
+ */
+class SoupBinSharedRing
+{
+    public:
+    struct Options
+    {
+        std::string name; // the shared memory object (a leading / is added if missing), empty = no ring
+        size_t capacity = 16 * 1024 * 1024; // bytes of packets (rounded up to a power of 2)
+        size_t indexSize = 256 * 1024; // sequence numbers that can be looked up (rounded up to a power of 2)
+    };
+
+    /***
+     * Create a ring. One left behind with the same name by a server that is
+     * gone is replaced, one that is still in use is not
+     * @param options the name and sizes
+     * @throws std::runtime_error if the name is taken, or on a system error
+     */
+    explicit SoupBinSharedRing(const Options& options);
+    /***
+     * Open a ring that a server created
+     * @param name the shared memory object
+     * @param token what the creator's get_token() said, so that a ring of the
+     * same name on another host (or from an earlier run) is not mistaken for it
+     */
+    SoupBinSharedRing(const std::string& name, uint64_t token);
+    /***
+     * Unmaps the ring. The creator also removes the name
+     */
+    ~SoupBinSharedRing();
+    SoupBinSharedRing(const SoupBinSharedRing&) = delete;
+    SoupBinSharedRing& operator=(const SoupBinSharedRing&) = delete;
+
+    const std::string& get_name() const { return name; }
+    uint64_t get_token() const;
+
+    // the writer
+    /***
+     * Add a sequenced packet. Readers see it once the call returns
+     * @param seq its sequence number (1 more than the last one)
+     * @param packet the whole packet
+     */
+    void append(uint64_t seq, std::span<const unsigned char> packet);
+    /***
+     * Wake the readers that are waiting, if anything was appended since the
+     * last call. Once per batch is enough
+     */
+    void notify();
+
+    // the readers
+    enum class Find
+    {
+        FOUND,
+        NOT_YET, // not appended yet
+        GONE // overwritten
+    };
+    /***
+     * @param seq a sequence number
+     * @param pos set to where its packet starts (FOUND only)
+     */
+    Find find(uint64_t seq, uint64_t& pos) const;
+    static constexpr size_t LAPPED = SIZE_MAX;
+    /***
+     * Copy out whatever has been appended from a position on
+     * @param pos where to start (from find(), then moved on by each read)
+     * @param out where to put it
+     * @returns the bytes copied (0 if there is nothing new), or LAPPED if
+     * pos has been overwritten
+     */
+    size_t read(uint64_t pos, std::span<unsigned char> out) const;
+    /***
+     * @returns the position after the last packet appended
+     */
+    uint64_t get_write_pos() const;
+    /***
+     * Sleep until the write position moves from pos, wake() is called, or
+     * the timeout passes
+     */
+    void wait(uint64_t pos, std::chrono::milliseconds timeout) const;
+    /***
+     * Wake everything in wait() on this ring (i.e. to stop a waiting thread)
+     */
+    void wake() const;
+
+    private:
+    struct Header;
+    struct IndexEntry;
+    void map(int fd, bool create);
+    /***
+     * @returns false if name is a ring whose creator is gone without removing it
+     */
+    static bool in_use(const std::string& name);
+
+    std::string name;
+    bool owner = false; // created it, so removes the name
+    Header* header = nullptr;
+    IndexEntry* index = nullptr;
+    unsigned char* data = nullptr;
+    void* mapping = nullptr;
+    size_t mappingSize = 0;
+    uint64_t capacity = 0;
+    uint64_t indexMask = 0;
+    uint64_t writePos = 0; // the writer's copy of the write position
+    bool appended = false; // the writer, since the last notify()
+};
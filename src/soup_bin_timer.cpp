@@ -1,73 +1,169 @@
 #include "soup_bin_timer.h"
+#include <algorithm>
 #include <chrono>
 
-Timer::Timer(TimerListener* listener, uint64_t msBeforeFire, uint64_t currentTimeMs) 
-        : listener(listener), msBeforeFire(msBeforeFire), lastTimeMs(currentTimeMs)
+Timer::Timer(TimerListener* listener, uint64_t msBeforeFire, boost::asio::io_context& context)
+        : lastTimeMs(get_time()), msBeforeFire(msBeforeFire), listener(listener),
+        wheel(boost::asio::use_service<SoupBinTimingWheel>(context))
 {
-    shuttingDown = false;
-    timerThread = std::thread(&Timer::run, this);
+    wheel.schedule(this, lastTimeMs + msBeforeFire);
 }
 
 Timer::~Timer()
 {
-    shuttingDown = true;
-    if (timerThread.joinable())
-        timerThread.join();
+    cancel();
 }
 
-void Timer::run()
+void Timer::fire(uint64_t now)
 {
-    // run continually, firing approx every msBeforeFire
-    while(!shuttingDown)
-    {
-        wait_until(lastTimeMs + msBeforeFire);
-        if (!shuttingDown)
-        {
-            if (check())
-                // reset clock
-                reset();
-        }
-    }
+    // repeat, and let the listener cancel or reset if it wants
+    uint64_t diff = now - lastTimeMs;
+    lastTimeMs = now;
+    wheel.schedule(this, lastTimeMs + msBeforeFire);
+    listener->OnTimer(diff);
 }
 
-bool Timer::check()
+void Timer::reset()
 {
-    // get current time, fire if needed
-    uint64_t time = Timer::get_time();
-    int64_t diff = ((int64_t)time) - lastTimeMs;
-    if (diff >= msBeforeFire)
-    {
-        listener->OnTimer(diff);
-        return true;
-    }
-    return false;
+    lastTimeMs = Timer::get_time();
+    wheel.schedule(this, lastTimeMs + msBeforeFire);
+}
+
+void Timer::reset_from(uint64_t timeMs)
+{
+    lastTimeMs = timeMs;
+    wheel.schedule(this, lastTimeMs + msBeforeFire);
+}
+
+void Timer::set_interval(uint64_t ms)
+{
+    msBeforeFire = ms;
+    reset();
+}
+
+uint64_t Timer::coarse_time() const
+{
+    return wheel.coarse_time();
+}
+
+void Timer::cancel()
+{
+    // after the io_context shuts down, the wheel has already let go of us
+    if (is_armed())
+        wheel.cancel(this);
 }
 
 /***
- * blocks until a specific time
- * @param specificTime when to return
+ * @returns the current time in ms, from a clock that never jumps
  */
-void Timer::wait_until(uint64_t specificTime)
+uint64_t Timer::get_time()
 {
-    // get current time
-    uint64_t now = Timer::get_time();
-    if (now <= specificTime)
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+boost::asio::io_context::id SoupBinTimingWheel::id;
+
+SoupBinTimingWheel::SoupBinTimingWheel(boost::asio::io_context& context)
+        : boost::asio::io_context::service(context), ticker(context), nowMs(Timer::get_time())
+{
+    for(TimerLink& slot : slots)
+        slot.prev = slot.next = &slot;
+}
+
+void SoupBinTimingWheel::link(TimerLink& list, TimerLink* node)
+{
+    node->prev = list.prev;
+    node->next = &list;
+    list.prev->next = node;
+    list.prev = node;
+}
+
+void SoupBinTimingWheel::unlink(TimerLink* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+}
+
+void SoupBinTimingWheel::schedule(Timer* timer, uint64_t deadlineMs)
+{
+    if (timer->is_armed())
+        unlink(timer);
+    else
+        armed++;
+    if (!ticking)
     {
-        int64_t waitMs = specificTime - now;
-        std::this_thread::sleep_for(std::chrono::milliseconds(waitMs));
+        // the wheel has been idle, catch it up to now
+        nowMs = Timer::get_time();
+        currentTick = nowMs / TICK_MS;
+        start_ticker();
     }
+    // round up so we never fire early, and never into a tick already done
+    timer->deadlineTick = std::max((deadlineMs + TICK_MS - 1) / TICK_MS, currentTick + 1);
+    link(slots[timer->deadlineTick % SLOTS], timer);
 }
 
-void Timer::reset()
+void SoupBinTimingWheel::cancel(Timer* timer)
 {
-    uint64_t old_time = lastTimeMs;
-    lastTimeMs = Timer::get_time();
+    unlink(timer);
+    armed--;
 }
 
-/***
- * @returns the current time in msj
- */
-uint64_t Timer::get_time() 
+void SoupBinTimingWheel::start_ticker()
+{
+    ticking = true;
+    ticker.expires_at(std::chrono::steady_clock::time_point(std::chrono::milliseconds((currentTick + 1) * TICK_MS)));
+    ticker.async_wait(soupbintcp::with_memory(tickerMemory, [this](boost::system::error_code ec) {
+        if (ec == boost::asio::error::operation_aborted)
+            return;
+        on_tick();
+    }));
+}
+
+void SoupBinTimingWheel::on_tick()
 {
-    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-}
\ No newline at end of file
+    uint64_t now = Timer::get_time();
+    uint64_t nowTick = now / TICK_MS;
+    nowMs = now;
+    // collect what is due first, a callback may reset or cancel any timer
+    TimerLink expired;
+    expired.prev = expired.next = &expired;
+    uint64_t steps = std::min<uint64_t>(nowTick - currentTick, SLOTS);
+    for(uint64_t i = 1; i <= steps; ++i)
+    {
+        TimerLink& slot = slots[(currentTick + i) % SLOTS];
+        for(TimerLink* node = slot.next; node != &slot; )
+        {
+            TimerLink* next = node->next;
+            // anything for a later turn of the wheel stays
+            if (static_cast<Timer*>(node)->deadlineTick <= nowTick)
+            {
+                unlink(node);
+                link(expired, node);
+            }
+            node = next;
+        }
+    }
+    currentTick = nowTick;
+    while(expired.next != &expired)
+    {
+        Timer* timer = static_cast<Timer*>(expired.next);
+        unlink(timer);
+        armed--;
+        timer->fire(now);
+    }
+    if (armed > 0)
+        start_ticker();
+    else
+        ticking = false;
+}
+
+void SoupBinTimingWheel::shutdown()
+{
+    // the timers may outlive us, so they must not point here
+    for(TimerLink& slot : slots)
+        while(slot.next != &slot)
+            unlink(slot.next);
+    armed = 0;
+    ticking = false;
+}
@@ -1,6 +1,9 @@
 #pragma once
+#include "soup_bin_buffer_pool.h"
 #include <cstdint>
-#include <thread>
+#include <array>
+#include <utility> // boost asio needs std::exchange in C++20
+#include <boost/asio.hpp>
 
 class TimerListener
 {
@@ -8,26 +11,99 @@ class TimerListener
     virtual void OnTimer(uint64_t msSince) = 0;
 };
 
-class Timer
+/***
+ * How a Timer sits in a slot of the timing wheel
+ */
+struct TimerLink
+{
+    TimerLink* prev = nullptr;
+    TimerLink* next = nullptr;
+};
+
+class SoupBinTimingWheel;
+
+/***
+ * A repeating timer, driven by the timing wheel of an io_context. There is no
+ * thread per timer, the callback runs on the io_context's thread.
+ *
+ * Not thread safe. Use it on the io_context's thread (or before that thread
+ * is started).
+ */
+class Timer : private TimerLink
 {
     public:
-    Timer(TimerListener* listener, uint64_t msBeforeFire, uint64_t currentTimeMs);
+    /***
+     * Start the timer
+     * @param listener the callback
+     * @param msBeforeFire how long after the last fire (or reset) to fire
+     * @param context the io_context that runs the callback
+     */
+    Timer(TimerListener* listener, uint64_t msBeforeFire, boost::asio::io_context& context);
     ~Timer();
-    void run(); // blocks
-    void reset(); // reset timer
-    void wait_until(uint64_t specifiedTime); // blocks until a specified time
-    /****
-     * @brief check to see if the timer has expired, does callback if necessary
-     * @return true if callback called
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+    void reset(); // reset timer (and start it again if it was cancelled)
+    /***
+     * Reset as if it happened at a given time, so the next fire is
+     * timeMs + msBeforeFire
+     */
+    void reset_from(uint64_t timeMs);
+    void set_interval(uint64_t ms); // change msBeforeFire (and reset)
+    void cancel(); // stop firing
+    bool is_armed() const { return next != nullptr; }
+    static uint64_t get_time(); // get current time in ms (monotonic)
+    /***
+     * @returns get_time() as of the last tick of the wheel. Much cheaper, and
+     * good to TICK_MS (while any timer on this io_context is armed)
      */
-    bool check();
-    static uint64_t get_time(); // get current time in ms
+    uint64_t coarse_time() const;
 
     private:
+    friend class SoupBinTimingWheel;
+    void fire(uint64_t now);
+
     uint64_t lastTimeMs; // the last time we were reset
     uint64_t msBeforeFire; // how long each wait time should be
     TimerListener* listener; // the callback
-    std::thread timerThread; // waits and fires the callback
-    bool shuttingDown = false; // shuts down the thread on dtor
+    SoupBinTimingWheel& wheel; // where we wait
+    uint64_t deadlineTick = 0; // the tick of the wheel we fire on
 };
 
+/***
+ * One per io_context (an asio service). A hashed timing wheel: each timer
+ * hangs off the slot of its deadline, so arming, resetting and cancelling
+ * are O(1). One steady_timer ticks the wheel, only while a timer is armed.
+ * Timers further out than 1 turn of the wheel wait for their turn.
+ */
+class SoupBinTimingWheel : public boost::asio::io_context::service
+{
+    public:
+    static boost::asio::io_context::id id;
+    static constexpr uint64_t TICK_MS = 10; // the resolution
+    static constexpr size_t SLOTS = 512; // 1 turn is SLOTS * TICK_MS
+
+    explicit SoupBinTimingWheel(boost::asio::io_context& context);
+    /***
+     * (Re)arm a timer
+     * @param deadlineMs when to fire (as Timer::get_time()), never early
+     */
+    void schedule(Timer* timer, uint64_t deadlineMs);
+    void cancel(Timer* timer);
+    size_t get_armed_count() const { return armed; }
+    uint64_t coarse_time() const { return nowMs; }
+
+    private:
+    void shutdown() override;
+    void start_ticker();
+    void on_tick();
+    static void link(TimerLink& list, TimerLink* node);
+    static void unlink(TimerLink* node);
+
+    std::array<TimerLink, SLOTS> slots; // each is the head of a circular list
+    boost::asio::steady_timer ticker;
+    soupbintcp::handler_memory tickerMemory; // the wait in progress
+    uint64_t currentTick = 0; // the last tick processed
+    uint64_t nowMs = 0; // the time of the last tick
+    size_t armed = 0;
+    bool ticking = false;
+};
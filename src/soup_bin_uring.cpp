@@ -0,0 +1,395 @@
+#include "soup_bin_uring.h"
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+boost::asio::io_context::id SoupBinUring::id;
+
+SoupBinUring::SoupBinUring(boost::asio::io_context& context) : SoupBinUring(context, Options()) {}
+
+SoupBinUring::SoupBinUring(boost::asio::execution_context& context, const Options& options)
+        : boost::asio::io_context::service(static_cast<boost::asio::io_context&>(context)), options(options),
+        eventDescriptor(static_cast<boost::asio::io_context&>(context))
+{
+    try
+    {
+        setup();
+    }
+    catch(...)
+    {
+        release();
+        throw;
+    }
+}
+
+SoupBinUring::~SoupBinUring()
+{
+    release();
+}
+
+void SoupBinUring::release()
+{
+    // closing the ring cancels anything still in flight
+    if (ringFd >= 0)
+        ::close(ringFd);
+    ringFd = -1;
+    if (sqes != nullptr)
+        ::munmap(sqes, sqesSize);
+    if (cqRing != nullptr && cqRing != sqRing)
+        ::munmap(cqRing, cqRingSize);
+    if (sqRing != nullptr)
+        ::munmap(sqRing, sqRingSize);
+    if (bufferRing != nullptr)
+        ::munmap(bufferRing, bufferRingSize);
+    if (buffers != nullptr)
+        ::munmap(buffers, buffersSize);
+    sqes = nullptr;
+    sqRing = cqRing = nullptr;
+    bufferRing = nullptr;
+    buffers = nullptr;
+}
+
+void SoupBinUring::shutdown()
+{
+    boost::system::error_code ignored;
+    eventDescriptor.close(ignored);
+}
+
+bool SoupBinUring::is_supported()
+{
+    static const bool supported = []() {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+            return false;
+        bool result = false;
+        try
+        {
+            boost::asio::io_context context;
+            Options small;
+            small.entries = 4;
+            small.bufferCount = 2;
+            small.bufferSize = 4096;
+            SoupBinUring ring(context, small);
+            // the buffer ring came with 5.19, multishot receives with 6.0, so
+            // setting up is not enough: a receive has to come back, and stay armed
+            struct Probe : public SoupBinUringHandler
+            {
+                void on_uring_complete(uint8_t tag, int32_t res, uint32_t cqeFlags) override
+                {
+                    done = true;
+                    result = res;
+                    flags = cqeFlags;
+                }
+                bool done = false;
+                int32_t result = 0;
+                uint32_t flags = 0;
+            } probe;
+            const unsigned char byte = 0;
+            if (::write(fds[1], &byte, 1) == 1)
+            {
+                ring.receive(fds[0], &probe, 0);
+                ring.flush();
+                for(int i = 0; i < 1000 && !probe.done; ++i)
+                {
+                    if (ring.reap() == 0)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                result = probe.done && probe.result == 1 && (probe.flags & IORING_CQE_F_MORE) != 0;
+            }
+        }
+        catch(const std::exception&)
+        {
+            result = false;
+        }
+        // after the ring, which cancels the receive as it closes
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return result;
+    }();
+    return supported;
+}
+
+/***
+ * @returns a mapping of part of the ring, or nullptr
+ */
+static void* map(size_t size, int fd, off_t offset)
+{
+    void* result = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return result == MAP_FAILED ? nullptr : result;
+}
+
+/***
+ * @returns page aligned memory, or nullptr
+ */
+static void* map_anonymous(size_t size)
+{
+    void* result = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    return result == MAP_FAILED ? nullptr : result;
+}
+
+void SoupBinUring::setup()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = options.entries * 2;
+    if (options.sqPoll)
+    {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = options.sqPollIdleMs;
+        if (options.sqPollCpu >= 0)
+        {
+            params.flags |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu = options.sqPollCpu;
+        }
+    }
+    ringFd = ::syscall(__NR_io_uring_setup, options.entries, &params);
+    if (ringFd < 0)
+        throw std::runtime_error(std::string("Unable to set up io_uring: ") + strerror(errno));
+
+    // the rings are shared with the kernel
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    sqRing = map(sqRingSize, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == nullptr)
+        throw std::runtime_error("Unable to map the io_uring submission queue");
+    cqRing = (single ? sqRing : map(cqRingSize, ringFd, IORING_OFF_CQ_RING));
+    if (cqRing == nullptr)
+        throw std::runtime_error("Unable to map the io_uring completion queue");
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*)map(sqesSize, ringFd, IORING_OFF_SQES);
+    if (sqes == nullptr)
+        throw std::runtime_error("Unable to map the io_uring submission entries");
+    unsigned char* sq = (unsigned char*)sqRing;
+    sqHead = (unsigned*)(sq + params.sq_off.head);
+    sqTail = (unsigned*)(sq + params.sq_off.tail);
+    sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sqFlags = (unsigned*)(sq + params.sq_off.flags);
+    sqArray = (unsigned*)(sq + params.sq_off.array);
+    sqEntries = params.sq_entries;
+    sqLocalTail = *sqTail;
+    // entry i always sits in slot i, so the indirection is set up once
+    for(unsigned i = 0; i < sqEntries; ++i)
+        sqArray[i] = i;
+    unsigned char* cq = (unsigned char*)cqRing;
+    cqHead = (unsigned*)(cq + params.cq_off.head);
+    cqTail = (unsigned*)(cq + params.cq_off.tail);
+    cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // the receive buffers, handed to the kernel once
+    unsigned count = 1;
+    while(count < options.bufferCount && count < 32768)
+        count <<= 1;
+    bufferMask = count - 1;
+    bufferRingSize = count * sizeof(io_uring_buf);
+    bufferRing = (io_uring_buf_ring*)map_anonymous(bufferRingSize);
+    if (bufferRing == nullptr)
+        throw std::runtime_error("Unable to map the io_uring buffer ring");
+    options.bufferSize = std::min(options.bufferSize, MAX_BUFFER_SIZE);
+    buffersSize = (size_t)count * options.bufferSize;
+    buffers = (unsigned char*)map_anonymous(buffersSize);
+    if (buffers == nullptr)
+        throw std::runtime_error("Unable to map the io_uring receive buffers");
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)bufferRing;
+    reg.ring_entries = count;
+    reg.bgid = BUFFER_GROUP;
+    if (::syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        throw std::runtime_error(std::string("Unable to register io_uring buffers: ") + strerror(errno));
+    for(unsigned i = 0; i < count; ++i)
+        recycle(IORING_CQE_F_BUFFER | (i << IORING_CQE_BUFFER_SHIFT));
+
+    // completions wake the io_context through an eventfd
+    eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd < 0)
+        throw std::runtime_error("Unable to create an eventfd");
+    eventDescriptor.assign(eventFd);
+    if (::syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1) < 0)
+        throw std::runtime_error(std::string("Unable to register the io_uring eventfd: ") + strerror(errno));
+}
+
+io_uring_sqe* SoupBinUring::next_sqe()
+{
+    // full, make room (with sqPoll, wait for the kernel thread to catch up)
+    while(sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+    {
+        submit();
+        if (options.sqPoll)
+            std::this_thread::yield();
+    }
+    io_uring_sqe* sqe = &sqes[sqLocalTail & *sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqLocalTail++;
+    schedule_submit();
+    return sqe;
+}
+
+void SoupBinUring::schedule_submit()
+{
+    // everything queued until the io_context gets to this goes in 1 submit
+    if (submitScheduled)
+        return;
+    submitScheduled = true;
+    boost::asio::post(get_io_context(), [this]() {
+        submitScheduled = false;
+        submit();
+    });
+}
+
+int SoupBinUring::enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    enterCount.fetch_add(1, std::memory_order_relaxed);
+    int result = ::syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0);
+    return result < 0 ? -errno : result;
+}
+
+void SoupBinUring::submit()
+{
+    unsigned toSubmit = sqLocalTail - *sqTail;
+    if (toSubmit > 0)
+    {
+        __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+        if (options.sqPoll)
+        {
+            // the kernel thread may have gone to sleep
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+                enter(0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+        else
+        {
+            while(toSubmit > 0)
+            {
+                int submitted = enter(toSubmit, 0, 0);
+                if (submitted == -EBUSY || submitted == -EAGAIN)
+                {
+                    // the completion queue is full, empty it and try again
+                    reap();
+                    continue;
+                }
+                if (submitted <= 0)
+                    break;
+                toSubmit -= submitted;
+            }
+        }
+    }
+    wait_for_completions();
+}
+
+void SoupBinUring::flush()
+{
+    submit();
+    while(options.sqPoll && __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) != sqLocalTail)
+    {
+        if (__atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+            enter(0, 0, IORING_ENTER_SQ_WAKEUP);
+        std::this_thread::yield();
+    }
+}
+
+void SoupBinUring::wait_for_completions()
+{
+    // only wait while something is in flight, so the io_context can run out of work
+    if (waiting || inFlight == 0 || !eventDescriptor.is_open())
+        return;
+    waiting = true;
+    eventDescriptor.async_wait(boost::asio::posix::stream_descriptor::wait_read, [this](boost::system::error_code ec) {
+        waiting = false;
+        if (ec)
+            return;
+        uint64_t count;
+        while(::read(eventFd, &count, sizeof(count)) > 0)
+            ;
+        reap();
+    });
+}
+
+size_t SoupBinUring::reap()
+{
+    size_t count = 0;
+    while(true)
+    {
+        // a handler may have reaped too (a full submission queue does), so
+        // the head is read each time
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            // the queue was full, the kernel kept the rest aside until asked for them
+            if (!(__atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+                break;
+            enter(0, 0, IORING_ENTER_GETEVENTS);
+            if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+                break;
+            continue;
+        }
+        io_uring_cqe cqe = cqes[head & *cqMask];
+        // free the slot before the handler runs, it may start more
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            inFlight--;
+        auto handler = (SoupBinUringHandler*)(cqe.user_data & ~(uint64_t)SoupBinUringHandler::TAG_MASK);
+        handler->on_uring_complete(cqe.user_data & SoupBinUringHandler::TAG_MASK, cqe.res, cqe.flags);
+        count++;
+    }
+    wait_for_completions();
+    return count;
+}
+
+void SoupBinUring::receive(int fd, SoupBinUringHandler* handler, uint8_t tag)
+{
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = (uint64_t)handler | tag;
+    inFlight++;
+}
+
+void SoupBinUring::send(int fd, const msghdr* msg, SoupBinUringHandler* handler, uint8_t tag)
+{
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)msg;
+    sqe->len = 1;
+    // the kernel keeps going until all of it is sent (or the socket fails)
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uint64_t)handler | tag;
+    inFlight++;
+}
+
+std::span<const unsigned char> SoupBinUring::get_buffer(int32_t result, uint32_t flags) const
+{
+    unsigned bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+    return std::span<const unsigned char>(buffers + (size_t)bufferId * options.bufferSize, result > 0 ? result : 0);
+}
+
+void SoupBinUring::recycle(uint32_t flags)
+{
+    if (!(flags & IORING_CQE_F_BUFFER))
+        return;
+    uint16_t bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+    // field by field, the tail sits in the resv of the first entry. Not
+    // through bufs[], which C++ puts behind a 1 byte placeholder
+    io_uring_buf& entry = reinterpret_cast<io_uring_buf*>(bufferRing)[bufferTail & bufferMask];
+    entry.addr = (uint64_t)(buffers + (size_t)bufferId * options.bufferSize);
+    entry.len = options.bufferSize;
+    entry.bid = bufferId;
+    bufferTail++;
+    __atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+}
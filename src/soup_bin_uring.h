@@ -0,0 +1,156 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <span>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <utility> // boost asio needs std::exchange in C++20
+#include <boost/asio.hpp>
+
+/***
+ * Something with operations on a SoupBinUring. Aligned so that the low bits
+ * of its address are free to carry a tag in the completion.
+ */
+class alignas(64) SoupBinUringHandler
+{
+    public:
+    static constexpr uint8_t TAG_MASK = 63;
+    /***
+     * An operation finished (or, for a multishot receive, produced something)
+     * @param tag what was passed when it was started
+     * @param result what the system call would have returned, or -errno
+     * @param flags the completion's IORING_CQE_F_ flags
+     */
+    virtual void on_uring_complete(uint8_t tag, int32_t result, uint32_t flags) = 0;
+};
+
+/***
+ * One per io_context (an asio service, created with make_service). An
+ * io_uring shared by every socket on that io_context, so that the sends of
+ * all of them go to the kernel in one system call.
+ *
+ * Receives are multishot: started once, they keep completing into buffers
+ * that are registered with the kernel up front (a provided buffer ring), so
+ * a socket that has data costs no readiness round trip and no system call.
+ * Operations queued while a handler runs are submitted together, at the
+ * next turn of the io_context. With sqPoll a kernel thread picks them up, so
+ * submitting is not a system call either. Completions come back through an
+ * eventfd the io_context waits on (only while something is in flight), or
+ * from reap() on a thread that busy polls.
+ *
+ * Not thread safe. Use it on the io_context's thread.
+ */
+class SoupBinUring : public boost::asio::io_context::service
+{
+    public:
+    static boost::asio::io_context::id id;
+
+    struct Options
+    {
+        unsigned entries = 256; // the submission queue (the completion queue is twice as big)
+        bool sqPoll = false; // a kernel thread takes submissions, instead of a system call. It spins a core while busy
+        unsigned sqPollIdleMs = 100; // sqPoll only, how long the kernel thread spins before it sleeps
+        int sqPollCpu = -1; // sqPoll only, the core of the kernel thread, -1 = any
+        unsigned bufferCount = 256; // receive buffers shared by the sockets (rounded up to a power of 2)
+        unsigned bufferSize = 16 * 1024; // bytes per receive buffer, at most MAX_BUFFER_SIZE
+    };
+    static constexpr unsigned MAX_BUFFER_SIZE = 64 * 1024; // a receive always fits behind a partial packet
+
+    explicit SoupBinUring(boost::asio::io_context& context);
+    /***
+     * @param context an io_context (as make_service passes it)
+     * @param options the ring's size and buffers
+     */
+    SoupBinUring(boost::asio::execution_context& context, const Options& options);
+    ~SoupBinUring();
+
+    /***
+     * @returns true if this system lets us set up an io_uring with
+     * everything we use (it is often blocked in containers), tried out with
+     * a multishot receive on a socketpair
+     */
+    static bool is_supported();
+
+    /***
+     * Start a multishot receive. Each receive completes with the number of
+     * bytes, in the buffer given by get_buffer(). Hand the buffer back with
+     * recycle() once done with it. The receive stops (completes without
+     * IORING_CQE_F_MORE) at the end of the stream, on an error, or with
+     * -ENOBUFS if the buffers ran out.
+     */
+    void receive(int fd, SoupBinUringHandler* handler, uint8_t tag);
+    /***
+     * Start a sendmsg. msg (and what it points to) must stay put until it completes
+     */
+    void send(int fd, const msghdr* msg, SoupBinUringHandler* handler, uint8_t tag);
+    /***
+     * @returns the bytes of a receive completion
+     */
+    std::span<const unsigned char> get_buffer(int32_t result, uint32_t flags) const;
+    /***
+     * Give a receive completion's buffer back to the kernel
+     */
+    void recycle(uint32_t flags);
+    /***
+     * Submit everything queued now, and with sqPoll wait until the kernel
+     * has taken it. Needed before a socket with queued operations is closed,
+     * so none of them ends up on another socket that gets the same descriptor
+     */
+    void flush();
+    /***
+     * Hand every completion there is to its handler, without waiting
+     * @returns the number of completions
+     */
+    size_t reap();
+    /***
+     * @returns the io_uring_enter calls so far (everything else is shared memory)
+     */
+    uint64_t get_enter_count() const { return enterCount.load(std::memory_order_relaxed); }
+
+    private:
+    void shutdown() override;
+    void setup();
+    void release();
+    io_uring_sqe* next_sqe();
+    void schedule_submit();
+    void submit();
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+    void wait_for_completions();
+
+    Options options;
+    int ringFd = -1;
+    int eventFd = -1;
+    boost::asio::posix::stream_descriptor eventDescriptor; // the io_context waits on eventFd here
+    bool waiting = false; // eventDescriptor is waiting
+    bool submitScheduled = false;
+    size_t inFlight = 0; // operations that will still complete
+    // the submission queue
+    void* sqRing = nullptr;
+    size_t sqRingSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqFlags = nullptr;
+    unsigned* sqArray = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+    unsigned sqEntries = 0;
+    unsigned sqLocalTail = 0; // queued, but not yet published to the kernel
+    // the completion queue (in sqRing, or its own mapping)
+    void* cqRing = nullptr;
+    size_t cqRingSize = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    // the receive buffers
+    io_uring_buf_ring* bufferRing = nullptr;
+    size_t bufferRingSize = 0;
+    unsigned char* buffers = nullptr;
+    size_t buffersSize = 0;
+    unsigned bufferMask = 0;
+    uint16_t bufferTail = 0;
+    std::atomic<uint64_t> enterCount = 0;
+    static constexpr uint16_t BUFFER_GROUP = 0;
+};
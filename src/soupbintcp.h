@@ -1,11 +1,14 @@
 #pragma once
+#include "soup_bin_numeric.h"
 #include <cstdint>
 #include <cstring> // memcpy
+#include <algorithm>
+#include <array>
 #include <string>
+#include <string_view>
+#include <span>
 #include <vector>
 #include <stdexcept>
-#include <sstream>
-#include <iomanip>
 
 namespace soupbintcp {
 
@@ -40,176 +43,498 @@ constexpr typename std::underlying_type<E>::type to_underlying(E e) noexcept {
     return static_cast<typename std::underlying_type<E>::type>(e);
 }
 
+/***
+ * Checks a packet's field list at compile time. Fields must be in order,
+ * must not overlap or leave gaps, must cover exactly the fixed part of the
+ * packet, and INTEGER fields must be 1, 2, 4 or 8 bytes wide.
+ * @param fields the field list of the packet
+ * @param size the fixed size of the packet
+ * @returns true if the layout is sane
+ */
+template<size_t N>
+constexpr bool valid_schema(const std::array<message_record, N>& fields, unsigned int size)
+{
+    unsigned int pos = 0;
+    for(const message_record& f : fields)
+    {
+        if (f.offset != pos || f.length == 0)
+            return false;
+        if (f.type == message_record::field_type::INTEGER
+                && f.length != 1 && f.length != 2 && f.length != 4 && f.length != 8)
+            return false;
+        pos += f.length;
+    }
+    return pos == size;
+}
+
+/***
+ * Read an integer field out of a raw record
+ * @param record the start of the packet (the 2 byte length)
+ * @param mr where the field lives
+ * @returns the value
+ */
+inline int64_t read_int(const unsigned char* record, const message_record& mr)
+{
+    if (mr.type == message_record::field_type::NUMERIC)
+    {
+        // a field that is not a number reads as 0
+        uint64_t val = 0;
+        if (!decode_numeric(&record[mr.offset], mr.length, val))
+            return 0;
+        return (int64_t)val;
+    }
+    //     how many bytes to grab
+    switch(mr.length)
+    {
+        case 1:
+            return (int64_t)record[mr.offset];
+        case 2:
+        {
+            uint16_t val;
+            memcpy(&val, &record[mr.offset], sizeof(val));
+            return (int64_t)swap_endian_bytes<uint16_t>(val);
+        }
+        case 4:
+        {
+            uint32_t val;
+            memcpy(&val, &record[mr.offset], sizeof(val));
+            return (int64_t)swap_endian_bytes<uint32_t>(val);
+        }
+        case 8:
+        {
+            uint64_t val;
+            memcpy(&val, &record[mr.offset], sizeof(val));
+            return (int64_t)swap_endian_bytes<uint64_t>(val);
+        }
+        default:
+            break;
+    }
+    return 0;
+}
+
+/***
+ * Write an integer field into a raw record
+ * @param record the start of the packet (the 2 byte length)
+ * @param mr where the field lives
+ * @param in the value
+ */
+inline void write_int(unsigned char* record, const message_record& mr, int64_t in)
+{
+    if (mr.type == message_record::field_type::NUMERIC)
+    {
+        // right-justified, padded with spaces
+        if (in < 0 || !encode_numeric(&record[mr.offset], mr.length, (uint64_t)in))
+            throw std::out_of_range("Value does not fit in NUMERIC field");
+        return;
+    }
+    switch(mr.length)
+    {
+        case 1:
+            record[mr.offset] = (uint8_t)in;
+            break;
+        case 2:
+        {
+            uint16_t val = swap_endian_bytes<uint16_t>((uint16_t)in);
+            memcpy(&record[mr.offset], &val, sizeof(val));
+            break;
+        }
+        case 4:
+        {
+            uint32_t val = swap_endian_bytes<uint32_t>((uint32_t)in);
+            memcpy(&record[mr.offset], &val, sizeof(val));
+            break;
+        }
+        case 8:
+        {
+            uint64_t val = swap_endian_bytes<uint64_t>((uint64_t)in);
+            memcpy(&record[mr.offset], &val, sizeof(val));
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/***
+ * Compile time versions of read_int / write_int. The field is known at
+ * compile time, so the offset, width and encoding are resolved without
+ * branching on the record.
+ */
+template<message_record MR>
+inline int64_t read_int(const unsigned char* record)
+{
+    if constexpr (MR.type == message_record::field_type::NUMERIC)
+    {
+        uint64_t val = 0;
+        if (!decode_numeric(&record[MR.offset], MR.length, val))
+            return 0;
+        return (int64_t)val;
+    }
+    else if constexpr (MR.length == 1)
+    {
+        return (int64_t)record[MR.offset];
+    }
+    else if constexpr (MR.length == 2)
+    {
+        uint16_t val;
+        memcpy(&val, &record[MR.offset], sizeof(val));
+        return (int64_t)swap_endian_bytes<uint16_t>(val);
+    }
+    else if constexpr (MR.length == 4)
+    {
+        uint32_t val;
+        memcpy(&val, &record[MR.offset], sizeof(val));
+        return (int64_t)swap_endian_bytes<uint32_t>(val);
+    }
+    else
+    {
+        static_assert(MR.length == 8, "INTEGER fields must be 1, 2, 4 or 8 bytes");
+        uint64_t val;
+        memcpy(&val, &record[MR.offset], sizeof(val));
+        return (int64_t)swap_endian_bytes<uint64_t>(val);
+    }
+}
+
+template<message_record MR>
+inline void write_int(unsigned char* record, int64_t in)
+{
+    if constexpr (MR.type == message_record::field_type::NUMERIC)
+    {
+        if (in < 0 || !encode_numeric(&record[MR.offset], MR.length, (uint64_t)in))
+            throw std::out_of_range("Value does not fit in NUMERIC field");
+    }
+    else if constexpr (MR.length == 1)
+    {
+        record[MR.offset] = (uint8_t)in;
+    }
+    else if constexpr (MR.length == 2)
+    {
+        uint16_t val = swap_endian_bytes<uint16_t>((uint16_t)in);
+        memcpy(&record[MR.offset], &val, sizeof(val));
+    }
+    else if constexpr (MR.length == 4)
+    {
+        uint32_t val = swap_endian_bytes<uint32_t>((uint32_t)in);
+        memcpy(&record[MR.offset], &val, sizeof(val));
+    }
+    else
+    {
+        static_assert(MR.length == 8, "INTEGER fields must be 1, 2, 4 or 8 bytes");
+        uint64_t val = swap_endian_bytes<uint64_t>((uint64_t)in);
+        memcpy(&record[MR.offset], &val, sizeof(val));
+    }
+}
+
+/***
+ * Read an ALPHA field out of a raw record
+ * @param record the start of the packet (the 2 byte length)
+ * @param mr where the field lives
+ * @returns the value, stopping at the first NUL
+ */
+inline std::string read_string(const unsigned char* record, const message_record& mr)
+{
+    const char* start = (const char*)&record[mr.offset];
+    return std::string(start, strnlen(start, mr.length));
+}
+
+inline void write_string(unsigned char* record, const message_record& mr, const std::string& in)
+{
+    strncpy((char*)&record[mr.offset], in.c_str(), mr.length);
+}
+
+/***
+ * An outgoing (or copied) packet. The fixed part of the packet lives inline,
+ * so packets without a payload (logins, heartbeats, etc.) never touch the
+ * heap. Adding a payload with set_message moves the record to the heap.
+ */
 template<unsigned int SIZE>
 struct message {
+    static constexpr unsigned int fixed_size = SIZE;
     const char message_type = ' ';
     message(char message_type) : message_type(message_type)
     {
-        // we don't have the size yet, so allocate SIZE
-        record = (unsigned char*)malloc(SIZE);
-        if (record == nullptr)
-            throw std::invalid_argument("Size too big");
-        allocated_space = SIZE;
         // set the size to SIZE
-        uint16_t swapped = swap_endian_bytes<uint16_t>(allocated_space-2);
-        ::memcpy( &record[0], &swapped, 2);
+        uint16_t swapped = swap_endian_bytes<uint16_t>(SIZE-2);
+        ::memcpy( &inline_record[0], &swapped, 2);
         // set the message type
-        record[2] = message_type;
-        if (SIZE-3 > 0)
-            ::memset( &record[3], 0, SIZE-3 );
+        inline_record[2] = message_type;
+        if constexpr (SIZE > 3)
+            ::memset( &inline_record[3], 0, SIZE-3 );
     }
-    message(const unsigned char* in) : message_type(in[0])
+    message(const unsigned char* in) : message_type(in[2])
     {
         // calculate the size
-        size_t sz = swap_endian_bytes<uint16_t>(*(uint16_t*)&in[0]);
-        allocated_space = sz + 2;
-        record = (unsigned char*)malloc(allocated_space);
+        uint16_t sz;
+        memcpy(&sz, in, sizeof(sz));
+        reserve(swap_endian_bytes<uint16_t>(sz) + 2);
+        allocated_space = swap_endian_bytes<uint16_t>(sz) + 2;
         memcpy(record, in, allocated_space);
     }
-    ~message() {
-        free(record);
+    message(const message& in) : message_type(in.message_type)
+    {
+        reserve(in.allocated_space);
+        allocated_space = in.allocated_space;
+        memcpy(record, in.record, allocated_space);
     }
-    const uint8_t get_raw_byte(uint8_t pos) const { return record[pos]; }
-    void set_raw_byte(uint8_t pos, uint8_t in) { record[pos] = in; }
-    int64_t get_int(const message_record& mr) const {
-        if (mr.type == message_record::field_type::NUMERIC)
+    message(message&& in) noexcept : message_type(in.message_type)
+    {
+        if (in.record == in.inline_record)
         {
-            // get just the portion we want
-            std::string val = get_string(mr);
-            return strtoll(val.c_str(), nullptr, 10);
+            memcpy(inline_record, in.inline_record, SIZE);
         }
         else
         {
-            //     how many bytes to grab
-            switch(mr.length)
-            {
-                    case 1:
-                        return (int64_t)&record[mr.offset];
-                    case 2:
-                        return (int64_t)swap_endian_bytes<uint16_t>(*(uint16_t*)&record[mr.offset]);
-                    case 4:
-                        return (int64_t)swap_endian_bytes<uint32_t>(*(uint32_t*)&record[mr.offset]);
-                case 8:
-                    return (int64_t)swap_endian_bytes<uint64_t>(*(uint64_t*)&record[mr.offset]);
-                default:
-                    break;
-            }
+            record = in.record;
+            capacity = in.capacity;
+            in.record = in.inline_record;
+            in.capacity = SIZE;
         }
-        return 0;
+        allocated_space = in.allocated_space;
+        in.allocated_space = SIZE;
+    }
+    message& operator=(const message&) = delete;
+    ~message() {
+        if (record != inline_record)
+            free(record);
     }
-    void set_int(const message_record& mr, int64_t in)
+    uint8_t get_raw_byte(uint8_t pos) const { return record[pos]; }
+    void set_raw_byte(uint8_t pos, uint8_t in) { record[pos] = in; }
+    int64_t get_int(const message_record& mr) const { return read_int(record, mr); }
+    void set_int(const message_record& mr, int64_t in) { write_int(record, mr, in); }
+    void set_string(const message_record& mr, const std::string& in) { write_string(record, mr, in); }
+    const std::string get_string(const message_record& mr) const { return read_string(record, mr); }
+    /***
+     * Field accessors resolved at compile time, i.e.
+     * msg.set_int<login_request::REQUESTED_SEQUENCE_NUMBER>(1)
+     */
+    template<message_record MR>
+    int64_t get_int() const
     {
-        if (mr.type == message_record::field_type::NUMERIC)
-        {
-            // turn the value into a right-justified string
-            std::stringstream ss;
-            ss << std::right << std::setw(mr.length) << std::to_string(in);
-            memcpy((char*)&record[mr.offset], ss.str().c_str(), mr.length);
-        }
-        else
-        {
-            int64_t tmp = 0;
-            switch(mr.length)
-            {
-                case 1:
-                    break;
-                case 2:
-                    tmp = swap_endian_bytes<uint16_t>(in);
-                    break;
-                case 4:
-                    tmp = swap_endian_bytes<uint32_t>(in);
-                    break;
-                case 8:
-                    tmp = swap_endian_bytes<uint64_t>(in);
-                    break;
-                default:
-                    break;
-            }
-            memcpy(&record[mr.offset], &in, mr.length);
-        }
+        static_assert(MR.offset + MR.length <= SIZE, "field is outside of the packet");
+        return read_int<MR>(record);
     }
-    void set_string(const message_record& mr, const std::string& in)
+    template<message_record MR>
+    void set_int(int64_t in)
     {
-        strncpy((char*)&record[mr.offset], in.c_str(), mr.length);
+        static_assert(MR.offset + MR.length <= SIZE, "field is outside of the packet");
+        write_int<MR>(record, in);
     }
-    const std::string get_string(const message_record& mr) const
+    template<message_record MR>
+    const std::string get_string() const
     {
-        // get the section of the record we want
-        char buf[mr.length+1];
-        memset(buf, 0, mr.length+1);
-        strncpy(buf, (const char*)&record[mr.offset], mr.length);
-        return buf;
+        static_assert(MR.offset + MR.length <= SIZE, "field is outside of the packet");
+        return read_string(record, MR);
     }
-    void set_message(const std::vector<unsigned char> data)
+    template<message_record MR>
+    void set_string(const std::string& in)
+    {
+        static_assert(MR.offset + MR.length <= SIZE, "field is outside of the packet");
+        write_string(record, MR, in);
+    }
+    void set_message(const std::vector<unsigned char>& data)
+    {
+        set_message(std::span<const unsigned char>(data.data(), data.size()));
+    }
+    void set_message(std::span<const unsigned char> data)
     {
-        // do we need to allocate space?
         size_t needed_space = SIZE + data.size();
-        if (allocated_space <= needed_space) {
-            record = (unsigned char*)realloc(record, needed_space);
-            allocated_space = needed_space;
-            const unsigned char* tmp = (unsigned char*)&allocated_space;
-            uint16_t sz = swap_endian_bytes<uint16_t>(allocated_space - 2);
-            memcpy(record, &sz, 2);
-        }
-        if (record != nullptr)
-        {
-            // copy in the vector
-            std::copy(data.begin(), data.end(), &record[SIZE]);
-        }
+        if (needed_space - 2 > UINT16_MAX)
+            throw std::invalid_argument("Size too big");
+        reserve(needed_space);
+        allocated_space = needed_space;
+        uint16_t sz = swap_endian_bytes<uint16_t>(allocated_space - 2);
+        memcpy(record, &sz, 2);
+        // copy in the payload
+        std::copy(data.begin(), data.end(), &record[SIZE]);
     }
     std::vector<unsigned char> get_message() const
     {
-        size_t sz = allocated_space - SIZE;
-        std::vector<unsigned char> vec(sz);
-        vec.assign(&record[SIZE], &record[SIZE] + sz);
-        return vec;
+        return std::vector<unsigned char>(&record[SIZE], &record[0] + allocated_space);
     }
     std::vector<unsigned char> get_record_as_vec() const
     {
-        std::vector<unsigned char> vec(allocated_space);
-        vec.assign(&record[0], &record[0] + allocated_space);
-        return vec;
+        return std::vector<unsigned char>(&record[0], &record[0] + allocated_space);
     }
 
     const unsigned char* get_record() const { return record; }
+    size_t get_record_length() const { return allocated_space; }
+    std::span<const unsigned char> get_record_span() const { return std::span<const unsigned char>(record, allocated_space); }
     protected:
-    unsigned char *record = nullptr;
-    size_t allocated_space = 0;
+    /***
+     * make sure there is room for a record of sz bytes
+     */
+    void reserve(size_t sz)
+    {
+        if (sz <= capacity)
+            return;
+        unsigned char* tmp = nullptr;
+        if (record == inline_record)
+        {
+            tmp = (unsigned char*)malloc(sz);
+            if (tmp != nullptr)
+                memcpy(tmp, inline_record, SIZE);
+        }
+        else
+        {
+            tmp = (unsigned char*)realloc(record, sz);
+        }
+        if (tmp == nullptr)
+            throw std::invalid_argument("Size too big");
+        record = tmp;
+        capacity = sz;
+    }
+    unsigned char inline_record[SIZE];
+    unsigned char *record = inline_record;
+    size_t allocated_space = SIZE; // the size of the record
+    size_t capacity = SIZE; // how much room record has
 };
 
 /***
- * A temporary storage area for an incoming message
+ * @returns true if this is a packet type we know about
  */
-struct incoming_message
+inline bool known_packet_type(unsigned char packetType)
 {
-    incoming_message() { clean(); }
-    bool decode_header()
+    switch(packetType)
     {
-        switch(buffer[2])
+        case('+'):
+        case('A'):
+        case('J'):
+        case('S'): // sequenced_data
+        case('H'):
+        case('Z'):
+        case('L'):
+        case('U'): // unsequenced
+        case('R'):
+        case('O'):
+            return true;
+    }
+    return false;
+}
+
+/***
+ * Storage for incoming bytes. The socket reads as much as it can into the
+ * free space, and then every complete packet is taken out in one pass. A
+ * partial packet at the end stays put until the next read completes it.
+ * Packets are always contiguous, so they can be handed out as views.
+ */
+class receive_buffer
+{
+    public:
+    // the largest possible packet (2 byte length plus 65535 bytes)
+    static constexpr size_t MAX_PACKET_LEN = 2 + UINT16_MAX;
+
+    receive_buffer(size_t capacity = 2 * MAX_PACKET_LEN) : buffer(std::max(capacity, 2 * MAX_PACKET_LEN)) {}
+    /***
+     * @returns where the next read should go
+     */
+    std::span<unsigned char> free_space() { return std::span<unsigned char>(&buffer[end], buffer.size() - end); }
+    /***
+     * @param length the number of bytes the last read put into free_space()
+     */
+    void commit(size_t length) { end += length; }
+    /***
+     * @returns the next complete packet, or nullptr if there is not one
+     */
+    const unsigned char* next_packet()
+    {
+        if (end - begin < 2)
+            return nullptr;
+        uint16_t sz;
+        memcpy(&sz, &buffer[begin], sizeof(sz));
+        sz = swap_endian_bytes<uint16_t>(sz);
+        if (sz == 0)
         {
-            case('+'):
-            case('A'):
-            case('J'):
-            case('S'): // sequenced_data
-            case('H'):
-            case('Z'):
-            case('L'):
-            case('U'): // unsequenced
-            case('R'):
-            case('O'):
-                return true;
+            // every packet has at least a type, the stream is out of sync
+            corrupt = true;
+            return nullptr;
         }
-        return false;
+        if (end - begin < (size_t)sz + 2)
+            return nullptr;
+        const unsigned char* packet = &buffer[begin];
+        begin += sz + 2;
+        return packet;
     }
-    unsigned char* data() { return &buffer[0]; }
-    unsigned char* body() { return &buffer[3]; }
-    size_t body_length() { uint16_t val; memcpy(&val, buffer, sizeof(val)); return swap_endian_bytes<uint16_t>(val)-1; }
-    void clean() { memset(&buffer[0], 0, max_length); }
-    
+    /***
+     * Make sure there is room for the rest of a partial packet. Packets
+     * already handed out by next_packet() are no longer valid.
+     */
+    void compact()
+    {
+        if (begin == end)
+        {
+            begin = end = 0;
+        }
+        else if (buffer.size() - end < MAX_PACKET_LEN)
+        {
+            memmove(&buffer[0], &buffer[begin], end - begin);
+            end -= begin;
+            begin = 0;
+        }
+    }
+    /***
+     * @returns true if the stream can no longer be framed
+     */
+    bool is_corrupt() const { return corrupt; }
+    /***
+     * Give up on the stream, because a packet in it made no sense
+     */
+    void set_corrupt() { corrupt = true; }
+
     private:
-    static const size_t max_length = 65535;
-    size_t curr_length = 0;
-    unsigned char buffer[max_length];
+    std::vector<unsigned char> buffer;
+    size_t begin = 0; // the start of the first packet not yet handed out
+    size_t end = 0; // the end of the bytes read so far
+    bool corrupt = false;
+};
+
+/***
+ * A non-owning look at a packet that is sitting in a buffer (usually a
+ * receive_buffer). Nothing is copied, so the view is only good for as long
+ * as the buffer is. Use the field records of PACKET to get at the values.
+ */
+template<typename PACKET>
+struct message_view
+{
+    message_view(const unsigned char* in) : record(in) {}
+    char get_message_type() const { return (char)record[2]; }
+    uint8_t get_raw_byte(uint8_t pos) const { return record[pos]; }
+    int64_t get_int(const message_record& mr) const { return read_int(record, mr); }
+    const std::string get_string(const message_record& mr) const { return read_string(record, mr); }
+    template<message_record MR>
+    int64_t get_int() const
+    {
+        static_assert(MR.offset + MR.length <= PACKET::fixed_size, "field is outside of the packet");
+        return read_int<MR>(record);
+    }
+    template<message_record MR>
+    const std::string get_string() const
+    {
+        static_assert(MR.offset + MR.length <= PACKET::fixed_size, "field is outside of the packet");
+        return read_string(record, MR);
+    }
+    /***
+     * @returns the payload (everything after the fixed part of the packet)
+     */
+    std::span<const unsigned char> get_message() const
+    {
+        size_t length = get_record_length();
+        if (length <= PACKET::fixed_size)
+            return std::span<const unsigned char>();
+        return std::span<const unsigned char>(&record[PACKET::fixed_size], length - PACKET::fixed_size);
+    }
+    const unsigned char* get_record() const { return record; }
+    /***
+     * @returns the size of the whole packet, including the 2 byte length
+     */
+    size_t get_record_length() const
+    {
+        uint16_t sz;
+        memcpy(&sz, record, sizeof(sz));
+        return swap_endian_bytes<uint16_t>(sz) + 2;
+    }
+
+    private:
+    const unsigned char* record = nullptr;
 };
 
 const static uint8_t DEBUG_PACKET_LEN = 3;
@@ -217,10 +542,12 @@ struct debug_packet : public message<DEBUG_PACKET_LEN>
 {
     static constexpr message_record PACKET_LENGTH{0, 2, message_record::field_type::INTEGER};
     static constexpr message_record PACKET_TYPE{2, 1, message_record::field_type::ALPHA};
+    static constexpr std::array<message_record, 2> fields{ PACKET_LENGTH, PACKET_TYPE };
     
     debug_packet() : message('+') {}
     debug_packet(const unsigned char* in) : message(in) {}
 };
+static_assert(valid_schema(debug_packet::fields, DEBUG_PACKET_LEN));
 
 /*****
  * Outgoing messages (to NASDAQ)
@@ -233,10 +560,12 @@ struct login_accepted : public message<LOGIN_ACCEPTED_LEN>
     static constexpr message_record PACKET_TYPE{2, 1, message_record::field_type::ALPHA};
     static constexpr message_record SESSION{3, 10, message_record::field_type::ALPHA};
     static constexpr message_record SEQUENCE_NUMBER{13, 20, message_record::field_type::NUMERIC};
+    static constexpr std::array<message_record, 4> fields{ PACKET_LENGTH, PACKET_TYPE, SESSION, SEQUENCE_NUMBER };
     
     login_accepted() : message('A') {}
     login_accepted(const unsigned char* in) : message(in) {}
 };
+static_assert(valid_schema(login_accepted::fields, LOGIN_ACCEPTED_LEN));
 
 const static uint8_t LOGIN_REJECTED_LEN = 4;
 struct login_rejected : public message<LOGIN_REJECTED_LEN>
@@ -245,40 +574,48 @@ struct login_rejected : public message<LOGIN_REJECTED_LEN>
     static constexpr message_record PACKET_TYPE{2, 1, message_record::field_type::ALPHA};
     // A (authorization) or S (session not available)
     static constexpr message_record REJECT_REASON_CODE{3, 1, message_record::field_type::ALPHA};
+    static constexpr std::array<message_record, 3> fields{ PACKET_LENGTH, PACKET_TYPE, REJECT_REASON_CODE };
     
     login_rejected() : message('J') {}
     login_rejected(const unsigned char* in) : message(in) {}
 };
+static_assert(valid_schema(login_rejected::fields, LOGIN_REJECTED_LEN));
 
 const static uint8_t SEQUENCED_DATA_LEN = 3;
 struct sequenced_data : public message<SEQUENCED_DATA_LEN>
 {
     static constexpr message_record PACKET_LENGTH{0, 2, message_record::field_type::INTEGER};
     static constexpr message_record PACKET_TYPE{2, 1, message_record::field_type::ALPHA};
+    static constexpr std::array<message_record, 2> fields{ PACKET_LENGTH, PACKET_TYPE };
     
     sequenced_data() : message('S') {}
     sequenced_data(const unsigned char* in) : message(in) {}
 };
+static_assert(valid_schema(sequenced_data::fields, SEQUENCED_DATA_LEN));
 
 const static uint8_t SERVER_HEARTBEAT_LEN = 3;
 struct server_heartbeat : public message<SERVER_HEARTBEAT_LEN>
 {
     static constexpr message_record PACKET_LENGTH{0, 2, message_record::field_type::INTEGER};
     static constexpr message_record PACKET_TYPE{2, 1, message_record::field_type::ALPHA};
+    static constexpr std::array<message_record, 2> fields{ PACKET_LENGTH, PACKET_TYPE };
     
     server_heartbeat() : message('H') {}
     server_heartbeat(const unsigned char* in) : message(in) {}
 };
+static_assert(valid_schema(server_heartbeat::fields, SERVER_HEARTBEAT_LEN));
 
 const static uint8_t END_OF_SESSION_LEN = 3;
 struct end_of_session : public message<END_OF_SESSION_LEN>
 {
     static constexpr message_record PACKET_LENGTH{0, 2, message_record::field_type::INTEGER};
     static constexpr message_record PACKET_TYPE{2, 1, message_record::field_type::ALPHA};
+    static constexpr std::array<message_record, 2> fields{ PACKET_LENGTH, PACKET_TYPE };
     
     end_of_session() : message('Z') {}
     end_of_session(const unsigned char* in) : message(in) {}
 };
+static_assert(valid_schema(end_of_session::fields, END_OF_SESSION_LEN));
 
 /****
  * Client packets
@@ -293,40 +630,93 @@ struct login_request : public message<LOGIN_REQUEST_LEN>
     static constexpr message_record PASSWORD{9, 10, message_record::field_type::ALPHA};
     static constexpr message_record REQUESTED_SESSION{19, 10, message_record::field_type::ALPHA};
     static constexpr message_record REQUESTED_SEQUENCE_NUMBER{29, 20, message_record::field_type::NUMERIC};
+    static constexpr std::array<message_record, 6> fields{ PACKET_LENGTH, PACKET_TYPE, USERNAME, PASSWORD, REQUESTED_SESSION, REQUESTED_SEQUENCE_NUMBER };
     
     login_request() : message('L') {}
     login_request(const unsigned char* in) : message(in) {}
 };
+static_assert(valid_schema(login_request::fields, LOGIN_REQUEST_LEN));
 
 const static uint8_t UNSEQUENCED_DATA_LEN = 3;
 struct unsequenced_data : public message<UNSEQUENCED_DATA_LEN>
 {
     static constexpr message_record PACKET_LENGTH{0, 2, message_record::field_type::INTEGER};
     static constexpr message_record PACKET_TYPE{2, 1, message_record::field_type::ALPHA};
+    static constexpr std::array<message_record, 2> fields{ PACKET_LENGTH, PACKET_TYPE };
     
     unsequenced_data() : message('U') {}
     unsequenced_data(const unsigned char* in) : message(in) {}
 };
+static_assert(valid_schema(unsequenced_data::fields, UNSEQUENCED_DATA_LEN));
 
 const static uint8_t CLIENT_HEARTBEAT_LEN = 3;
 struct client_heartbeat : public message<CLIENT_HEARTBEAT_LEN>
 {
     static constexpr message_record PACKET_LENGTH{0, 2, message_record::field_type::INTEGER};
     static constexpr message_record PACKET_TYPE{2, 1, message_record::field_type::ALPHA};
+    static constexpr std::array<message_record, 2> fields{ PACKET_LENGTH, PACKET_TYPE };
     
     client_heartbeat() : message('R') {}
     client_heartbeat(const unsigned char* in) : message(in) {}
 };
+static_assert(valid_schema(client_heartbeat::fields, CLIENT_HEARTBEAT_LEN));
 
 const static uint8_t LOGOUT_REQUEST_LEN = 3;
 struct logout_request : public message<LOGOUT_REQUEST_LEN>
 {
     static constexpr message_record PACKET_LENGTH{0, 2, message_record::field_type::INTEGER};
     static constexpr message_record PACKET_TYPE{2, 1, message_record::field_type::ALPHA};
+    static constexpr std::array<message_record, 2> fields{ PACKET_LENGTH, PACKET_TYPE };
     
     logout_request() : message('O') {}
     logout_request(const unsigned char* in) : message(in) {}
 };
+static_assert(valid_schema(logout_request::fields, LOGOUT_REQUEST_LEN));
+
+/****
+ * Views of incoming packets
+ */
+using debug_packet_view = message_view<debug_packet>;
+using login_accepted_view = message_view<login_accepted>;
+using login_rejected_view = message_view<login_rejected>;
+using sequenced_data_view = message_view<sequenced_data>;
+using server_heartbeat_view = message_view<server_heartbeat>;
+using end_of_session_view = message_view<end_of_session>;
+using login_request_view = message_view<login_request>;
+using unsequenced_data_view = message_view<unsequenced_data>;
+using client_heartbeat_view = message_view<client_heartbeat>;
+using logout_request_view = message_view<logout_request>;
+
+/***
+ * @returns the fixed part of a packet type (every packet of the type is at
+ * least this long), or 0 if it is not a type we know about
+ */
+inline size_t fixed_packet_length(unsigned char packetType)
+{
+    switch(packetType)
+    {
+        case('+'): return debug_packet::fixed_size;
+        case('A'): return login_accepted::fixed_size;
+        case('J'): return login_rejected::fixed_size;
+        case('S'): return sequenced_data::fixed_size;
+        case('H'): return server_heartbeat::fixed_size;
+        case('Z'): return end_of_session::fixed_size;
+        case('L'): return login_request::fixed_size;
+        case('U'): return unsequenced_data::fixed_size;
+        case('R'): return client_heartbeat::fixed_size;
+        case('O'): return logout_request::fixed_size;
+    }
+    return 0;
+}
+
+/***
+ * A sequenced data packet and its sequence number (see on_sequenced_batch)
+ */
+struct sequenced_message
+{
+    uint64_t seq;
+    sequenced_data_view view;
+};
 
 } // end namespace soupbintcp
 
@@ -0,0 +1,155 @@
+#include <gtest/gtest.h>
+#include "soup_bin_server.h"
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+// the heap allocations of each thread, for the tests that want none
+static thread_local uint64_t threadAllocations = 0;
+
+void* operator new(size_t size)
+{
+    threadAllocations++;
+    if (void* mem = malloc(size > 0 ? size : 1))
+        return mem;
+    throw std::bad_alloc();
+}
+void operator delete(void* mem) noexcept { free(mem); }
+void operator delete(void* mem, size_t) noexcept { free(mem); }
+
+/***
+ * A client that counts what it gets
+ */
+class CountingConnection : public SoupBinConnection
+{
+    public:
+    CountingConnection(boost::asio::ip::tcp::socket socket, MessageRepeater* parent) : SoupBinConnection(std::move(socket), parent) {}
+    CountingConnection(const std::string& url, const std::string& sessionId = "") : SoupBinConnection(url, "test1", "password", sessionId, 0) {}
+    void on_sequenced_data(const soupbintcp::sequenced_data_view& in) override { numSequenced++; }
+    void on_unsequenced_data(const soupbintcp::unsequenced_data_view& in) override { numUnsequenced++; }
+    std::atomic<uint32_t> numSequenced = 0;
+    std::atomic<uint32_t> numUnsequenced = 0;
+};
+
+/***
+ * Sends every unsequenced message straight back, and counts the heap
+ * allocations of its thread from the warm up on
+ */
+class EchoConnection : public SoupBinConnection
+{
+    public:
+    EchoConnection(boost::asio::ip::tcp::socket socket, MessageRepeater* parent) : SoupBinConnection(std::move(socket), parent) {}
+    void on_unsequenced_data(const soupbintcp::unsequenced_data_view& in) override
+    {
+        if (++echoed == WARM_UP)
+            allocationsAtWarmUp = threadAllocations;
+        send_unsequenced(in.get_message());
+        if (echoed == TOTAL)
+            allocations.store(threadAllocations - allocationsAtWarmUp, std::memory_order_release);
+    }
+    static constexpr uint64_t WARM_UP = 1000;
+    static constexpr uint64_t TOTAL = 5000;
+    uint64_t echoed = 0;
+    uint64_t allocationsAtWarmUp = 0;
+    std::atomic<uint64_t> allocations = UINT64_MAX;
+};
+
+class EchoServer : public SoupBinServer<EchoConnection>
+{
+    public:
+    EchoServer(uint32_t port) : SoupBinServer(port) {}
+    std::shared_ptr<EchoConnection> GetConnection(size_t i) { return connections[i]; }
+};
+
+TEST(AllocationTests, SendWithoutAllocating)
+{
+    EchoServer server(9023);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    CountingConnection client("127.0.0.1:9023");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    // 1 at a time, and a few at a time, in sizes from several classes
+    std::vector<std::string> messages = { "Hi", std::string(200, 'x'), std::string(3000, 'y') };
+    uint32_t sent = 0;
+    while(sent < EchoConnection::TOTAL)
+    {
+        for(int i = 0; i < 3 && sent < EchoConnection::TOTAL; ++i)
+            client.send_unsequenced(std::string_view(messages[sent++ % messages.size()]));
+        auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while(client.numUnsequenced < sent && std::chrono::steady_clock::now() < giveUp)
+            std::this_thread::yield();
+        ASSERT_EQ(client.numUnsequenced, sent);
+    }
+    // framing, queuing, writing and the write completing, on the server's thread.
+    // The last echo can reach the client before the server has counted
+    auto conn = server.GetConnection(0);
+    auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while(conn->allocations.load(std::memory_order_acquire) == UINT64_MAX && std::chrono::steady_clock::now() < giveUp)
+        std::this_thread::yield();
+    EXPECT_EQ(conn->allocations.load(std::memory_order_acquire), 0);
+}
+
+class PublishServer : public SoupBinServer<CountingConnection>
+{
+    public:
+    PublishServer(uint32_t port, const SoupBinServerOptions& options) : SoupBinServer(port, options) {}
+    /***
+     * @returns the heap allocations of the server's thread so far
+     */
+    uint64_t server_thread_allocations()
+    {
+        std::promise<uint64_t> result;
+        boost::asio::post(io_context, [&result]() { result.set_value(threadAllocations); });
+        return result.get_future().get();
+    }
+};
+
+TEST(AllocationTests, PublishWithoutAllocating)
+{
+    SoupBinServerOptions options;
+    options.log.maxMessages = 200; // the log drops old messages, and reuses their room
+    options.log.chunkSize = 64 * 1024; // through many chunks
+    options.sessions = { "FEED1" };
+    PublishServer server(9029, options);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    CountingConnection main("127.0.0.1:9029");
+    CountingConnection feed1("127.0.0.1:9029", "FEED1");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    size_t feed1Stream = server.find_session("FEED1");
+    // a few at a time, to both sessions, sequenced and not, in sizes from
+    // several classes (and bigger than the publish ring keeps in its slots)
+    std::vector<std::string> messages = { "Hi", std::string(200, 'x'), std::string(3000, 'y') };
+    uint32_t sent = 0;
+    uint64_t allocationsAtWarmUp = 0;
+    const uint32_t WARM_UP = 3000;
+    const uint32_t TOTAL = 6000;
+    while(sent < TOTAL)
+    {
+        if (sent == WARM_UP)
+            allocationsAtWarmUp = server.server_thread_allocations();
+        for(int i = 0; i < 4; ++i, ++sent)
+        {
+            std::string_view message(messages[sent % messages.size()]);
+            if (i == 0)
+                server.send_sequenced(message);
+            else if (i == 1)
+                server.send_sequenced(feed1Stream, message);
+            else if (i == 2)
+                server.send_unsequenced(message);
+            else
+                server.send_unsequenced(feed1Stream, message);
+        }
+        auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while((main.numSequenced < sent / 4 || feed1.numUnsequenced < sent / 4)
+                && std::chrono::steady_clock::now() < giveUp)
+            std::this_thread::yield();
+        ASSERT_EQ(main.numSequenced, sent / 4);
+        ASSERT_EQ(feed1.numUnsequenced, sent / 4);
+    }
+    // draining, sequencing into the log, and the fan out to the sockets
+    EXPECT_EQ(server.server_thread_allocations() - allocationsAtWarmUp, 0);
+    EXPECT_EQ(main.numUnsequenced, TOTAL / 4);
+    EXPECT_EQ(feed1.numSequenced, TOTAL / 4);
+}
@@ -0,0 +1,269 @@
+#include <gtest/gtest.h>
+#include "soup_bin_sequenced_log.h"
+#include "soup_bin_journal.h"
+#include "soup_bin_shared_ring.h"
+#include <filesystem>
+#include <string>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static std::string payload_of(const unsigned char* frame)
+{
+    soupbintcp::sequenced_data_view view(frame);
+    auto payload = view.get_message();
+    return std::string(payload.begin(), payload.end());
+}
+
+TEST(SequencedLogTests, AppendAndGet)
+{
+    SequencedLog log;
+    EXPECT_EQ(log.first_seq(), 1);
+    EXPECT_EQ(log.next_seq(), 1);
+    for(int i = 1; i <= 100; ++i)
+    {
+        std::string msg = "Hello" + std::to_string(i);
+        soupbintcp::buffer_slice frame = log.append('S', soupbintcp::as_uchars(msg));
+        EXPECT_EQ(payload_of(frame.data()), msg);
+    }
+    EXPECT_EQ(log.next_seq(), 101);
+    EXPECT_EQ(log.size(), 100);
+    EXPECT_TRUE(log.contains(1));
+    EXPECT_FALSE(log.contains(101));
+    EXPECT_EQ(payload_of(log.get(42).data()), "Hello42");
+    EXPECT_EQ(log.get(101).size(), 0);
+
+    // the whole log is in one chunk, so a range is every message back to back
+    uint64_t count = 0;
+    soupbintcp::buffer_slice range = log.get_range(10, 1024 * 1024, count);
+    EXPECT_EQ(count, 91);
+    EXPECT_EQ(range.data(), log.get(10).data());
+    size_t pos = 0;
+    for(uint64_t seq = 10; seq <= 100; ++seq)
+    {
+        EXPECT_EQ(payload_of(range.data() + pos), "Hello" + std::to_string(seq));
+        pos += log.get(seq).size();
+    }
+    EXPECT_EQ(pos, range.size());
+
+    // byte limits are honoured, but at least one message comes back
+    range = log.get_range(10, 1, count);
+    EXPECT_EQ(count, 1);
+    range = log.get_range(10, log.get(10).size() * 3, count);
+    EXPECT_EQ(count, 3);
+}
+
+TEST(SequencedLogTests, ChunksAndRetention)
+{
+    SequencedLog::Options options;
+    options.chunkSize = 100; // 10 byte messages, 10 to a chunk
+    options.maxMessages = 25;
+    SequencedLog log(1, options);
+    std::string msg = "1234567";
+    soupbintcp::buffer_slice first = log.append('S', soupbintcp::as_uchars(msg));
+    for(int i = 2; i <= 40; ++i)
+        log.append('S', soupbintcp::as_uchars(msg));
+    EXPECT_EQ(log.size(), 25);
+    EXPECT_EQ(log.first_seq(), 16);
+    EXPECT_EQ(log.next_seq(), 41);
+    EXPECT_FALSE(log.contains(15));
+    EXPECT_EQ(log.bytes(), 25 * 10);
+    // a range stops at the end of a chunk
+    uint64_t count = 0;
+    log.get_range(16, 1024, count);
+    EXPECT_EQ(count, 5);
+    log.get_range(21, 1024, count);
+    EXPECT_EQ(count, 10);
+    // a slice taken before the chunk was dropped is still good
+    EXPECT_EQ(payload_of(first.data()), msg);
+
+    SequencedLog::Options byBytes;
+    byBytes.maxBytes = 55;
+    SequencedLog small(1, byBytes);
+    for(int i = 0; i < 10; ++i)
+        small.append('S', soupbintcp::as_uchars(msg));
+    EXPECT_EQ(small.size(), 5);
+    EXPECT_EQ(small.first_seq(), 6);
+}
+
+class JournalTests : public ::testing::Test
+{
+    protected:
+    void SetUp() override
+    {
+        directory = (std::filesystem::temp_directory_path() / ("soupbin_journal_" + std::to_string(::getpid()))).string();
+        std::filesystem::remove_all(directory);
+    }
+    void TearDown() override { std::filesystem::remove_all(directory); }
+    std::string directory;
+};
+
+TEST_F(JournalTests, AppendAndRecover)
+{
+    std::string sessionId = "SESSION1";
+    {
+        SoupBinJournal::Options options;
+        options.syncPolicy = SoupBinJournal::Options::SyncPolicy::EVERY_N;
+        options.syncEveryN = 3;
+        SoupBinJournal journal(directory, sessionId, options);
+        EXPECT_EQ(journal.first_seq(), 1);
+        EXPECT_EQ(journal.next_seq(), 1);
+        for(int i = 1; i <= 10; ++i)
+        {
+            std::string msg = "Hello" + std::to_string(i);
+            soupbintcp::buffer_slice frame = soupbintcp::make_frame('S', soupbintcp::as_uchars(msg));
+            soupbintcp::buffer_slice stored = journal.append(frame.span());
+            EXPECT_EQ(payload_of(stored.data()), msg);
+        }
+        EXPECT_EQ(journal.next_seq(), 11);
+    }
+    // a restart picks up the sequence number and the session from the index
+    SoupBinJournal journal(directory, "OTHER");
+    EXPECT_EQ(journal.get_session_id(), sessionId);
+    EXPECT_EQ(journal.first_seq(), 1);
+    EXPECT_EQ(journal.next_seq(), 11);
+    EXPECT_EQ(payload_of(journal.get(7).data()), "Hello7");
+    uint64_t count = 0;
+    soupbintcp::buffer_slice range = journal.get_range(3, 1024, count);
+    EXPECT_EQ(count, 8);
+    size_t pos = 0;
+    for(uint64_t seq = 3; seq <= 10; ++seq)
+    {
+        EXPECT_EQ(payload_of(range.data() + pos), "Hello" + std::to_string(seq));
+        pos += journal.get(seq).size();
+    }
+    EXPECT_EQ(pos, range.size());
+    // and appends carry on from there
+    std::string msg = "Hello11";
+    journal.append(soupbintcp::make_frame('S', soupbintcp::as_uchars(msg)).span());
+    EXPECT_EQ(payload_of(journal.get(11).data()), msg);
+}
+
+TEST_F(JournalTests, Segments)
+{
+    SoupBinJournal::Options options;
+    options.segmentSize = 100; // 10 byte messages, 10 to a segment
+    std::string msg = "1234567";
+    soupbintcp::buffer_slice first;
+    {
+        SoupBinJournal journal(directory, "SESSION1", options);
+        first = journal.append(soupbintcp::make_frame('S', soupbintcp::as_uchars(msg)).span());
+        for(int i = 2; i <= 25; ++i)
+            journal.append(soupbintcp::make_frame('S', soupbintcp::as_uchars(msg)).span());
+        uint64_t count = 0;
+        journal.get_range(5, 1024, count);
+        EXPECT_EQ(count, 6); // stops at the end of the segment
+        journal.get_range(11, 1024, count);
+        EXPECT_EQ(count, 10);
+    }
+    // the slice kept its segment mapped after the journal went away
+    EXPECT_EQ(payload_of(first.data()), msg);
+    SoupBinJournal journal(directory, "SESSION1", options);
+    EXPECT_EQ(journal.next_seq(), 26);
+    EXPECT_EQ(payload_of(journal.get(21).data()), msg);
+    EXPECT_EQ(journal.get(26).size(), 0);
+}
+
+TEST_F(JournalTests, CorruptIndex)
+{
+    {
+        SoupBinJournal journal(directory, "SESSION1");
+        for(int i = 1; i <= 3; ++i)
+            journal.append(soupbintcp::make_frame('S', soupbintcp::as_uchars(std::string("Hello"))).span());
+    }
+    std::string indexPath = directory + "/00000000000000000001.idx";
+    const off_t countAt = 32; // magic, session, first sequence number
+    const off_t offsetsAt = 64; // the rest of the header
+    auto write_at = [&indexPath](off_t pos, uint64_t value) {
+        int fd = ::open(indexPath.c_str(), O_RDWR);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(::pwrite(fd, &value, sizeof(value), pos), (ssize_t)sizeof(value));
+        ::close(fd);
+    };
+    // more messages than the index has room for
+    write_at(countAt, 1ull << 40);
+    EXPECT_THROW(SoupBinJournal(directory, "SESSION1"), std::runtime_error);
+    // the last message starts past the end of the data
+    write_at(countAt, 3);
+    write_at(offsetsAt + 2 * sizeof(uint64_t), 1ull << 40);
+    EXPECT_THROW(SoupBinJournal(directory, "SESSION1"), std::runtime_error);
+}
+
+TEST(SharedRingTests, AppendFindAndRead)
+{
+    SoupBinSharedRing::Options options;
+    options.name = "soupbin-ring-test-" + std::to_string(::getpid());
+    options.capacity = 1; // the smallest there is, 2 of the largest packets
+    options.indexSize = 1024;
+    SoupBinSharedRing writer(options);
+    SoupBinSharedRing reader(options.name, writer.get_token());
+    // the same name without the token is someone else's ring
+    EXPECT_THROW(SoupBinSharedRing(options.name, writer.get_token() + 1), std::runtime_error);
+    uint64_t pos = 0;
+    EXPECT_EQ(reader.find(1, pos), SoupBinSharedRing::Find::NOT_YET);
+    for(uint64_t seq = 1; seq <= 100; ++seq)
+    {
+        std::string msg = "Hello" + std::to_string(seq);
+        writer.append(seq, soupbintcp::make_frame('S', soupbintcp::as_uchars(msg)).span());
+    }
+    writer.notify();
+
+    // the packets are back to back, as they would be on a socket
+    ASSERT_EQ(reader.find(42, pos), SoupBinSharedRing::Find::FOUND);
+    EXPECT_EQ(reader.find(101, pos), SoupBinSharedRing::Find::NOT_YET);
+    ASSERT_EQ(reader.find(42, pos), SoupBinSharedRing::Find::FOUND);
+    soupbintcp::receive_buffer buffer;
+    size_t length = reader.read(pos, buffer.free_space());
+    EXPECT_EQ(pos + length, reader.get_write_pos());
+    buffer.commit(length);
+    for(uint64_t seq = 42; seq <= 100; ++seq)
+    {
+        const unsigned char* packet = buffer.next_packet();
+        ASSERT_NE(packet, nullptr);
+        EXPECT_EQ(payload_of(packet), "Hello" + std::to_string(seq));
+    }
+    EXPECT_EQ(buffer.next_packet(), nullptr);
+    EXPECT_EQ(reader.read(reader.get_write_pos(), buffer.free_space()), 0);
+
+    // the writer does not wait, so a reader that falls a whole ring behind loses
+    uint64_t oldPos = pos;
+    std::string msg(1000, 'x');
+    for(uint64_t seq = 101; seq <= 400; ++seq)
+        writer.append(seq, soupbintcp::make_frame('S', soupbintcp::as_uchars(msg)).span());
+    EXPECT_EQ(reader.read(oldPos, buffer.free_space()), SoupBinSharedRing::LAPPED);
+    EXPECT_EQ(reader.find(42, pos), SoupBinSharedRing::Find::GONE);
+    ASSERT_EQ(reader.find(400, pos), SoupBinSharedRing::Find::FOUND);
+    soupbintcp::receive_buffer last;
+    length = reader.read(pos, last.free_space());
+    last.commit(length);
+    EXPECT_EQ(payload_of(last.next_packet()), msg);
+}
+
+TEST(SharedRingTests, NameInUse)
+{
+    SoupBinSharedRing::Options options;
+    options.name = "soupbin-ring-owner-test-" + std::to_string(::getpid());
+    options.capacity = 1;
+    options.indexSize = 16;
+    {
+        SoupBinSharedRing writer(options);
+        SoupBinSharedRing reader(options.name, writer.get_token());
+        // a second server does not take the ring from under the first one's readers
+        EXPECT_THROW(SoupBinSharedRing second(options), std::runtime_error);
+        EXPECT_NO_THROW(SoupBinSharedRing(options.name, writer.get_token()));
+    }
+    // a ring left behind by a server that died is replaced
+    pid_t child = ::fork();
+    ASSERT_GE(child, 0);
+    if (child == 0)
+    {
+        new SoupBinSharedRing(options);
+        ::_exit(0);
+    }
+    int status = 0;
+    ::waitpid(child, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+    SoupBinSharedRing replacement(options);
+    SoupBinSharedRing reader(options.name, replacement.get_token());
+    EXPECT_EQ(reader.get_write_pos(), 0);
+}
@@ -2,44 +2,62 @@
 #include "soup_bin_server.h"
 #include "soup_bin_client.h"
 #include <thread>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <map>
+#include <unistd.h>
 
 class MyConnection : public SoupBinConnection
 {
     public:
     MyConnection(boost::asio::ip::tcp::socket socket, MessageRepeater* parent) : SoupBinConnection(std::move(socket), parent) {}
     MyConnection(const std::string& url, const std::string& username, const std::string& password, 
-            const std::string& sessionId, uint64_t seqNum) 
-            : SoupBinConnection(url, username, password, sessionId, seqNum) {}
-    virtual void on_client_heartbeat(const soupbintcp::client_heartbeat& in) override
+            const std::string& sessionId, uint64_t seqNum, const PollOptions& pollOptions = PollOptions(),
+            const TransportOptions& transportOptions = TransportOptions()) 
+            : SoupBinConnection(url, username, password, sessionId, seqNum, false)
+    {
+        set_poll_options(pollOptions);
+        set_transport_options(transportOptions);
+        connect();
+    }
+    virtual void on_client_heartbeat(const soupbintcp::client_heartbeat_view& in) override
     {
         numClientHeartbeats++;
     }
-    virtual void on_server_heartbeat(const soupbintcp::server_heartbeat& in) override
+    virtual void on_server_heartbeat(const soupbintcp::server_heartbeat_view& in) override
     {
         numServerHeartbeats++;
     }
-    virtual void on_login_accepted(const soupbintcp::login_accepted& in) override
+    void on_sequenced_data(const soupbintcp::sequenced_data_view& in) override
     {
-        nextSeq = in.get_int(soupbintcp::login_accepted::SEQUENCE_NUMBER);
-        sessionId = in.get_string(soupbintcp::login_accepted::SESSION);
+        uint64_t seq = peek_next_seq(); // the connection moves it on after the call
+        auto payload = in.get_message();
+        messages.emplace(seq, std::vector<unsigned char>(payload.begin(), payload.end()));
     }
-    void on_sequenced_data(const soupbintcp::sequenced_data& in) override
+    void on_unsequenced_data(const soupbintcp::unsequenced_data_view& in) override
     {
-        uint64_t seq = get_next_seq();
-        messages.emplace(seq, in.get_message());
+        numUnsequenced++;
+    }
+    void on_login_rejected(const soupbintcp::login_rejected_view& in) override
+    {
+        rejectReason = in.get_string<soupbintcp::login_rejected::REJECT_REASON_CODE>();
     }
     uint32_t numClientHeartbeats = 0;
     uint32_t numServerHeartbeats = 0;
+    std::atomic<uint32_t> numUnsequenced = 0;
+    std::string rejectReason;
     std::unordered_map<uint64_t, std::vector<unsigned char>> messages;
 };
 class MySoupBinServer : public SoupBinServer<MyConnection>
 {
     public:
-    MySoupBinServer(uint32_t port) : SoupBinServer(port)
+    MySoupBinServer(uint32_t port, const SoupBinServerOptions& options = SoupBinServerOptions()) : SoupBinServer(port, options)
     {
     }
     uint32_t GetNumClientHeartbeats()
     {
+        std::lock_guard lock(connectionsMutex);
         uint32_t total = 0;
         for(auto c : connections)
             total += c->numClientHeartbeats;
@@ -47,11 +65,33 @@ class MySoupBinServer : public SoupBinServer<MyConnection>
     }
     uint32_t GetNumServerHeartbeats()
     {
+        std::lock_guard lock(connectionsMutex);
         uint32_t total = 0;
         for(auto c : connections)
             total += c->numServerHeartbeats;
         return total;
     }
+    uint32_t GetNumUnsequenced()
+    {
+        std::lock_guard lock(connectionsMutex);
+        uint32_t total = 0;
+        for(auto c : connections)
+            total += c->numUnsequenced;
+        return total;
+    }
+    std::shared_ptr<MyConnection> GetConnection(size_t i)
+    {
+        std::lock_guard lock(connectionsMutex);
+        return connections[i];
+    }
+    /***
+     * @returns the connections still open (the server lets go of closed ones)
+     */
+    size_t GetConnectionCount()
+    {
+        std::lock_guard lock(connectionsMutex);
+        return connections.size();
+    }
 };
 class MySoupBinClient
 {
@@ -68,7 +108,7 @@ class MySoupBinClient
     {
         return connection.numServerHeartbeats;
     }
-    uint64_t GetCurrentSequenceNo() { return connection.get_next_seq(false); }
+    uint64_t GetCurrentSequenceNo() { return connection.peek_next_seq(); }
     std::string GetSessionId() { return connection.get_session_id(); }
     std::string GetMessage(uint64_t msgNo) 
     { 
@@ -80,12 +120,86 @@ class MySoupBinClient
 };
 
 
+/***
+ * A client that logs in and then does not read until asked to, with a small
+ * receive buffer so that it backs up quickly
+ */
+class SlowClient
+{
+    public:
+    SlowClient(uint16_t port) : skt(io_context)
+    {
+        skt.open(boost::asio::ip::tcp::v4());
+        skt.set_option(boost::asio::socket_base::receive_buffer_size(4096));
+        skt.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), port));
+        soupbintcp::login_request req;
+        req.set_string<soupbintcp::login_request::USERNAME>("slow");
+        req.set_int<soupbintcp::login_request::REQUESTED_SEQUENCE_NUMBER>(1);
+        std::span<const unsigned char> record = req.get_record_span();
+        boost::asio::write(skt, boost::asio::buffer(record.data(), record.size()));
+    }
+    /***
+     * read until nothing comes in for a while
+     * @returns the payloads of the sequenced messages
+     */
+    std::vector<std::string> read_all()
+    {
+        skt.non_blocking(true);
+        soupbintcp::receive_buffer incoming;
+        std::vector<std::string> sequenced;
+        auto lastData = std::chrono::steady_clock::now();
+        while(std::chrono::steady_clock::now() - lastData < std::chrono::milliseconds(500))
+        {
+            std::span<unsigned char> space = incoming.free_space();
+            boost::system::error_code ec;
+            size_t length = skt.read_some(boost::asio::buffer(space.data(), space.size()), ec);
+            if (ec == boost::asio::error::would_block)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                continue;
+            }
+            if (ec)
+                break;
+            lastData = std::chrono::steady_clock::now();
+            incoming.commit(length);
+            while(const unsigned char* packet = incoming.next_packet())
+            {
+                if (packet[2] == 'S')
+                {
+                    auto payload = soupbintcp::sequenced_data_view(packet).get_message();
+                    sequenced.emplace_back(payload.begin(), payload.end());
+                }
+            }
+            incoming.compact();
+        }
+        return sequenced;
+    }
+    boost::asio::io_context io_context;
+    boost::asio::ip::tcp::socket skt;
+};
+
+/***
+ * a numbered message big enough to back up a slow client
+ */
+static std::string padded(uint32_t i)
+{
+    std::string msg = "Msg" + std::to_string(i);
+    msg.resize(1000, ' ');
+    return msg;
+}
+
+static void publish_padded(MySoupBinServer& server, uint32_t count)
+{
+    for(uint32_t i = 1; i <= count; ++i)
+        server.send_sequenced(std::string_view(padded(i)));
+}
+
 TEST(SoupBinServerTests, timer)
 {
     class MyClass : public TimerListener
     {
         public:
-        MyClass() : timer(this, 1000, Timer::get_time())
+        MyClass(boost::asio::io_context& context) : timer(this, 1000, context)
         {
         }
 
@@ -93,24 +207,70 @@ TEST(SoupBinServerTests, timer)
         {
             numFires++;
         }
-        uint16_t numFires = 0;
+        std::atomic<uint16_t> numFires = 0;
         Timer timer;
     };
 
-    MyClass myClass;
+    boost::asio::io_context context;
+    MyClass myClass(context);
+    std::thread runThread([&context]() { context.run(); });
     // check the timer, it should not have gone off
     EXPECT_EQ(myClass.numFires, 0);
-    // wait for half of the timeout and then reset
-    uint64_t start = Timer::get_time();
+    // wait for half of the timeout and then reset (on the timer's thread)
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
     EXPECT_EQ(myClass.numFires, 0);
-    myClass.timer.reset();
+    boost::asio::post(context, [&myClass]() { myClass.timer.reset(); });
     // now wait for the other half of the first timeout
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
     EXPECT_EQ(myClass.numFires, 0);
     // now wait for the other half of the second timeout (plus a little)
     std::this_thread::sleep_for(std::chrono::milliseconds(510));
     EXPECT_EQ(myClass.numFires, 1);
+    // a cancelled timer lets the io_context run out of work
+    boost::asio::post(context, [&myClass]() { myClass.timer.cancel(); });
+    runThread.join();
+    EXPECT_EQ(myClass.numFires, 1);
+}
+
+TEST(SoupBinServerTests, TimingWheel)
+{
+    class Counter : public TimerListener
+    {
+        public:
+        virtual void OnTimer(uint64_t msSince) override { numFires++; }
+        uint32_t numFires = 0;
+    };
+    // many timers on one thread, with no thread per timer
+    boost::asio::io_context context;
+    const size_t numTimers = 5000;
+    std::vector<Counter> counters(numTimers);
+    std::vector<std::unique_ptr<Timer>> timers;
+    for(size_t i = 0; i < numTimers; ++i)
+        timers.push_back(std::make_unique<Timer>(&counters[i], 100 + (i % 10) * 10, context));
+    auto& wheel = boost::asio::use_service<SoupBinTimingWheel>(context);
+    EXPECT_EQ(wheel.get_armed_count(), numTimers);
+    // cancel the odd ones
+    for(size_t i = 1; i < numTimers; i += 2)
+        timers[i]->cancel();
+    EXPECT_EQ(wheel.get_armed_count(), numTimers / 2);
+    context.run_for(std::chrono::milliseconds(250));
+    for(size_t i = 0; i < numTimers; ++i)
+    {
+        if (i % 2 == 1)
+            ASSERT_EQ(counters[i].numFires, 0);
+        else
+            ASSERT_GE(counters[i].numFires, 1);
+    }
+    // a timer further out than a turn of the wheel waits its turn
+    Counter longCounter;
+    Timer longTimer(&longCounter, SoupBinTimingWheel::SLOTS * SoupBinTimingWheel::TICK_MS + 200, context);
+    timers.clear();
+    context.restart();
+    context.run_for(std::chrono::milliseconds(SoupBinTimingWheel::SLOTS * SoupBinTimingWheel::TICK_MS));
+    EXPECT_EQ(longCounter.numFires, 0);
+    context.restart();
+    context.run_for(std::chrono::milliseconds(400));
+    EXPECT_EQ(longCounter.numFires, 1);
 }
 
 TEST(SoupBinServerTests, ServerStartStop)
@@ -131,8 +291,7 @@ TEST(SoupBinServerTests, OneClient)
     EXPECT_EQ(server.GetNumServerHeartbeats(), 0);
     EXPECT_EQ(client.GetNumClientHeartbeats(), 0);
     EXPECT_EQ(client.GetNumServerHeartbeats(), 1);
-    // if the server sends data, it should not bother sending heartbeat requests
-    // the client always sends heartbeat requests
+    // if either side sends data, it does not bother sending heartbeats (see HeartbeatOnlyWhenIdle)
 }
 
 TEST(SoupBinServerTests, ServerReconnect)
@@ -164,3 +323,946 @@ TEST(SoupBinServerTests, ServerReconnect)
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
     EXPECT_EQ(client->GetCurrentSequenceNo(), 4);
 }
+
+TEST(SoupBinServerTests, SendWithoutOwningVector)
+{
+    MySoupBinServer server(9012);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    MySoupBinClient client("127.0.0.1:9012", "test1", "password");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    server.send_sequenced(std::string_view("Hello"));
+    const std::byte bytes[] = { std::byte{'W'}, std::byte{'o'}, std::byte{'r'}, std::byte{'l'}, std::byte{'d'} };
+    server.send_sequenced(std::span<const std::byte>(bytes));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(client.GetMessage(1), "Hello");
+    EXPECT_EQ(client.GetMessage(2), "World");
+}
+
+TEST(SoupBinServerTests, CoalescedWrites)
+{
+    MySoupBinServer server(9012);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    MySoupBinClient client("127.0.0.1:9012", "test1", "password");
+    SoupBinConnection::WriteOptions options;
+    options.flushPolicy = SoupBinConnection::WriteOptions::FlushPolicy::BATCH;
+    options.latencyBudget = std::chrono::milliseconds(5);
+    client.connection.set_write_options(options);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    // a burst of small packets should go out in far fewer writes
+    uint64_t writesBefore = client.connection.get_write_count();
+    const uint32_t numMessages = 1000;
+    for(uint32_t i = 0; i < numMessages; ++i)
+        client.connection.send_unsequenced(std::string_view("Hello"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(server.GetNumUnsequenced(), numMessages);
+    EXPECT_LT(client.connection.get_write_count() - writesBefore, numMessages / 10);
+    // and far fewer reads on the other side
+    auto conn = server.GetConnection(0);
+    EXPECT_LT(conn->get_receive_count(), conn->get_packet_count() / 10);
+}
+
+TEST(SoupBinServerTests, JournalSurvivesRestart)
+{
+    std::string directory = (std::filesystem::temp_directory_path() / ("soupbin_server_journal_" + std::to_string(::getpid()))).string();
+    std::filesystem::remove_all(directory);
+    SoupBinServerOptions options;
+    options.journalDirectory = directory;
+    options.journal.syncPolicy = SoupBinJournal::Options::SyncPolicy::PERIODIC; // the server's timer syncs too
+    options.journal.syncInterval = std::chrono::milliseconds(10);
+    options.sessionId = "SESSION1";
+    {
+        MySoupBinServer server(9012, options);
+        for(int i = 1; i <= 3; ++i)
+            server.send_sequenced(std::string_view("Hello" + std::to_string(i)));
+    }
+    // a new server finds the history on disk
+    MySoupBinServer server(9012, options);
+    EXPECT_EQ(server.get_session_id(), "SESSION1");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    MySoupBinClient client("127.0.0.1:9012", "test1", "password", "", 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(client.GetCurrentSequenceNo(), 4);
+    EXPECT_EQ(client.GetMessage(1), "Hello1");
+    EXPECT_EQ(client.GetMessage(3), "Hello3");
+    std::filesystem::remove_all(directory);
+}
+
+TEST(SoupBinServerTests, ReplayCatchesUpToLive)
+{
+    MySoupBinServer server(9012);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    // plenty of history, so the replay takes many batches
+    const uint32_t numHistory = 20000;
+    const uint32_t numLive = 20000;
+    for(uint32_t i = 1; i <= numHistory; ++i)
+        server.send_sequenced(std::string_view("Msg" + std::to_string(i)));
+    MySoupBinClient client("127.0.0.1:9012", "test1", "password", "", 1);
+    // keep publishing while the replay is going
+    for(uint32_t i = numHistory + 1; i <= numHistory + numLive; ++i)
+        server.send_sequenced(std::string_view("Msg" + std::to_string(i)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    // every message, once, in order
+    EXPECT_EQ(client.GetCurrentSequenceNo(), numHistory + numLive + 1);
+    EXPECT_EQ(client.GetMessages().size(), numHistory + numLive);
+    for(uint32_t i = 1; i <= numHistory + numLive; ++i)
+    {
+        ASSERT_EQ(client.GetMessage(i), "Msg" + std::to_string(i));
+    }
+}
+
+TEST(SoupBinServerTests, LoginWithoutReplay)
+{
+    MySoupBinServer server(9012);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    for(int i = 1; i <= 3; ++i)
+        server.send_sequenced(std::string_view("Hello" + std::to_string(i)));
+    // sequence number 0 means "only new messages"
+    MySoupBinClient client("127.0.0.1:9012", "test1", "password");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(client.GetCurrentSequenceNo(), 4);
+    server.send_sequenced(std::string_view("Hello4"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(client.GetMessages().size(), 1);
+    EXPECT_EQ(client.GetMessage(4), "Hello4");
+}
+
+TEST(SoupBinServerTests, SlowConsumerDisconnect)
+{
+    MySoupBinServer server(9012);
+    SoupBinConnection::QueueOptions queueOptions;
+    queueOptions.maxBytes = 256 * 1024;
+    server.set_queue_options(queueOptions);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    SlowClient client(9012);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto conn = server.GetConnection(0);
+    const uint32_t numMessages = 10000;
+    publish_padded(server, numMessages);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    auto stats = conn->get_queue_stats();
+    EXPECT_GT(stats.slowConsumerEvents, 0);
+    EXPECT_LE(stats.highWaterBytes, queueOptions.maxBytes);
+    EXPECT_EQ(conn->status, SoupBinConnection::Status::DISCONNECTED);
+    EXPECT_EQ(server.GetConnectionCount(), 0);
+    EXPECT_LT(client.read_all().size(), numMessages);
+}
+
+TEST(SoupBinServerTests, SlowConsumerDropAndReplay)
+{
+    MySoupBinServer server(9012);
+    SoupBinConnection::QueueOptions queueOptions;
+    queueOptions.maxBytes = 256 * 1024;
+    queueOptions.slowConsumerPolicy = SoupBinConnection::QueueOptions::SlowConsumerPolicy::DROP_AND_REPLAY;
+    server.set_queue_options(queueOptions);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    SlowClient client(9012);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    const uint32_t numMessages = 10000;
+    publish_padded(server, numMessages);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    auto stats = server.GetConnection(0)->get_queue_stats();
+    EXPECT_GT(stats.droppedMessages, 0);
+    EXPECT_LE(stats.highWaterBytes, queueOptions.maxBytes);
+    // once the client reads, it gets everything, in order
+    std::vector<std::string> messages = client.read_all();
+    ASSERT_EQ(messages.size(), numMessages);
+    for(uint32_t i = 1; i <= numMessages; ++i)
+    {
+        ASSERT_EQ(messages[i - 1], padded(i));
+    }
+}
+
+TEST(SoupBinServerTests, SlowConsumerSpill)
+{
+    MySoupBinServer server(9012);
+    SoupBinConnection::QueueOptions queueOptions;
+    queueOptions.maxBytes = 256 * 1024;
+    queueOptions.slowConsumerPolicy = SoupBinConnection::QueueOptions::SlowConsumerPolicy::SPILL;
+    server.set_queue_options(queueOptions);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    SlowClient client(9012);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    const uint32_t numMessages = 10000;
+    publish_padded(server, numMessages);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    auto stats = server.GetConnection(0)->get_queue_stats();
+    EXPECT_GT(stats.spilledBytes, 0);
+    EXPECT_LE(stats.highWaterBytes, queueOptions.maxBytes);
+    std::vector<std::string> messages = client.read_all();
+    ASSERT_EQ(messages.size(), numMessages);
+    for(uint32_t i = 1; i <= numMessages; ++i)
+    {
+        ASSERT_EQ(messages[i - 1], padded(i));
+    }
+}
+
+TEST(SoupBinServerTests, SlowConsumerSpillLimit)
+{
+    MySoupBinServer server(9012);
+    SoupBinConnection::QueueOptions queueOptions;
+    queueOptions.maxBytes = 256 * 1024;
+    queueOptions.slowConsumerPolicy = SoupBinConnection::QueueOptions::SlowConsumerPolicy::SPILL;
+    queueOptions.maxSpillBytes = 1024 * 1024; // a tenth of what is published
+    server.set_queue_options(queueOptions);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    SlowClient client(9012);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto conn = server.GetConnection(0);
+    const uint32_t numMessages = 10000;
+    publish_padded(server, numMessages);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    // the file stopped growing at the limit (some of it was read back as the
+    // socket's buffers took it), and the client was let go
+    auto stats = conn->get_queue_stats();
+    EXPECT_GT(stats.spilledBytes, 0);
+    EXPECT_LT(stats.spilledBytes, numMessages * padded(1).size() / 2);
+    EXPECT_EQ(conn->status, SoupBinConnection::Status::DISCONNECTED);
+    EXPECT_LT(client.read_all().size(), numMessages);
+}
+
+TEST(SoupBinServerTests, Shards)
+{
+    for(bool reusePort : { false, true })
+    {
+        SoupBinServerOptions options;
+        options.ioThreads = 4;
+        options.reusePort = reusePort;
+        MySoupBinServer server(9012, options);
+        EXPECT_EQ(server.get_shard_count(), 4);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        std::vector<std::unique_ptr<MySoupBinClient>> clients;
+        for(int i = 0; i < 8; ++i)
+            clients.push_back(std::make_unique<MySoupBinClient>("127.0.0.1:9012", "test1", "password"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        const uint32_t numMessages = 1000;
+        for(uint32_t i = 1; i <= numMessages; ++i)
+            server.send_sequenced(std::string_view("Msg" + std::to_string(i)));
+        server.send_unsequenced(std::string_view("Hello"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        // every session, whatever its shard, sees every message in order
+        for(auto& client : clients)
+        {
+            EXPECT_EQ(client->GetCurrentSequenceNo(), numMessages + 1);
+            EXPECT_EQ(client->GetMessage(1), "Msg1");
+            EXPECT_EQ(client->GetMessage(numMessages), "Msg" + std::to_string(numMessages));
+            EXPECT_EQ(client->connection.numUnsequenced, 1);
+        }
+        clients.clear();
+    }
+}
+
+TEST(SoupBinServerTests, HeartbeatOnlyWhenIdle)
+{
+    MySoupBinServer server(9012);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    MySoupBinClient client("127.0.0.1:9012", "test1", "password");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    // the server streams, the client is idle
+    for(int i = 0; i < 30; ++i)
+    {
+        server.send_sequenced(std::string_view("Hello"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    EXPECT_EQ(client.GetNumServerHeartbeats(), 0);
+    EXPECT_GE(server.GetNumClientHeartbeats(), 2);
+    // once the server goes quiet, the heartbeats start
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    EXPECT_GE(client.GetNumServerHeartbeats(), 1);
+}
+
+TEST(SoupBinServerTests, DeadPeerDisconnect)
+{
+    MySoupBinServer server(9012);
+    SoupBinConnection::HeartbeatOptions heartbeatOptions;
+    heartbeatOptions.deadPeerTimeout = std::chrono::milliseconds(1500);
+    server.set_heartbeat_options(heartbeatOptions);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    // logs in, and then never sends anything
+    SlowClient silent(9012);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    // sends heartbeats
+    MySoupBinClient client("127.0.0.1:9012", "test1", "password");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto silentConn = server.GetConnection(0);
+    auto clientConn = server.GetConnection(1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2300));
+    EXPECT_EQ(silentConn->status, SoupBinConnection::Status::DISCONNECTED);
+    EXPECT_EQ(clientConn->status, SoupBinConnection::Status::CONNECTED);
+    ASSERT_EQ(server.GetConnectionCount(), 1);
+    EXPECT_EQ(server.GetConnection(0), clientConn);
+}
+
+TEST(SoupBinServerTests, ConcurrentPublishers)
+{
+    SoupBinServerOptions options;
+    options.ioThreads = 2;
+    options.publishRingSize = 1024; // small, so the publishers have to wait for it
+    MySoupBinServer server(9012, options);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    MySoupBinClient client1("127.0.0.1:9012", "test1", "password");
+    MySoupBinClient client2("127.0.0.1:9012", "test2", "password");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    const uint32_t numPublishers = 4;
+    const uint32_t perPublisher = 5000;
+    std::vector<std::thread> publishers;
+    for(uint32_t p = 0; p < numPublishers; ++p)
+        publishers.emplace_back([&server, p]() {
+            for(uint32_t n = 0; n < perPublisher; ++n)
+                server.send_sequenced(std::string_view(std::to_string(p) + ":" + std::to_string(n)));
+        });
+    for(auto& publisher : publishers)
+        publisher.join();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    // every message has a sequence number, with no gaps, and each publisher's
+    // messages are in the order it sent them
+    for(MySoupBinClient* client : { &client1, &client2 })
+    {
+        EXPECT_EQ(client->GetCurrentSequenceNo(), numPublishers * perPublisher + 1);
+        std::vector<uint32_t> next(numPublishers, 0);
+        for(uint64_t seq = 1; seq <= numPublishers * perPublisher; ++seq)
+        {
+            std::string msg = client->GetMessage(seq);
+            size_t colon = msg.find(':');
+            ASSERT_NE(colon, std::string::npos);
+            uint32_t p = std::stoul(msg.substr(0, colon));
+            uint32_t n = std::stoul(msg.substr(colon + 1));
+            ASSERT_EQ(n, next[p]);
+            next[p]++;
+        }
+    }
+    // the 2 sessions saw the same sequence
+    EXPECT_EQ(client1.GetMessage(1234), client2.GetMessage(1234));
+}
+
+TEST(SoupBinServerTests, BusyPollClient)
+{
+    MySoupBinServer server(9013);
+    SoupBinConnection::SocketOptions socketOptions;
+    socketOptions.noDelay = true;
+    socketOptions.busyPollMicros = 50; // may not be allowed, which is fine
+    socketOptions.receiveBufferBytes = 1024 * 1024;
+    server.set_socket_options(socketOptions);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    SoupBinConnection::PollOptions pollOptions;
+    pollOptions.mode = SoupBinConnection::PollOptions::Mode::BUSY_POLL;
+    std::shared_ptr<MyConnection> conn;
+    {
+        MyConnection client("127.0.0.1:9013", "test", "password", "", 1, pollOptions);
+        client.set_socket_options(socketOptions);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        EXPECT_EQ(client.status, SoupBinConnection::Status::CONNECTED);
+        for(uint32_t i = 1; i <= 100; ++i)
+            server.send_sequenced(std::string_view("Msg" + std::to_string(i)));
+        client.send_unsequenced(std::string_view("Hello"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        EXPECT_EQ(client.peek_next_seq(), 101);
+        EXPECT_EQ(std::string(client.messages[100].begin(), client.messages[100].end()), "Msg100");
+        EXPECT_EQ(server.GetNumUnsequenced(), 1);
+        conn = server.GetConnection(0);
+    }
+    // the spinning thread stopped with the connection, and the server saw it go
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(conn->status, SoupBinConnection::Status::DISCONNECTED);
+    EXPECT_EQ(server.GetConnectionCount(), 0);
+}
+
+TEST(SoupBinServerTests, SequencedBatch)
+{
+    class BatchConnection : public SoupBinConnection
+    {
+        public:
+        BatchConnection(const std::string& url) : SoupBinConnection(url, "batch", "password", "", 1, false)
+        {
+            set_sequenced_batch(true);
+            connect();
+        }
+        void on_sequenced_batch(std::span<const soupbintcp::sequenced_message> batch) override
+        {
+            for(const soupbintcp::sequenced_message& msg : batch)
+            {
+                auto payload = msg.view.get_message();
+                messages.emplace(msg.seq, std::string(payload.begin(), payload.end()));
+            }
+            numBatches++;
+        }
+        std::unordered_map<uint64_t, std::string> messages;
+        std::atomic<uint32_t> numBatches = 0;
+    };
+
+    MySoupBinServer server(9014);
+    for(uint32_t i = 1; i <= 1000; ++i)
+        server.send_sequenced(std::string_view("Msg" + std::to_string(i)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    // the replay comes in far fewer receives than messages
+    BatchConnection client("127.0.0.1:9014");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(client.peek_next_seq(), 1001);
+    EXPECT_EQ(client.messages.size(), 1000);
+    for(uint64_t seq = 1; seq <= 1000; ++seq)
+        EXPECT_EQ(client.messages[seq], "Msg" + std::to_string(seq));
+    EXPECT_GT(client.numBatches, 0);
+    EXPECT_LT(client.numBatches, 1000);
+    // and live messages carry on from there
+    server.send_sequenced(std::string_view("Live"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(client.messages[1001], "Live");
+    EXPECT_EQ(client.peek_next_seq(), 1002);
+
+    // without its own on_sequenced_batch, each message goes to on_sequenced_data at its number
+    class ForwardedConnection : public SoupBinConnection
+    {
+        public:
+        ForwardedConnection(const std::string& url) : SoupBinConnection(url, "batch", "password", "", 1, false)
+        {
+            set_sequenced_batch(true);
+            connect();
+        }
+        void on_sequenced_data(const soupbintcp::sequenced_data_view& in) override
+        {
+            auto payload = in.get_message();
+            messages.emplace(peek_next_seq(), std::string(payload.begin(), payload.end()));
+        }
+        std::unordered_map<uint64_t, std::string> messages;
+    };
+    ForwardedConnection forwarded("127.0.0.1:9014");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(forwarded.peek_next_seq(), 1002);
+    ASSERT_EQ(forwarded.messages.size(), 1001);
+    EXPECT_EQ(forwarded.messages[1], "Msg1");
+    EXPECT_EQ(forwarded.messages[1001], "Live");
+}
+
+/***
+ * handlers resolved at compile time, on both sides
+ */
+class StaticConnection final : public SoupBinStaticConnection<StaticConnection>
+{
+    public:
+    StaticConnection(boost::asio::ip::tcp::socket socket, MessageRepeater* parent)
+            : SoupBinStaticConnection(std::move(socket), parent) {}
+    StaticConnection(const std::string& url) : SoupBinStaticConnection(url, "static", "password", "", 1, false)
+    {
+        connect();
+    }
+    void on_sequenced_data(const soupbintcp::sequenced_data_view& in)
+    {
+        auto payload = in.get_message();
+        messages.emplace_back(payload.begin(), payload.end());
+    }
+    void on_unsequenced_data(const soupbintcp::unsequenced_data_view& in) { numUnsequenced++; }
+    std::vector<std::string> messages;
+    std::atomic<uint32_t> numUnsequenced = 0;
+};
+
+class StaticServer : public SoupBinServer<StaticConnection>
+{
+    public:
+    StaticServer(uint32_t port) : SoupBinServer(port) {}
+    std::shared_ptr<StaticConnection> GetConnection(size_t i) { return connections[i]; }
+};
+
+TEST(SoupBinServerTests, StaticDispatch)
+{
+    StaticServer server(9015);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    StaticConnection client("127.0.0.1:9015");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    // the base class still handles the login on both sides
+    EXPECT_EQ(client.status, SoupBinConnection::Status::CONNECTED);
+    for(uint32_t i = 1; i <= 100; ++i)
+        server.send_sequenced(std::string_view("Msg" + std::to_string(i)));
+    client.send_unsequenced(std::string_view("Hello"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    ASSERT_EQ(client.messages.size(), 100);
+    EXPECT_EQ(client.messages[99], "Msg100");
+    EXPECT_EQ(server.GetConnection(0)->numUnsequenced, 1);
+}
+
+TEST(SoupBinServerTests, Metrics)
+{
+    std::string path = (std::filesystem::temp_directory_path() / ("soupbin_metrics_" + std::to_string(getpid()))).string();
+    std::filesystem::remove(path);
+    {
+        MySoupBinServer server(9016);
+        for(uint32_t i = 1; i <= 50; ++i)
+            server.send_sequenced(std::string_view("Msg" + std::to_string(i)));
+        server.export_metrics(path, std::chrono::milliseconds(100));
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        MySoupBinClient client1("127.0.0.1:9016", "test1", "password", "", 1); // replays all 50
+        MySoupBinClient client2("127.0.0.1:9016", "test2", "password");
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        for(uint32_t i = 51; i <= 100; ++i)
+            server.send_sequenced(std::string_view("Msg" + std::to_string(i)));
+        server.send_unsequenced(std::string_view("Hello"));
+        client1.connection.send_unsequenced(std::string_view("Hi"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        EXPECT_EQ(client1.GetCurrentSequenceNo(), 101);
+
+        soupbintcp::metrics_snapshot metrics = server.get_metrics();
+        EXPECT_EQ(metrics.sessions, 2);
+        EXPECT_EQ(metrics.publishedSequenced, 100);
+        EXPECT_EQ(metrics.publishedUnsequenced, 1);
+        EXPECT_GT(metrics.publishBatches, 0);
+        EXPECT_EQ(metrics.packetsIn[soupbintcp::packet_type_index('L')], 2);
+        EXPECT_EQ(metrics.packetsIn[soupbintcp::packet_type_index('U')], 1);
+        EXPECT_EQ(metrics.packetsOut[soupbintcp::packet_type_index('A')], 2);
+        EXPECT_EQ(metrics.packetsOut[soupbintcp::packet_type_index('S')], 150); // 100 to client1, 50 to client2
+        EXPECT_EQ(metrics.packetsOut[soupbintcp::packet_type_index('U')], 2);
+        EXPECT_EQ(metrics.replayedMessages, 50);
+        EXPECT_GT(metrics.bytesOut, metrics.replayedBytes);
+        EXPECT_EQ(metrics.queueBytes, 0);
+        EXPECT_EQ(metrics.handlerTime.count, metrics.receives);
+
+        // the client side counts too
+        soupbintcp::metrics_snapshot clientMetrics = client1.connection.get_metrics();
+        EXPECT_EQ(clientMetrics.packetsIn[soupbintcp::packet_type_index('S')], 100);
+        EXPECT_EQ(clientMetrics.packetsIn[soupbintcp::packet_type_index('A')], 1);
+    }
+    // written every 100ms, and once more on the way out
+    std::ifstream in(path);
+    std::string line;
+    std::string last;
+    size_t lines = 0;
+    while(std::getline(in, line))
+    {
+        EXPECT_EQ(line.front(), '{');
+        last = line;
+        lines++;
+    }
+    EXPECT_GT(lines, 5);
+    EXPECT_NE(last.find("\"published_sequenced\":100,"), std::string::npos);
+    std::filesystem::remove(path);
+}
+
+/***
+ * A client that lets the connection track the sequence and reconnect
+ */
+class ReconnectingClient : public SoupBinConnection
+{
+    public:
+    ReconnectingClient(const std::string& url, uint64_t seqNum) : SoupBinConnection(url, "recon", "password", "", seqNum, false)
+    {
+        ReconnectOptions options;
+        options.enabled = true;
+        options.initialBackoff = std::chrono::milliseconds(50);
+        options.maxBackoff = std::chrono::milliseconds(200);
+        set_reconnect_options(options);
+        connect();
+    }
+    void on_sequenced_data(const soupbintcp::sequenced_data_view& in) override
+    {
+        auto payload = in.get_message();
+        messages.emplace(peek_next_seq(), std::string(payload.begin(), payload.end()));
+    }
+    void on_reconnected(std::chrono::milliseconds recoveryTime) override
+    {
+        lastRecoveryMs = recoveryTime.count();
+        numReconnects++;
+    }
+    void on_sequence_gap(uint64_t requested, uint64_t accepted) override
+    {
+        gapRequested = requested;
+        gapAccepted = accepted;
+    }
+    std::map<uint64_t, std::string> messages;
+    std::atomic<uint64_t> lastRecoveryMs = 0;
+    std::atomic<uint32_t> numReconnects = 0;
+    std::atomic<uint64_t> gapRequested = 0;
+    std::atomic<uint64_t> gapAccepted = 0;
+};
+
+TEST(SoupBinServerTests, Reconnect)
+{
+    // the journal lets the second server pick up where the first left off
+    std::string directory = (std::filesystem::temp_directory_path() / ("soupbin_reconnect_" + std::to_string(::getpid()))).string();
+    std::filesystem::remove_all(directory);
+    SoupBinServerOptions options;
+    options.journalDirectory = directory;
+    options.sessionId = "SESSION1";
+    auto server = std::make_unique<MySoupBinServer>(9017, options);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    ReconnectingClient client("127.0.0.1:9017", 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    for(uint32_t i = 1; i <= 10; ++i)
+        server->send_sequenced(std::string_view("Msg" + std::to_string(i)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(client.peek_next_seq(), 11);
+    std::string session = client.get_session_id();
+
+    // the server goes away, and comes back with more messages
+    server.reset();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(client.status, SoupBinConnection::Status::DISCONNECTED);
+    server = std::make_unique<MySoupBinServer>(9017, options);
+    for(uint32_t i = 11; i <= 20; ++i)
+        server->send_sequenced(std::string_view("Msg" + std::to_string(i)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    EXPECT_EQ(client.numReconnects, 1);
+    EXPECT_GE(client.lastRecoveryMs, 500);
+    EXPECT_EQ(client.gapRequested, 0);
+    EXPECT_EQ(client.get_session_id(), session); // asked for the same session again
+    // nothing missed, nothing twice
+    EXPECT_EQ(client.peek_next_seq(), 21);
+    ASSERT_EQ(client.messages.size(), 20);
+    for(uint64_t seq = 1; seq <= 20; ++seq)
+        EXPECT_EQ(client.messages[seq], "Msg" + std::to_string(seq));
+    soupbintcp::metrics_snapshot metrics = client.get_metrics();
+    EXPECT_EQ(metrics.reconnects, 1);
+    EXPECT_EQ(metrics.recoveryTime.count, 1);
+
+    // asking for more than the server has is a gap
+    ReconnectingClient ahead("127.0.0.1:9017", 50);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(ahead.gapRequested, 50);
+    EXPECT_EQ(ahead.gapAccepted, 21);
+    server.reset();
+    std::filesystem::remove_all(directory);
+}
+
+TEST(SoupBinServerTests, SendBeforeLogin)
+{
+    MySoupBinServer server(9025);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    // still connecting, held until the login is accepted
+    MySoupBinClient client("127.0.0.1:9025", "test1", "password");
+    for(int i = 0; i < 3; ++i)
+        EXPECT_TRUE(client.connection.send_unsequenced(std::string_view("Early")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(server.GetNumUnsequenced(), 3);
+    EXPECT_EQ(client.connection.get_queue_stats().unsentMessages, 0);
+}
+
+TEST(SoupBinServerTests, ConnectFailed)
+{
+    class FailingConnection : public SoupBinConnection
+    {
+        public:
+        FailingConnection(const std::string& url) : SoupBinConnection(url, "test1", "password", "", 0, false)
+        {
+            connect();
+        }
+        void on_connect_failed(const std::string& reason) override
+        {
+            std::lock_guard lock(mutex);
+            reasons.push_back(reason);
+        }
+        std::mutex mutex;
+        std::vector<std::string> reasons;
+    };
+    // nothing listens there, and there is no reconnecting
+    FailingConnection client("127.0.0.1:9026");
+    client.send_unsequenced(std::string_view("Held"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    {
+        std::lock_guard lock(client.mutex);
+        ASSERT_EQ(client.reasons.size(), 1);
+        EXPECT_NE(client.reasons[0].find("127.0.0.1:9026"), std::string::npos);
+    }
+    EXPECT_EQ(client.status, SoupBinConnection::Status::DISCONNECTED);
+    EXPECT_FALSE(client.send_unsequenced(std::string_view("Late")));
+    EXPECT_EQ(client.get_queue_stats().unsentMessages, 2);
+}
+
+TEST(SoupBinServerTests, NamedSessions)
+{
+    SoupBinServerOptions options;
+    options.ioThreads = 2;
+    options.sessions = { "FEED1", "FEED2" };
+    MySoupBinServer server(9018, options);
+    EXPECT_EQ(server.get_session_count(), 3);
+    size_t feed1 = server.find_session("FEED1");
+    size_t feed2 = server.find_session("     FEED2"); // padded, as on the wire
+    EXPECT_EQ(feed1, 1);
+    EXPECT_EQ(feed2, 2);
+    EXPECT_EQ(server.find_session("FEED3"), MySoupBinServer::NO_SESSION);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    MySoupBinClient main("127.0.0.1:9018", "test1", "password");
+    MySoupBinClient client1("127.0.0.1:9018", "test1", "password", "FEED1");
+    MySoupBinClient client2("127.0.0.1:9018", "test1", "password", "FEED2");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    // interleaved, each session numbers its own messages
+    for(uint32_t i = 1; i <= 10; ++i)
+    {
+        server.send_sequenced(feed1, std::string_view("One" + std::to_string(i)));
+        if (i <= 5)
+            server.send_sequenced(feed2, std::string_view("Two" + std::to_string(i)));
+        if (i <= 3)
+            server.send_sequenced(std::string_view("Main" + std::to_string(i)));
+    }
+    server.send_unsequenced(feed2, std::string_view("Hello"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(client1.GetSessionId(), "FEED1");
+    EXPECT_EQ(client2.GetSessionId(), "FEED2");
+    EXPECT_EQ(client1.GetCurrentSequenceNo(), 11);
+    EXPECT_EQ(client2.GetCurrentSequenceNo(), 6);
+    EXPECT_EQ(main.GetCurrentSequenceNo(), 4);
+    EXPECT_EQ(client1.GetMessages().size(), 10);
+    EXPECT_EQ(client2.GetMessages().size(), 5);
+    EXPECT_EQ(main.GetMessages().size(), 3);
+    EXPECT_EQ(client1.GetMessage(10), "One10");
+    EXPECT_EQ(client2.GetMessage(1), "Two1");
+    EXPECT_EQ(main.GetMessage(3), "Main3");
+    EXPECT_EQ(client1.connection.numUnsequenced, 0);
+    EXPECT_EQ(client2.connection.numUnsequenced, 1);
+    // a late login replays from its own session's store
+    MySoupBinClient late("127.0.0.1:9018", "test1", "password", "FEED2", 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(late.GetCurrentSequenceNo(), 6);
+    EXPECT_EQ(late.GetMessage(5), "Two5");
+    EXPECT_EQ(late.GetMessages().size(), 5);
+}
+
+TEST(SoupBinServerTests, UnknownSessionRejected)
+{
+    // a default session with a name does not take logins for other sessions
+    SoupBinServerOptions options;
+    options.sessionId = "MAIN";
+    MySoupBinServer server(9019, options);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    MySoupBinClient known("127.0.0.1:9019", "test1", "password", "MAIN");
+    MySoupBinClient unknown("127.0.0.1:9019", "test1", "password", "NOPE");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(known.GetSessionId(), "MAIN");
+    EXPECT_EQ(known.connection.rejectReason, "");
+    EXPECT_EQ(unknown.connection.rejectReason, "S");
+    EXPECT_EQ(unknown.connection.status, SoupBinConnection::Status::DISCONNECTED);
+}
+
+TEST(SoupBinServerTests, UnknownSessionRejectedByUnnamedDefault)
+{
+    // an unnamed default session takes empty session ids, and nothing else
+    MySoupBinServer server(9027);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    MySoupBinClient known("127.0.0.1:9027", "test1", "password");
+    MySoupBinClient unknown("127.0.0.1:9027", "test1", "password", "NOPE");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_EQ(known.GetSessionId(), "");
+    EXPECT_EQ(known.connection.rejectReason, "");
+    EXPECT_EQ(unknown.connection.rejectReason, "S");
+    EXPECT_EQ(unknown.connection.status, SoupBinConnection::Status::DISCONNECTED);
+}
+
+TEST(SoupBinServerTests, PublishToUnknownSession)
+{
+    SoupBinServerOptions options;
+    options.sessions = { "FEED1" };
+    MySoupBinServer server(9028, options);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    MySoupBinClient client("127.0.0.1:9028", "test1", "password", "FEED1");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    size_t missing = server.find_session("FEED2");
+    EXPECT_THROW(server.send_sequenced(missing, "Hello"), std::out_of_range);
+    EXPECT_THROW(server.send_unsequenced(missing, "Hello"), std::out_of_range);
+    EXPECT_THROW(server.send_sequenced(2, "Hello"), std::out_of_range);
+    // nothing went out, and the known session still works
+    server.send_sequenced(server.find_session("FEED1"), "Hello");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(client.GetMessages().size(), 1);
+    EXPECT_EQ(client.GetCurrentSequenceNo(), 2);
+}
+
+TEST(SoupBinServerTests, PublishTooBig)
+{
+    MySoupBinServer server(9031);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    MySoupBinClient client("127.0.0.1:9031", "test1", "password");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    // the length and the packet type share 16 bits
+    std::string largest(UINT16_MAX - 1, 'x');
+    std::string tooBig(UINT16_MAX, 'x');
+    EXPECT_THROW(server.send_sequenced(std::string_view(tooBig)), std::invalid_argument);
+    EXPECT_THROW(server.send_unsequenced(std::string_view(tooBig)), std::invalid_argument);
+    // the server's thread never saw them, and carries on
+    server.send_sequenced(std::string_view(largest));
+    server.send_sequenced(std::string_view("Hello"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(client.GetCurrentSequenceNo(), 3);
+    EXPECT_EQ(client.GetMessage(1), largest);
+    EXPECT_EQ(client.GetMessage(2), "Hello");
+}
+
+TEST(SoupBinServerTests, ShortPacketDisconnects)
+{
+    MySoupBinServer server(9024);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    // a login request that stops after its type
+    boost::asio::io_context io_context;
+    boost::asio::ip::tcp::socket skt(io_context);
+    skt.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 9024));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto conn = server.GetConnection(0);
+    const unsigned char shortLogin[] = { 0, 1, 'L' };
+    boost::asio::write(skt, boost::asio::buffer(shortLogin));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(conn->status, SoupBinConnection::Status::DISCONNECTED);
+    EXPECT_EQ(server.GetConnectionCount(), 0);
+    unsigned char byte;
+    boost::system::error_code ec;
+    skt.read_some(boost::asio::buffer(&byte, 1), ec);
+    EXPECT_EQ(ec, boost::asio::error::eof);
+}
+
+TEST(SoupBinServerTests, ClosedConnectionsLetGo)
+{
+    class CountingServer : public MySoupBinServer
+    {
+        public:
+        CountingServer(uint32_t port, const SoupBinServerOptions& options) : MySoupBinServer(port, options) {}
+        /***
+         * @returns the subscribers of every shard, counted on the shards' threads
+         */
+        size_t GetSubscriberCount()
+        {
+            size_t total = 0;
+            for(Shard& shard : shards)
+            {
+                std::promise<size_t> count;
+                boost::asio::post(*shard.context, [&shard, &count]() {
+                    size_t n = 0;
+                    for(auto& subscribers : shard.subscribers)
+                        n += subscribers.size();
+                    count.set_value(n);
+                });
+                total += count.get_future().get();
+            }
+            return total;
+        }
+    };
+    SoupBinServerOptions options;
+    options.ioThreads = 2;
+    CountingServer server(9030, options);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    MySoupBinClient stays("127.0.0.1:9030", "test1", "password");
+    // clients that come and go leave nothing behind
+    for(int i = 0; i < 5; ++i)
+    {
+        MySoupBinClient passing("127.0.0.1:9030", "test1", "password");
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(server.GetConnectionCount(), 1);
+    EXPECT_EQ(server.GetSubscriberCount(), 1);
+    server.send_sequenced(std::string_view("Hello"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(stays.GetMessage(1), "Hello");
+    // the ones that closed still count
+    soupbintcp::metrics_snapshot metrics = server.get_metrics();
+    EXPECT_EQ(metrics.sessions, 1);
+    EXPECT_EQ(metrics.packetsOut[soupbintcp::packet_type_index('A')], 6);
+}
+
+TEST(SoupBinServerTests, UringTransport)
+{
+    if (!SoupBinUring::is_supported())
+        GTEST_SKIP() << "io_uring is not available here";
+    for(bool sqPoll : { false, true })
+    {
+        SoupBinServerOptions options;
+        options.ioThreads = 2;
+        options.transport.backend = SoupBinConnection::TransportOptions::Backend::IO_URING;
+        options.transport.uring.sqPoll = sqPoll;
+        MySoupBinServer server(9020, options);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        SoupBinConnection::TransportOptions transport = options.transport;
+        std::vector<std::unique_ptr<MyConnection>> clients;
+        clients.push_back(std::make_unique<MyConnection>("127.0.0.1:9020", "test1", "password", "", 0,
+                SoupBinConnection::PollOptions(), transport));
+        SoupBinConnection::PollOptions busyPoll;
+        busyPoll.mode = SoupBinConnection::PollOptions::Mode::BUSY_POLL;
+        clients.push_back(std::make_unique<MyConnection>("127.0.0.1:9020", "test1", "password", "", 0, busyPoll, transport));
+        // an asio client talks to an io_uring server just the same
+        clients.push_back(std::make_unique<MyConnection>("127.0.0.1:9020", "test1", "password", "", 0));
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        const uint32_t numMessages = 5000;
+        for(uint32_t i = 1; i <= numMessages; ++i)
+            server.send_sequenced(std::string_view("Msg" + std::to_string(i)));
+        server.send_unsequenced(std::string_view("Hello"));
+        // a late login replays through the ring
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        clients.push_back(std::make_unique<MyConnection>("127.0.0.1:9020", "test1", "password", "", 1,
+                SoupBinConnection::PollOptions(), transport));
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        EXPECT_TRUE(clients[0]->is_using_uring());
+        EXPECT_TRUE(clients[1]->is_using_uring());
+        EXPECT_FALSE(clients[2]->is_using_uring());
+        EXPECT_TRUE(server.GetConnection(0)->is_using_uring());
+        for(size_t i = 0; i < clients.size(); ++i)
+        {
+            MyConnection& client = *clients[i];
+            EXPECT_EQ(client.peek_next_seq(), numMessages + 1);
+            ASSERT_EQ(client.messages.size(), numMessages);
+            EXPECT_EQ(std::string(client.messages[1].begin(), client.messages[1].end()), "Msg1");
+            EXPECT_EQ(std::string(client.messages[numMessages].begin(), client.messages[numMessages].end()),
+                    "Msg" + std::to_string(numMessages));
+            EXPECT_EQ(client.numUnsequenced, i < 3 ? 1 : 0);
+        }
+        // the client goes away, and so does its session's receive. The server
+        // lets go of the session once the ring is done with it
+        clients.clear();
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        EXPECT_EQ(server.GetConnectionCount(), 0);
+    }
+}
+
+TEST(SoupBinServerTests, SharedMemoryTransport)
+{
+    SoupBinServerOptions options;
+    options.sharedMemory.name = "soupbin-test-" + std::to_string(::getpid());
+    MySoupBinServer server(9021, options);
+    // and one with no ring, for its clients to stay on TCP
+    MySoupBinServer tcpServer(9022);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    SoupBinConnection::TransportOptions transport;
+    transport.backend = SoupBinConnection::TransportOptions::Backend::SHARED_MEMORY;
+    SoupBinConnection::PollOptions busyPoll;
+    busyPoll.mode = SoupBinConnection::PollOptions::Mode::BUSY_POLL;
+    std::vector<std::unique_ptr<MyConnection>> clients;
+    clients.push_back(std::make_unique<MyConnection>("127.0.0.1:9021", "test1", "password", "", 0,
+            SoupBinConnection::PollOptions(), transport));
+    clients.push_back(std::make_unique<MyConnection>("127.0.0.1:9021", "test1", "password", "", 0, busyPoll, transport));
+    clients.push_back(std::make_unique<MyConnection>("127.0.0.1:9021", "test1", "password", "", 0));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    const uint32_t numMessages = 5000;
+    for(uint32_t i = 1; i <= numMessages / 2; ++i)
+        server.send_sequenced(std::string_view("Msg" + std::to_string(i)));
+    // a late login replays over TCP, and switches to the ring once caught up
+    clients.push_back(std::make_unique<MyConnection>("127.0.0.1:9021", "test1", "password", "", 1,
+            SoupBinConnection::PollOptions(), transport));
+    for(uint32_t i = numMessages / 2 + 1; i <= numMessages; ++i)
+        server.send_sequenced(std::string_view("Msg" + std::to_string(i)));
+    // unsequenced data is not replayed, so the late login has to be in first
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    server.send_unsequenced(std::string_view("Hello"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    EXPECT_TRUE(clients[0]->is_using_shared_memory());
+    EXPECT_TRUE(clients[1]->is_using_shared_memory());
+    EXPECT_FALSE(clients[2]->is_using_shared_memory());
+    EXPECT_TRUE(clients[3]->is_using_shared_memory());
+    for(size_t i = 0; i < clients.size(); ++i)
+    {
+        MyConnection& client = *clients[i];
+        ASSERT_EQ(client.messages.size(), numMessages);
+        for(uint32_t seq = 1; seq <= numMessages; ++seq)
+            ASSERT_EQ(std::string(client.messages[seq].begin(), client.messages[seq].end()), "Msg" + std::to_string(seq));
+        // unsequenced data still comes over TCP
+        EXPECT_EQ(client.numUnsequenced, 1);
+    }
+    // the clients that were there from the start got no sequenced data over their sockets
+    size_t fedFromRing = 0;
+    for(size_t i = 0; i < clients.size(); ++i)
+        if (server.GetConnection(i)->get_metrics().packetsOut[soupbintcp::packet_type_index('S')] == 0)
+            fedFromRing++;
+    EXPECT_EQ(fedFromRing, 2);
+
+    // without a ring on offer, the same client reads everything from its socket
+    MyConnection tcpClient("127.0.0.1:9022", "test1", "password", "", 0, SoupBinConnection::PollOptions(), transport);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    for(uint32_t i = 1; i <= 100; ++i)
+        tcpServer.send_sequenced(std::string_view("Msg" + std::to_string(i)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    EXPECT_FALSE(tcpClient.is_using_shared_memory());
+    EXPECT_EQ(tcpClient.messages.size(), 100);
+    clients.clear();
+}
@@ -1,5 +1,11 @@
 #include <gtest/gtest.h>
 #include "soupbintcp.h"
+#include "soup_bin_framing.h"
+#include "soup_bin_buffer_pool.h"
+#include "soup_bin_publish_ring.h"
+#include "soup_bin_metrics.h"
+#include <atomic>
+#include <thread>
 
 TEST(SoupTests, ExtraData)
 {
@@ -13,4 +19,326 @@ TEST(SoupTests, ExtraData)
     const unsigned char* rec = dbg.get_record();
     for(int i = 0; i < 13; ++i)
         EXPECT_EQ( rec[i], expected[i] );
-}
\ No newline at end of file
+}
+TEST(SoupTests, MessageView)
+{
+    std::vector<unsigned char> vec{ 'H', 'e', 'l', 'l', 'o' };
+    soupbintcp::sequenced_data data;
+    data.set_message(vec);
+    soupbintcp::sequenced_data_view view(data.get_record());
+    EXPECT_EQ(view.get_message_type(), 'S');
+    EXPECT_EQ(view.get_record_length(), soupbintcp::SEQUENCED_DATA_LEN + vec.size());
+    EXPECT_EQ(view.get_int(soupbintcp::sequenced_data::PACKET_LENGTH), soupbintcp::SEQUENCED_DATA_LEN - 2 + vec.size());
+    auto payload = view.get_message();
+    ASSERT_EQ(payload.size(), vec.size());
+    // the payload is not a copy
+    EXPECT_EQ(payload.data(), data.get_record() + soupbintcp::SEQUENCED_DATA_LEN);
+    EXPECT_TRUE(std::equal(payload.begin(), payload.end(), vec.begin()));
+
+    soupbintcp::login_accepted accepted;
+    accepted.set_string(soupbintcp::login_accepted::SESSION, "SESSION1");
+    accepted.set_int(soupbintcp::login_accepted::SEQUENCE_NUMBER, 42);
+    soupbintcp::login_accepted_view acceptedView(accepted.get_record());
+    EXPECT_EQ(acceptedView.get_string(soupbintcp::login_accepted::SESSION), "SESSION1");
+    EXPECT_EQ(acceptedView.get_int(soupbintcp::login_accepted::SEQUENCE_NUMBER), 42);
+    EXPECT_TRUE(acceptedView.get_message().empty());
+}
+
+TEST(SoupTests, CompileTimeFields)
+{
+    // fixed size packets keep their record inline
+    soupbintcp::login_request req;
+    const unsigned char* rec = req.get_record();
+    EXPECT_TRUE(rec >= (const unsigned char*)&req && rec < (const unsigned char*)&req + sizeof(req));
+    EXPECT_EQ(req.get_record_length(), soupbintcp::LOGIN_REQUEST_LEN);
+    req.set_string<soupbintcp::login_request::USERNAME>("user1");
+    req.set_int<soupbintcp::login_request::REQUESTED_SEQUENCE_NUMBER>(12345);
+    EXPECT_EQ(req.get_string<soupbintcp::login_request::USERNAME>(), "user1");
+    EXPECT_EQ(req.get_int<soupbintcp::login_request::REQUESTED_SEQUENCE_NUMBER>(), 12345);
+    EXPECT_EQ(req.get_int(soupbintcp::login_request::REQUESTED_SEQUENCE_NUMBER), 12345);
+    EXPECT_EQ(req.get_int<soupbintcp::login_request::PACKET_LENGTH>(), soupbintcp::LOGIN_REQUEST_LEN - 2);
+
+    // copies and moves keep the inline storage their own
+    soupbintcp::login_request copy(req);
+    EXPECT_NE(copy.get_record(), req.get_record());
+    EXPECT_EQ(copy.get_record_as_vec(), req.get_record_as_vec());
+    soupbintcp::login_request moved(std::move(copy));
+    EXPECT_EQ(moved.get_int<soupbintcp::login_request::REQUESTED_SEQUENCE_NUMBER>(), 12345);
+
+    // INTEGER fields are big endian, including 1 byte fields
+    static constexpr soupbintcp::message_record ONE_BYTE{3, 1, soupbintcp::message_record::field_type::INTEGER};
+    soupbintcp::login_rejected rej;
+    rej.set_int<ONE_BYTE>(200);
+    EXPECT_EQ(rej.get_int<ONE_BYTE>(), 200);
+    EXPECT_EQ(rej.get_int(ONE_BYTE), 200);
+    EXPECT_EQ(rej.get_raw_byte(3), 200);
+    soupbintcp::sequenced_data data;
+    data.set_message(std::vector<unsigned char>(300, 'x'));
+    EXPECT_EQ(data.get_raw_byte(0), 0x01);
+    EXPECT_EQ(data.get_raw_byte(1), 0x2D);
+    data.set_int<soupbintcp::sequenced_data::PACKET_LENGTH>(0x0102);
+    EXPECT_EQ(data.get_raw_byte(0), 0x01);
+    EXPECT_EQ(data.get_raw_byte(1), 0x02);
+}
+
+TEST(SoupTests, NumericCodec)
+{
+    unsigned char buf[20];
+    // right justified, space padded
+    EXPECT_TRUE(soupbintcp::encode_numeric(buf, 20, 12345));
+    EXPECT_EQ(std::string((char*)buf, 20), "               12345");
+    EXPECT_TRUE(soupbintcp::encode_numeric(buf, 20, 0));
+    EXPECT_EQ(std::string((char*)buf, 20), "                   0");
+    EXPECT_TRUE(soupbintcp::encode_numeric(buf, 20, 42, '0'));
+    EXPECT_EQ(std::string((char*)buf, 20), "00000000000000000042");
+    EXPECT_TRUE(soupbintcp::encode_numeric(buf, 20, UINT64_MAX));
+    EXPECT_EQ(std::string((char*)buf, 20), "18446744073709551615");
+    EXPECT_FALSE(soupbintcp::encode_numeric(buf, 4, 12345));
+
+    // every width of number round trips
+    uint64_t val = 0;
+    for(uint64_t in = 1; in != 0 && in < UINT64_MAX / 10; in = in * 10 + 7)
+    {
+        ASSERT_TRUE(soupbintcp::encode_numeric(buf, 20, in));
+        ASSERT_TRUE(soupbintcp::decode_numeric(buf, 20, val));
+        EXPECT_EQ(val, in);
+    }
+
+    auto decode = [](const std::string& in, uint64_t& out) {
+        return soupbintcp::decode_numeric((const unsigned char*)in.data(), in.size(), out);
+    };
+    EXPECT_TRUE(decode("00000000000000000042", val));
+    EXPECT_EQ(val, 42);
+    EXPECT_TRUE(decode(std::string(20, ' '), val));
+    EXPECT_EQ(val, 0);
+    EXPECT_TRUE(decode(std::string(20, '\0'), val));
+    EXPECT_EQ(val, 0);
+    EXPECT_TRUE(decode("18446744073709551615", val));
+    EXPECT_EQ(val, UINT64_MAX);
+    // overflow
+    EXPECT_FALSE(decode("18446744073709551616", val));
+    EXPECT_FALSE(decode("99999999999999999999", val));
+    // junk
+    EXPECT_FALSE(decode("            12a45", val));
+    EXPECT_FALSE(decode("  12 345", val));
+    EXPECT_FALSE(decode("        -1", val));
+
+    // the packets use the codec
+    soupbintcp::login_accepted msg;
+    msg.set_int<soupbintcp::login_accepted::SEQUENCE_NUMBER>(987654321);
+    EXPECT_EQ(msg.get_string(soupbintcp::login_accepted::SEQUENCE_NUMBER), "           987654321");
+    EXPECT_EQ(msg.get_int(soupbintcp::login_accepted::SEQUENCE_NUMBER), 987654321);
+    EXPECT_THROW(msg.set_int(soupbintcp::login_accepted::SEQUENCE_NUMBER, -1), std::out_of_range);
+}
+
+TEST(SoupTests, Framing)
+{
+    std::string payload = "Hello";
+    soupbintcp::buffer_slice frame = soupbintcp::make_frame('S', soupbintcp::as_uchars(payload));
+    ASSERT_EQ(frame.size(), soupbintcp::HEADER_LEN + payload.size());
+    EXPECT_EQ(frame.data()[0], 0);
+    EXPECT_EQ(frame.data()[1], payload.size() + 1);
+    EXPECT_EQ(frame.data()[2], 'S');
+    EXPECT_EQ(std::string(frame.data() + soupbintcp::HEADER_LEN, frame.data() + frame.size()), payload);
+    // framing by hand matches framing with message<SIZE>
+    soupbintcp::sequenced_data data;
+    data.set_message(std::vector<unsigned char>(payload.begin(), payload.end()));
+    soupbintcp::buffer_slice copied = soupbintcp::make_frame(data.get_record_span());
+    EXPECT_TRUE(std::equal(frame.data(), frame.data() + frame.size(), copied.data(), copied.data() + copied.size()));
+    // copies share the bytes
+    soupbintcp::buffer_slice shared = frame;
+    EXPECT_EQ(shared.data(), frame.data());
+    EXPECT_EQ(shared.owner.get(), frame.owner.get());
+}
+
+TEST(SoupTests, BufferPool)
+{
+    soupbintcp::buffer_pool& pool = soupbintcp::buffer_pool::local();
+    std::string payload(100, 'x');
+    const unsigned char* first;
+    {
+        soupbintcp::buffer_slice frame = soupbintcp::make_frame('U', soupbintcp::as_uchars(payload));
+        first = frame.data();
+    }
+    // a frame that went comes back for the next one of its size
+    uint64_t allocations = pool.get_heap_allocations();
+    for(int i = 0; i < 1000; ++i)
+    {
+        soupbintcp::buffer_slice frame = soupbintcp::make_frame('U', soupbintcp::as_uchars(payload));
+        EXPECT_EQ(frame.data(), first);
+    }
+    EXPECT_EQ(pool.get_heap_allocations(), allocations);
+
+    // frames let go of on another thread find their way back too
+    std::vector<soupbintcp::buffer_slice> frames;
+    for(int i = 0; i < 100; ++i)
+        frames.push_back(soupbintcp::make_frame('U', soupbintcp::as_uchars(payload)));
+    allocations = pool.get_heap_allocations();
+    std::thread other([&frames]() { frames.clear(); });
+    other.join();
+    for(int i = 0; i < 100; ++i)
+        frames.push_back(soupbintcp::make_frame('U', soupbintcp::as_uchars(payload)));
+    EXPECT_EQ(pool.get_heap_allocations(), allocations);
+
+    // and a frame can outlive the thread that made it
+    soupbintcp::buffer_slice orphan;
+    std::thread maker([&orphan, &payload]() { orphan = soupbintcp::make_frame('U', soupbintcp::as_uchars(payload)); });
+    maker.join();
+    EXPECT_EQ(orphan.data()[2], 'U');
+    orphan = soupbintcp::buffer_slice();
+
+    // frames given back on one thread while the thread that made them goes
+    for(int round = 0; round < 50; ++round)
+    {
+        std::vector<soupbintcp::buffer_slice> made;
+        std::atomic<bool> ready = false;
+        std::thread giver([&made, &ready]() {
+            while(!ready.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            made.clear();
+        });
+        std::thread maker([&made, &ready, &payload]() {
+            for(int i = 0; i < 100; ++i)
+                made.push_back(soupbintcp::make_frame('U', soupbintcp::as_uchars(payload)));
+            ready.store(true, std::memory_order_release);
+        });
+        maker.join();
+        giver.join();
+    }
+}
+
+TEST(SoupTests, ReceiveBuffer)
+{
+    // three packets arrive in two reads, the second packet split between them
+    std::vector<unsigned char> stream;
+    for(std::string payload : { "one", "two", "three" })
+    {
+        soupbintcp::sequenced_data data;
+        data.set_message(std::vector<unsigned char>(payload.begin(), payload.end()));
+        auto rec = data.get_record_as_vec();
+        stream.insert(stream.end(), rec.begin(), rec.end());
+    }
+    size_t split = 9; // the first packet is 6 bytes long
+    soupbintcp::receive_buffer buffer;
+    auto space = buffer.free_space();
+    ASSERT_GE(space.size(), soupbintcp::receive_buffer::MAX_PACKET_LEN);
+    memcpy(space.data(), stream.data(), split);
+    buffer.commit(split);
+    const unsigned char* packet = buffer.next_packet();
+    ASSERT_NE(packet, nullptr);
+    auto payload = soupbintcp::sequenced_data_view(packet).get_message();
+    EXPECT_EQ(std::string(payload.begin(), payload.end()), "one");
+    EXPECT_EQ(buffer.next_packet(), nullptr);
+    buffer.compact();
+
+    space = buffer.free_space();
+    memcpy(space.data(), stream.data() + split, stream.size() - split);
+    buffer.commit(stream.size() - split);
+    std::vector<std::string> received;
+    while(const unsigned char* p = buffer.next_packet())
+    {
+        auto pl = soupbintcp::sequenced_data_view(p).get_message();
+        received.emplace_back(pl.begin(), pl.end());
+    }
+    EXPECT_EQ(received, std::vector<std::string>({ "two", "three" }));
+    EXPECT_FALSE(buffer.is_corrupt());
+    buffer.compact();
+    EXPECT_EQ(buffer.free_space().size(), 2 * soupbintcp::receive_buffer::MAX_PACKET_LEN);
+
+    // a zero length can never be framed
+    unsigned char bad[] = { 0, 0, 'S' };
+    memcpy(buffer.free_space().data(), bad, sizeof(bad));
+    buffer.commit(sizeof(bad));
+    EXPECT_EQ(buffer.next_packet(), nullptr);
+    EXPECT_TRUE(buffer.is_corrupt());
+}
+
+TEST(SoupTests, PublishRing)
+{
+    SoupBinPublishRing ring(64);
+    EXPECT_TRUE(ring.empty());
+    // fill it, small and big messages
+    std::string big(SoupBinPublishRing::INLINE_BYTES + 1, 'B');
+    for(size_t i = 0; i < ring.capacity(); ++i)
+        EXPECT_TRUE(ring.try_push('S', soupbintcp::as_uchars(i % 2 == 0 ? std::string_view("small") : std::string_view(big))));
+    EXPECT_FALSE(ring.try_push('S', soupbintcp::as_uchars(std::string_view("full"))));
+    size_t i = 0;
+    EXPECT_EQ(ring.drain(1000, [&i, &big](char packetType, std::span<const unsigned char> body) {
+        EXPECT_EQ(packetType, 'S');
+        EXPECT_EQ(std::string(body.begin(), body.end()), i % 2 == 0 ? "small" : big);
+        i++;
+    }), ring.capacity());
+    EXPECT_TRUE(ring.empty());
+
+    // many producers, 1 consumer, nothing lost and each producer in order
+    const size_t numProducers = 4;
+    const uint32_t perProducer = 20000;
+    std::vector<std::thread> producers;
+    for(size_t p = 0; p < numProducers; ++p)
+        producers.emplace_back([&ring, p]() {
+            for(uint32_t n = 0; n < perProducer; ++n)
+            {
+                uint32_t msg[2] = { (uint32_t)p, n };
+                ring.push('U', std::span<const unsigned char>((const unsigned char*)msg, sizeof(msg)));
+            }
+        });
+    std::vector<uint32_t> next(numProducers, 0);
+    size_t total = 0;
+    bool inOrder = true;
+    while(total < numProducers * perProducer)
+    {
+        size_t count = ring.drain(256, [&next, &inOrder](char /* packetType */, std::span<const unsigned char> body) {
+            uint32_t msg[2];
+            memcpy(msg, body.data(), sizeof(msg));
+            if (msg[1] != next[msg[0]])
+                inOrder = false;
+            next[msg[0]] = msg[1] + 1;
+        });
+        // let the producers have the core
+        if (count == 0)
+            std::this_thread::yield();
+        total += count;
+    }
+    for(auto& producer : producers)
+        producer.join();
+    EXPECT_TRUE(inOrder);
+    EXPECT_TRUE(ring.empty());
+    for(size_t p = 0; p < numProducers; ++p)
+        EXPECT_EQ(next[p], perProducer);
+}
+
+TEST(SoupTests, Metrics)
+{
+    soupbintcp::latency_histogram histogram;
+    for(uint64_t i = 0; i < 98; ++i)
+        histogram.record(100); // bucket of 64 to 127
+    histogram.record(5000);
+    histogram.record(1000000);
+    soupbintcp::histogram_snapshot snapshot = histogram.snapshot();
+    EXPECT_EQ(snapshot.count, 100);
+    EXPECT_EQ(snapshot.maxNs, 1000000);
+    EXPECT_EQ(snapshot.percentile(0.5), 127);
+    EXPECT_EQ(snapshot.percentile(0.99), 8191);
+    EXPECT_EQ(snapshot.percentile(1.0), 1000000);
+
+    soupbintcp::metrics_snapshot a;
+    a.sessions = 1;
+    a.packetsIn[soupbintcp::packet_type_index('S')] = 10;
+    a.queueHighWaterBytes = 100;
+    a.handlerTime = snapshot;
+    soupbintcp::metrics_snapshot b = a;
+    b.queueHighWaterBytes = 50;
+    b.packetsIn[soupbintcp::packet_type_index('x')] = 1;
+    a.add(b);
+    EXPECT_EQ(a.sessions, 2);
+    EXPECT_EQ(a.packetsIn[soupbintcp::packet_type_index('S')], 20);
+    EXPECT_EQ(a.packetsIn[soupbintcp::packet_type_index('?')], 1);
+    EXPECT_EQ(a.queueHighWaterBytes, 100);
+    EXPECT_EQ(a.handlerTime.count, 200);
+    std::string json = a.to_json();
+    EXPECT_NE(json.find("\"sessions\":2,"), std::string::npos);
+    EXPECT_NE(json.find("\"packets_in\":{\"+\":0,\"A\":0,\"J\":0,\"S\":20,"), std::string::npos);
+    EXPECT_NE(json.find("\"p50_ns\":127,"), std::string::npos);
+    EXPECT_EQ(json.back(), '}');
+    EXPECT_NE(a.to_text().find("packets_in{type=\"S\"} 20\n"), std::string::npos);
+}